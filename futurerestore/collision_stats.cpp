@@ -0,0 +1,56 @@
+//
+//  collision_stats.cpp
+//  futurerestore
+//
+
+#include <stdio.h>
+#include <algorithm>
+#include "collision_stats.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+const double collision_stats::bucketBounds[collision_stats::bucketCount - 1] = {2, 3, 4, 5, 7, 10, 15};
+
+collision_stats::collision_stats()
+        : _start(std::chrono::steady_clock::now()), _attempts(0), _totalLatency(0), _minLatency(0), _maxLatency(0),
+          _histogram() {}
+
+void collision_stats::addAttempt(double rebootLatency) {
+    size_t bucket = std::upper_bound(bucketBounds, bucketBounds + bucketCount - 1, rebootLatency) - bucketBounds;
+    _histogram[bucket]++;
+    if (!_attempts || rebootLatency < _minLatency) _minLatency = rebootLatency;
+    if (!_attempts || rebootLatency > _maxLatency) _maxLatency = rebootLatency;
+    _totalLatency += rebootLatency;
+    _attempts++;
+}
+
+double collision_stats::attemptsPerMinute() const {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    return (elapsed > 0) ? _attempts * 60 / elapsed : 0;
+}
+
+void collision_stats::printProgress(const char *prefix) const {
+    info("%s attempt %zu, %.1f attempts/min, avg reboot %.2fs (min %.2fs, max %.2fs)\n", prefix, _attempts,
+         attemptsPerMinute(), averageLatency(), _minLatency, _maxLatency);
+}
+
+void collision_stats::printHistogram(const char *prefix) const {
+    if (!_attempts) return;
+    size_t peak = *std::max_element(_histogram.begin(), _histogram.end());
+    info("%s reboot latency over %zu attempts:\n", prefix, _attempts);
+    for (size_t i = 0; i < bucketCount; i++) {
+        char label[32];
+        if (i == 0)
+            snprintf(label, sizeof(label), "     < %4.1fs", bucketBounds[0]);
+        else if (i == bucketCount - 1)
+            snprintf(label, sizeof(label), "    >= %4.1fs", bucketBounds[i - 1]);
+        else
+            snprintf(label, sizeof(label), "%4.1f - %4.1fs", bucketBounds[i - 1], bucketBounds[i]);
+        char bar[41] = {};
+        size_t len = peak ? (_histogram[i] * 40 + peak - 1) / peak : 0;
+        for (size_t j = 0; j < len; j++) bar[j] = '#';
+        info("%s   %s %6zu %s\n", prefix, label, _histogram[i], bar);
+    }
+}
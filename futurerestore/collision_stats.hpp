@@ -0,0 +1,45 @@
+//
+//  collision_stats.hpp
+//  futurerestore
+//
+
+#ifndef collision_stats_hpp
+#define collision_stats_hpp
+
+#include <stddef.h>
+#include <array>
+#include <chrono>
+
+/*
+ * Throughput bookkeeping for the ApNonce collision loop.
+ * Every attempt records how long the device took from reset until it was back in recovery mode.
+ */
+class collision_stats {
+public:
+    static const size_t bucketCount = 8;
+
+private:
+    std::chrono::steady_clock::time_point _start;
+    size_t _attempts;
+    double _totalLatency;
+    double _minLatency;
+    double _maxLatency;
+    std::array<size_t, bucketCount> _histogram;
+
+public:
+    //upper bounds (in seconds) of all but the last bucket
+    static const double bucketBounds[bucketCount - 1];
+
+    collision_stats();
+
+    void addAttempt(double rebootLatency);
+
+    size_t attempts() const {return _attempts;}
+    double attemptsPerMinute() const;
+    double averageLatency() const {return _attempts ? _totalLatency / _attempts : 0;}
+
+    void printProgress(const char *prefix) const;
+    void printHistogram(const char *prefix) const;
+};
+
+#endif /* collision_stats_hpp */
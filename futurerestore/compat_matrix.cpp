@@ -0,0 +1,203 @@
+//
+//  compat_matrix.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <libgen.h>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include "compat_matrix.hpp"
+#include "futurerestore.hpp"
+#include "im4m_matcher.hpp"
+#include "threadpool.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static std::string getStringVal(plist_t dict, const char *key) {
+    std::string ret;
+    char *str = nullptr;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &str);
+    if (str) ret = str;
+    safeFree(str);
+    return ret;
+}
+
+static std::string getDataVal(plist_t dict, const char *key) {
+    std::string ret;
+    char *data = nullptr;
+    uint64_t dataSize = 0;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node && plist_get_node_type(node) == PLIST_DATA) plist_get_data_val(node, &data, &dataSize);
+    if (data) ret.assign(data, (size_t) dataSize);
+    safeFree(data);
+    return ret;
+}
+
+static std::string getBasename(const std::string &path) {
+    char *tmp = strdup(path.c_str());
+    std::string ret = basename(tmp);
+    free(tmp);
+    return ret;
+}
+
+static std::string getErrorString(tihmstar::exception &e) {
+    std::string ret = e.what();
+    ret.erase(ret.find_last_not_of('\n') + 1);
+    return ret;
+}
+
+compat_matrix::compat_matrix(const std::vector<std::string> &ipswPaths, const std::vector<std::string> &ticketPaths)
+        : _elapsed(0) {
+    for (auto &path: ipswPaths) {
+        _ipsws.push_back({path, nullptr, "", "", ""});
+    }
+    for (auto &path: ticketPaths) {
+        _tickets.push_back({path, "", false, "", ""});
+    }
+}
+
+compat_matrix::~compat_matrix() {
+    for (auto &i: _ipsws) {
+        safeFreeCustom(i.buildmanifest, plist_free);
+    }
+}
+
+void compat_matrix::loadManifests() {
+    threadpool::shared().parallelFor(_ipsws.size(), [&](size_t i) {
+        auto &ipsw = _ipsws[i];
+        try {
+            ipsw.buildmanifest = futurerestore::loadBuildManifest(ipsw.path.c_str());
+        } catch (tihmstar::exception &e) {
+            ipsw.error = "failed to read BuildManifest";
+            return;
+        }
+        ipsw.version = getStringVal(ipsw.buildmanifest, "ProductVersion");
+        ipsw.buildVersion = getStringVal(ipsw.buildmanifest, "ProductBuildVersion");
+    });
+}
+
+void compat_matrix::loadTickets() {
+    threadpool::shared().parallelFor(_tickets.size(), [&](size_t i) {
+        auto &t = _tickets[i];
+        plist_t apticket = nullptr;
+        cleanup([&] {
+            safeFreeCustom(apticket, plist_free);
+        });
+        try {
+            apticket = futurerestore::loadAPTicketFile(t.path.c_str());
+        } catch (tihmstar::exception &e) {
+            t.error = getErrorString(e);
+            return;
+        }
+        //same selection loadAPTickets does for -u
+        t.image4 = plist_dict_get_item(apticket, "ApImg4Ticket") != nullptr;
+        const char *key = t.image4 ? "ApImg4Ticket" : "APTicket";
+        t.erase = getDataVal(apticket, key);
+        plist_t update = plist_dict_get_item(apticket, "updateInstall");
+        t.update = update ? getDataVal(update, key) : t.erase;
+        if (t.erase.empty() && t.update.empty()) t.error = "no signing ticket in file";
+    });
+}
+
+void compat_matrix::score() {
+    std::vector<std::unique_ptr<im4m_matcher>> matchers(_ipsws.size());
+    threadpool::shared().parallelFor(_ipsws.size(), [&](size_t i) {
+        if (!_ipsws[i].buildmanifest) return;
+        try {
+            matchers[i].reset(new im4m_matcher(_ipsws[i].buildmanifest));
+        } catch (tihmstar::exception &e) {
+            _ipsws[i].error = getErrorString(e);
+        }
+    });
+
+    auto scoreTicket = [&](const ticket &t, size_t i, const std::string &im4m, const char *behavior) -> verdict {
+        if (im4m.empty() || !matchers[i]) return verdict_none;
+        if (t.image4) {
+            auto m = matchers[i]->matchIM4M(im4m.data(), im4m.size(), behavior);
+            return m.exact ? verdict_exact : (m.fallback ? verdict_fallback : verdict_none);
+        }
+        //32-bit tickets can only be checked against the restore ramdisk, like doRestore does
+        auto hash = futurerestore::getRamdiskHashFromSCAB(im4m.data(), im4m.size());
+        plist_t identities = plist_dict_get_item(_ipsws[i].buildmanifest, "BuildIdentities");
+        for (uint32_t j = 0; j < plist_array_get_size(identities); j++) {
+            plist_t identity = plist_array_get_item(identities, j);
+            if (im4m_matcher::getRestoreBehavior(identity) != behavior) continue;
+            plist_t ramdisk = plist_dict_get_item(plist_dict_get_item(identity, "Manifest"), "RestoreRamDisk");
+            std::string digest = getDataVal(ramdisk, "Digest");
+            if (digest.size() == hash.second && !memcmp(digest.data(), hash.first, hash.second)) return verdict_exact;
+        }
+        return verdict_none;
+    };
+
+    _cells.assign(_tickets.size() * _ipsws.size(), {verdict_none, verdict_none});
+    threadpool::shared().parallelFor(_cells.size(), [&](size_t c) {
+        auto &t = _tickets[c / _ipsws.size()];
+        size_t i = c % _ipsws.size();
+        if (!t.error.empty()) return;
+        try {
+            _cells[c].erase = scoreTicket(t, i, t.erase, "Erase");
+            _cells[c].update = scoreTicket(t, i, t.update, "Update");
+        } catch (tihmstar::exception &e) {
+            debug("[COMPAT] failed to score %s against %s: %s", t.path.c_str(), _ipsws[i].path.c_str(), e.what());
+        }
+    });
+}
+
+void compat_matrix::build() {
+    auto start = std::chrono::steady_clock::now();
+    loadManifests();
+    loadTickets();
+    score();
+    _elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+compat_matrix::verdict compat_matrix::get(size_t ticket, size_t ipsw, bool update) const {
+    retassure(ticket < _tickets.size() && ipsw < _ipsws.size() && _cells.size() == _tickets.size() * _ipsws.size(),
+              "compat matrix index out of bounds\n");
+    auto &c = _cells[ticket * _ipsws.size() + ipsw];
+    return update ? c.update : c.erase;
+}
+
+void compat_matrix::print(FILE *out) const {
+    static const char eraseChars[] = {'-', 'e', 'E'};
+    static const char updateChars[] = {'-', 'u', 'U'};
+
+    fprintf(out, "E/U: valid for Erase/Update, e/u: only when ignoring the restore ramdisk, -: not valid\n\n");
+    for (size_t i = 0; i < _ipsws.size(); i++) {
+        auto &ipsw = _ipsws[i];
+        if (ipsw.error.empty()) {
+            fprintf(out, "  [%zu] %s (%s) %s\n", i, ipsw.version.c_str(), ipsw.buildVersion.c_str(), ipsw.path.c_str());
+        } else {
+            fprintf(out, "  [%zu] %s: %s\n", i, ipsw.path.c_str(), ipsw.error.c_str());
+        }
+    }
+    fputc('\n', out);
+
+    size_t nameWidth = 6;
+    for (auto &t: _tickets) nameWidth = std::max(nameWidth, getBasename(t.path).size());
+    fprintf(out, "%-*s", (int) nameWidth, "ticket");
+    for (size_t i = 0; i < _ipsws.size(); i++) fprintf(out, " %4zu", i);
+    fputc('\n', out);
+
+    for (size_t t = 0; t < _tickets.size(); t++) {
+        fprintf(out, "%-*s", (int) nameWidth, getBasename(_tickets[t].path).c_str());
+        if (!_tickets[t].error.empty()) {
+            fprintf(out, "  %s\n", _tickets[t].error.c_str());
+            continue;
+        }
+        for (size_t i = 0; i < _ipsws.size(); i++) {
+            auto &c = _cells[t * _ipsws.size() + i];
+            fprintf(out, "   %c%c", eraseChars[c.erase], updateChars[c.update]);
+        }
+        fputc('\n', out);
+    }
+    fprintf(out, "\nscored %zu combinations in %.2f seconds\n", _cells.size() * 2, _elapsed);
+}
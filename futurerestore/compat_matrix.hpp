@@ -0,0 +1,68 @@
+//
+//  compat_matrix.hpp
+//  futurerestore
+//
+
+#ifndef compat_matrix_hpp
+#define compat_matrix_hpp
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <plist/plist.h>
+
+/*
+ * Which APTicket works with which IPSW, for both install types.
+ * Only the BuildManifests are read from the IPSWs, every (ticket, IPSW) pair is then scored on the shared
+ * threadpool with the same checks doRestore applies: the build identity match for IMG4 tickets, the
+ * ramdisk hash for 32-bit ones.
+ */
+class compat_matrix {
+public:
+    enum verdict {
+        verdict_none,
+        verdict_fallback,   //only matches when ignoring RestoreRamDisk/RestoreTrustCache
+        verdict_exact
+    };
+
+private:
+    struct ticket {
+        std::string path;
+        std::string error;
+        bool image4;
+        std::string erase;  //IM4M or SCAB
+        std::string update;
+    };
+    struct ipsw {
+        std::string path;
+        plist_t buildmanifest;
+        std::string version;
+        std::string buildVersion;
+        std::string error;
+    };
+    struct cell {
+        verdict erase;
+        verdict update;
+    };
+
+    std::vector<ticket> _tickets;
+    std::vector<ipsw> _ipsws;
+    std::vector<cell> _cells; //_tickets.size() rows of _ipsws.size() cells
+    double _elapsed;
+
+    void loadManifests();
+    void loadTickets();
+    void score();
+
+public:
+    compat_matrix(const std::vector<std::string> &ipswPaths, const std::vector<std::string> &ticketPaths);
+    compat_matrix(const compat_matrix &) = delete;
+    compat_matrix &operator=(const compat_matrix &) = delete;
+    ~compat_matrix();
+
+    void build();
+    verdict get(size_t ticket, size_t ipsw, bool update) const;
+    void print(FILE *out = stdout) const;
+};
+
+#endif /* compat_matrix_hpp */
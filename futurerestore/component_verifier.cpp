@@ -0,0 +1,208 @@
+//
+//  component_verifier.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include "component_verifier.hpp"
+#include "threadpool.hpp"
+#include "private_dir.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA384(d, n, md) CC_SHA384(d, n, md)
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static std::string toHex(const std::string &data) {
+    static const char digits[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(data.size() * 2);
+    for (unsigned char c: data) {
+        ret += digits[c >> 4];
+        ret += digits[c & 0xf];
+    }
+    return ret;
+}
+
+static std::string fromHex(const std::string &hex) {
+    std::string ret;
+    if (hex.size() % 2) return ret;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        ret += (char) strtoul(hex.substr(i, 2).c_str(), nullptr, 16);
+    }
+    return ret;
+}
+
+#pragma mark digest_cache
+
+digest_cache::digest_cache(std::string path) : _path(std::move(path)), _dirty(false), _trusted(false) {
+    char *dir = strdup(_path.c_str());
+    _trusted = private_dir::prepare(dirname(dir)) && private_dir::isTrusted(_path);
+    free(dir);
+    if (!_trusted) return;
+    std::ifstream cacheStream(_path);
+    std::string line;
+    while (std::getline(cacheStream, line)) {
+        std::istringstream ls(line);
+        size_t digestSize = 0;
+        record rec{};
+        std::string hex;
+        std::string file;
+        if (!(ls >> digestSize >> rec.size >> rec.mtime >> hex) || ls.get() != ' ' || !std::getline(ls, file))
+            continue;
+        rec.digest = fromHex(hex);
+        if (rec.digest.size() != digestSize) continue;
+        _records[makeKey(file, digestSize)] = rec;
+    }
+}
+
+std::string digest_cache::makeKey(const std::string &file, size_t digestSize) {
+    std::string path = file;
+#ifndef WIN32
+    if (char *real = realpath(file.c_str(), nullptr)) {
+        path = real;
+        free(real);
+    }
+#endif
+    return std::to_string(digestSize) + " " + path;
+}
+
+bool digest_cache::lookup(const std::string &file, const struct stat &st, size_t digestSize, std::string &digest) {
+    std::string key = makeKey(file, digestSize);
+    std::unique_lock<std::mutex> ul(_lock);
+    auto it = _records.find(key);
+    if (it == _records.end() || it->second.size != (uint64_t) st.st_size || it->second.mtime != (int64_t) st.st_mtime)
+        return false;
+    digest = it->second.digest;
+    return true;
+}
+
+void digest_cache::store(const std::string &file, const struct stat &st, const std::string &digest) {
+    std::string key = makeKey(file, digest.size());
+    std::unique_lock<std::mutex> ul(_lock);
+    _records[key] = {(uint64_t) st.st_size, (int64_t) st.st_mtime, digest};
+    _dirty = true;
+}
+
+void digest_cache::save() {
+    std::unique_lock<std::mutex> ul(_lock);
+    if (!_dirty || !_trusted) return;
+    std::string tmpPath = _path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream cacheStream(tmpPath, std::ios::trunc);
+    if (!cacheStream.good()) return;
+    for (auto &rec: _records) {
+        size_t sep = rec.first.find(' ');
+        cacheStream << rec.second.digest.size() << ' ' << rec.second.size << ' ' << rec.second.mtime << ' '
+                    << toHex(rec.second.digest) << ' ' << rec.first.substr(sep + 1) << '\n';
+    }
+    cacheStream.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (!cacheStream.fail() && !rename(tmpPath.c_str(), _path.c_str())) _dirty = false;
+    else remove(tmpPath.c_str());
+}
+
+#pragma mark component_verifier
+
+std::string component_verifier::hash(const char *data, size_t size, size_t digestSize) {
+    unsigned char digest[48]; //SHA384 digest length
+    //OpenSSL picks its SHA-NI/AVX2 implementations at runtime
+    if (digestSize == 20)
+        SHA1((const unsigned char *) data, size, digest);
+    else if (digestSize == 48)
+        SHA384((const unsigned char *) data, size, digest);
+    else
+        reterror("unsupported digest size %zu\n", digestSize);
+    return {(char *) digest, digestSize};
+}
+
+bool component_verifier::add(const std::string &component, plist_t identity, const char *data, size_t size,
+                             const std::string &path, bool fatal) {
+    if (!identity || (!data && path.empty())) return false;
+    plist_t manifest = plist_dict_get_item(identity, "Manifest");
+    plist_t comp = manifest ? plist_dict_get_item(manifest, component.c_str()) : nullptr;
+    plist_t pdigest = comp ? plist_dict_get_item(comp, "Digest") : nullptr;
+    if (!pdigest || plist_get_node_type(pdigest) != PLIST_DATA) return false;
+
+    char *digest = nullptr;
+    uint64_t digestSize = 0;
+    plist_get_data_val(pdigest, &digest, &digestSize);
+    cleanup([&] {
+        safeFree(digest);
+    });
+    if (digestSize != 20 && digestSize != 48) return false;
+
+    job j{};
+    j.name = component;
+    j.data = data;
+    j.size = size;
+    j.path = path;
+    j.expected.assign(digest, (size_t) digestSize);
+    j.fatal = fatal;
+    _jobs.push_back(j);
+    return true;
+}
+
+void component_verifier::verify() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint64_t> hashed(_jobs.size(), 0);
+
+    threadpool::shared().parallelFor(_jobs.size(), [&](size_t i) {
+        auto &j = _jobs[i];
+        struct stat st{};
+        bool haveStat = !j.path.empty() && !stat(j.path.c_str(), &st) && (!j.data || (size_t) st.st_size == j.size);
+        if (_cache && haveStat && _cache->lookup(j.path, st, j.expected.size(), j.digest)) {
+            j.cached = true;
+            return;
+        }
+        if (j.data) {
+            j.digest = hash(j.data, j.size, j.expected.size());
+            hashed[i] = j.size;
+        } else {
+            std::ifstream fileStream(j.path, std::ios::binary);
+            retassure(fileStream.good(), "failed to open %s for verifying %s\n", j.path.c_str(), j.name.c_str());
+            std::vector<char> buf((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+            j.digest = hash(buf.data(), buf.size(), j.expected.size());
+            hashed[i] = buf.size();
+        }
+        if (_cache && haveStat) _cache->store(j.path, st, j.digest);
+    });
+    if (_cache) _cache->save();
+
+    uint64_t hashedBytes = 0;
+    int failed = 0;
+    for (size_t i = 0; i < _jobs.size(); i++) {
+        auto &j = _jobs[i];
+        hashedBytes += hashed[i];
+        if (j.digest == j.expected) {
+            info("[VERIFY] %s matches its manifest digest%s\n", j.name.c_str(), j.cached ? " (cached)" : "");
+        } else if (j.fatal) {
+            error("[VERIFY] %s does not match its manifest digest!\n", j.name.c_str());
+            failed++;
+        } else {
+            warning("[VERIFY] %s does not match its manifest digest, make sure this is intended\n", j.name.c_str());
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    debug("[VERIFY] checked %zu components, hashed %" PRIu64 " bytes in %.3fs on %zu threads\n", _jobs.size(),
+          hashedBytes, elapsed, threadpool::shared().size());
+    retassure(!failed, "%d component(s) do not match the selected build identity\n", failed);
+}
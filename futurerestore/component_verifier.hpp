@@ -0,0 +1,82 @@
+//
+//  component_verifier.hpp
+//  futurerestore
+//
+
+#ifndef component_verifier_hpp
+#define component_verifier_hpp
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <plist/plist.h>
+
+/*
+ * Persistent (path, size, mtime) -> digest cache, so unchanged files don't need to be hashed again.
+ * A hit skips the digest check, so the cache file is only used inside a private_dir.
+ */
+class digest_cache {
+    struct record {
+        uint64_t size;
+        int64_t mtime;
+        std::string digest;
+    };
+    std::string _path;
+    std::map<std::string, record> _records;
+    std::mutex _lock;
+    bool _dirty;
+    bool _trusted;
+
+    static std::string makeKey(const std::string &file, size_t digestSize);
+
+public:
+    explicit digest_cache(std::string path);
+    digest_cache(const digest_cache &) = delete;
+    digest_cache &operator=(const digest_cache &) = delete;
+
+    bool lookup(const std::string &file, const struct stat &st, size_t digestSize, std::string &digest);
+    void store(const std::string &file, const struct stat &st, const std::string &digest);
+    void save();
+};
+
+/*
+ * Checks restore components against the Digest of their build identity.
+ * All components are hashed concurrently on the shared thread pool.
+ */
+class component_verifier {
+    struct job {
+        std::string name;
+        const char *data;
+        size_t size;
+        std::string path;
+        std::string expected;
+        bool fatal;
+        std::string digest;
+        bool cached;
+    };
+    std::vector<job> _jobs;
+    digest_cache *_cache;
+
+public:
+    explicit component_verifier(digest_cache *cache = nullptr) : _cache(cache) {}
+
+    static std::string hash(const char *data, size_t size, size_t digestSize);
+
+    /*
+     * Queues component of identity for verification. data may be nullptr to hash the file at path instead.
+     * Returns false if the identity has no usable Digest for it.
+     * Mismatches of non fatal components are only reported.
+     */
+    bool add(const std::string &component, plist_t identity, const char *data, size_t size, const std::string &path,
+             bool fatal = true);
+
+    size_t size() const {return _jobs.size();}
+
+    //throws if a fatal component doesn't match
+    void verify();
+};
+
+#endif /* component_verifier_hpp */
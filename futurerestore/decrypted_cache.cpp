@@ -0,0 +1,89 @@
+//
+//  decrypted_cache.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <utility>
+#include "decrypted_cache.hpp"
+#include "mapped_file.hpp"
+#include "private_dir.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA_DIGEST_LENGTH CC_SHA1_DIGEST_LENGTH
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+decrypted_cache::decrypted_cache(std::string dir) : _dir(std::move(dir)), _trusted(private_dir::prepare(_dir)) {}
+
+std::string decrypted_cache::getPath(const std::string &key) const {
+    return _dir + "/" + key + ".bin";
+}
+
+std::string decrypted_cache::getKey(const std::string &productType, const std::string &build,
+                                    const std::string &component, const char *source, size_t sourceSize) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *) source, sourceSize, digest);
+    std::string ret = productType + "-" + build + "-" + component + "-";
+    for (auto &c: ret) {
+        if (!isalnum((unsigned char) c) && c != '-' && c != '_' && c != ',') c = '_';
+    }
+    for (unsigned char b: digest) {
+        ret += digits[b >> 4];
+        ret += digits[b & 0xf];
+    }
+    return ret;
+}
+
+bool decrypted_cache::contains(const std::string &key) const {
+    struct stat st{};
+    return _trusted && !stat(getPath(key).c_str(), &st) && private_dir::isTrusted(getPath(key));
+}
+
+char *decrypted_cache::load(const std::string &key, size_t &size) const {
+    if (!_trusted || !private_dir::isTrusted(getPath(key))) return nullptr;
+    try {
+        mapped_file cached(getPath(key));
+        char *ret = (char *) malloc(cached.size() ? cached.size() : 1);
+        if (!ret) return nullptr;
+        memcpy(ret, cached.data(), cached.size());
+        size = cached.size();
+        debug("[DECRYPT] using cached %s\n", key.c_str());
+        return ret;
+    } catch (tihmstar::exception &e) {
+        return nullptr;
+    }
+}
+
+void decrypted_cache::store(const std::string &key, const char *data, size_t size) {
+    if (!_trusted) return;
+    std::string path = getPath(key);
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(data, size);
+    out.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (out.fail() || rename(tmpPath.c_str(), path.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[DECRYPT] failed to cache %s\n", path.c_str());
+    }
+}
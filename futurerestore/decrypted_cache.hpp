@@ -0,0 +1,36 @@
+//
+//  decrypted_cache.hpp
+//  futurerestore
+//
+
+#ifndef decrypted_cache_hpp
+#define decrypted_cache_hpp
+
+#include <stddef.h>
+#include <string>
+
+/*
+ * Components decrypted for the 32-bit pwnDFU path, kept in <dir>/<key>.bin.
+ * The key covers product type, build and component name plus a SHA-1 of the encrypted source, so a hit
+ * can be sent as is without fetching keys or decrypting, and a changed iPSW never hits a stale entry.
+ * Since hits go to the device unchecked, dir has to be a private_dir, otherwise nothing is cached.
+ */
+class decrypted_cache {
+    std::string _dir;
+    bool _trusted;
+
+    std::string getPath(const std::string &key) const;
+
+public:
+    explicit decrypted_cache(std::string dir);
+
+    static std::string getKey(const std::string &productType, const std::string &build, const std::string &component,
+                              const char *source, size_t sourceSize);
+
+    bool contains(const std::string &key) const;
+    //malloc'ed copy of the cached component, nullptr on a miss
+    char *load(const std::string &key, size_t &size) const;
+    void store(const std::string &key, const char *data, size_t size);
+};
+
+#endif /* decrypted_cache_hpp */
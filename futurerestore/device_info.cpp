@@ -0,0 +1,77 @@
+//
+//  device_info.cpp
+//  futurerestore
+//
+
+#include "device_info.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+device_info::device_info()
+        : _generation(0), _mode{false, 0}, _ecid{false, 0}, _ibootBuild{false, ""}, _apNonce{false, ""}, _queries(0),
+          _hits(0), _invalidations(0) {}
+
+void device_info::invalidate() {
+    std::unique_lock<std::mutex> ul(_lock);
+    _generation++;
+    _invalidations++;
+    _mode.valid = _ecid.valid = _ibootBuild.valid = _apNonce.valid = false;
+}
+
+template<typename T>
+T device_info::lookup(slot<T> &s, bool cacheable, const std::function<T()> &query, bool (*meaningful)(const T &)) {
+    uint64_t generation = 0;
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        if (cacheable && s.valid) {
+            _hits++;
+            return s.value;
+        }
+        _queries++;
+        generation = _generation;
+    }
+    //query without holding the lock, the event callbacks must never wait for USB transfers
+    T ret = query();
+    std::unique_lock<std::mutex> ul(_lock);
+    //don't keep what we got if the device changed meanwhile
+    if (cacheable && generation == _generation && meaningful(ret)) {
+        s.value = ret;
+        s.valid = true;
+    }
+    return ret;
+}
+
+static bool knownMode(const int &mode) {
+    return mode != _MODE_UNKNOWN;
+}
+
+static bool nonZero(const uint64_t &val) {
+    return val != 0;
+}
+
+static bool nonEmpty(const std::string &str) {
+    return !str.empty();
+}
+
+int device_info::mode(bool cacheable, const std::function<int()> &query) {
+    return lookup(_mode, cacheable, query, knownMode);
+}
+
+uint64_t device_info::ecid(bool cacheable, const std::function<uint64_t()> &query) {
+    return lookup(_ecid, cacheable, query, nonZero);
+}
+
+std::string device_info::ibootBuild(bool cacheable, const std::function<std::string()> &query) {
+    return lookup(_ibootBuild, cacheable, query, nonEmpty);
+}
+
+std::string device_info::apNonce(bool cacheable, const std::function<std::string()> &query) {
+    return lookup(_apNonce, cacheable, query, nonEmpty);
+}
+
+void device_info::printStats() const {
+    debug("[DEVINFO] %zu device queries, %zu answered from cache, %zu invalidations\n", _queries, _hits,
+          _invalidations);
+}
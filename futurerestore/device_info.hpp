@@ -0,0 +1,58 @@
+//
+//  device_info.hpp
+//  futurerestore
+//
+
+#ifndef device_info_hpp
+#define device_info_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <functional>
+
+/*
+ * Cache for device queries which each cost USB control transfers (mode, ECID, iBoot build, ApNonce).
+ * Values are kept until invalidate() is called, which the device event callbacks do whenever the device
+ * disconnects or changes its mode. Callers pass whether events are subscribed, without them nothing is cached.
+ */
+class device_info {
+    template<typename T>
+    struct slot {
+        bool valid;
+        T value;
+    };
+
+    std::mutex _lock;
+    uint64_t _generation;
+    slot<int> _mode;
+    slot<uint64_t> _ecid;
+    slot<std::string> _ibootBuild;
+    slot<std::string> _apNonce;
+    size_t _queries;
+    size_t _hits;
+    size_t _invalidations;
+
+    template<typename T>
+    T lookup(slot<T> &s, bool cacheable, const std::function<T()> &query, bool (*meaningful)(const T &));
+
+public:
+    device_info();
+
+    //forgets everything, safe to call from the event threads
+    void invalidate();
+
+    //results are only cached if they are meaningful (known mode, non-zero ECID, non-empty strings)
+    int mode(bool cacheable, const std::function<int()> &query);
+    uint64_t ecid(bool cacheable, const std::function<uint64_t()> &query);
+    std::string ibootBuild(bool cacheable, const std::function<std::string()> &query);
+    std::string apNonce(bool cacheable, const std::function<std::string()> &query);
+
+    //queries that actually went to the device, each one is at least one USB control transaction
+    size_t queries() const {return _queries;}
+    size_t hits() const {return _hits;}
+    void printStats() const;
+};
+
+#endif /* device_info_hpp */
@@ -0,0 +1,139 @@
+//
+//  device_profile.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include "device_profile.hpp"
+#include "mapped_file.hpp"
+#include "private_dir.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static uint64_t getUInt(plist_t profile, const char *key, bool required) {
+    plist_t node = plist_dict_get_item(profile, key);
+    uint64_t ret = 0;
+    if (node && plist_get_node_type(node) == PLIST_UINT) {
+        plist_get_uint_val(node, &ret);
+    } else if (node && plist_get_node_type(node) == PLIST_STRING) {
+        char *str = nullptr;
+        plist_get_string_val(node, &str);
+        if (str) ret = strtoull(str, nullptr, 0);
+        safeFree(str);
+    } else {
+        retassure(!required, "device profile is missing %s\n", key);
+    }
+    return ret;
+}
+
+static std::string getString(plist_t profile, const char *key) {
+    plist_t node = plist_dict_get_item(profile, key);
+    char *str = nullptr;
+    retassure(node && plist_get_node_type(node) == PLIST_STRING, "device profile is missing %s\n", key);
+    plist_get_string_val(node, &str);
+    std::string ret = str ? str : "";
+    safeFree(str);
+    return ret;
+}
+
+device_profile device_profile::fromPlist(plist_t profile) {
+    device_profile ret;
+    retassure(profile && plist_get_node_type(profile) == PLIST_DICT, "device profile is not a dictionary\n");
+    ret.ecid = getUInt(profile, "ECID", true);
+    ret.productType = getString(profile, "ProductType");
+    ret.boardConfig = getString(profile, "BoardConfig");
+    ret.chipID = (uint32_t) getUInt(profile, "ChipID", true);
+    ret.boardID = (uint32_t) getUInt(profile, "BoardID", false);
+    ret.bbgcid = getUInt(profile, "BbGoldCertID", false);
+    if (plist_t nonce = plist_dict_get_item(profile, "ApNonce")) {
+        retassure(plist_get_node_type(nonce) == PLIST_DATA, "ApNonce in device profile must be data\n");
+        char *data = nullptr;
+        uint64_t size = 0;
+        plist_get_data_val(nonce, &data, &size);
+        if (data) ret.apNonce.assign(data, (size_t) size);
+        safeFree(data);
+    }
+    retassure(ret.ecid && ret.chipID, "device profile has an invalid ECID or ChipID\n");
+    return ret;
+}
+
+plist_t device_profile::toPlist() const {
+    plist_t ret = plist_new_dict();
+    plist_dict_set_item(ret, "ECID", plist_new_uint(ecid));
+    plist_dict_set_item(ret, "ProductType", plist_new_string(productType.c_str()));
+    plist_dict_set_item(ret, "BoardConfig", plist_new_string(boardConfig.c_str()));
+    plist_dict_set_item(ret, "ChipID", plist_new_uint(chipID));
+    plist_dict_set_item(ret, "BoardID", plist_new_uint(boardID));
+    if (bbgcid) plist_dict_set_item(ret, "BbGoldCertID", plist_new_uint(bbgcid));
+    if (!apNonce.empty()) plist_dict_set_item(ret, "ApNonce", plist_new_data(apNonce.data(), apNonce.size()));
+    return ret;
+}
+
+device_profile_store::device_profile_store(std::string dir)
+        : _dir(std::move(dir)), _trusted(private_dir::prepare(_dir)) {}
+
+std::string device_profile_store::getPath(uint64_t ecid) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".plist", ecid);
+    return _dir + name;
+}
+
+bool device_profile_store::load(uint64_t ecid, device_profile &profile) const {
+    if (!ecid || !_trusted || !private_dir::isTrusted(getPath(ecid))) return false;
+    plist_t plist = nullptr;
+    cleanup([&] {
+        safeFreeCustom(plist, plist_free);
+    });
+    try {
+        mapped_file f(getPath(ecid));
+        plist_from_xml(f.data(), (uint32_t) f.size(), &plist);
+        device_profile stored = device_profile::fromPlist(plist);
+        if (stored.ecid != ecid) return false;
+        profile = stored;
+        return true;
+    } catch (tihmstar::exception &e) {
+        return false;
+    }
+}
+
+void device_profile_store::save(const device_profile &profile) {
+    if (!profile.ecid || !profile.chipID || !_trusted) return;
+    device_profile merged = profile;
+    merged.apNonce.clear();
+    device_profile stored;
+    if (!merged.bbgcid && load(profile.ecid, stored) && stored.chipID == merged.chipID &&
+        stored.boardID == merged.boardID)
+        merged.bbgcid = stored.bbgcid;
+
+    plist_t plist = merged.toPlist();
+    char *xml = nullptr;
+    uint32_t xmlSize = 0;
+    cleanup([&] {
+        safeFree(xml);
+        plist_free(plist);
+    });
+    plist_to_xml(plist, &xml, &xmlSize);
+    if (!xml) return;
+    std::string path = getPath(profile.ecid);
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(xml, xmlSize);
+    out.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (out.fail() || rename(tmpPath.c_str(), path.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[PROFILE] failed to save %s\n", path.c_str());
+    }
+}
@@ -0,0 +1,55 @@
+//
+//  device_profile.hpp
+//  futurerestore
+//
+
+#ifndef device_profile_hpp
+#define device_profile_hpp
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <plist/plist.h>
+
+/*
+ * Everything host side validation needs to know about a device, so it can run without one attached.
+ * Stored as a plist with the keys ECID, ProductType, BoardConfig, ChipID, BoardID, BbGoldCertID and
+ * optionally ApNonce (data).
+ */
+struct device_profile {
+    uint64_t ecid;
+    std::string productType;
+    std::string boardConfig;
+    uint32_t chipID;
+    uint32_t boardID;
+    uint64_t bbgcid;
+    std::string apNonce; //raw bytes, empty if unknown
+
+    device_profile() : ecid(0), chipID(0), boardID(0), bbgcid(0) {}
+
+    bool isImage4Supported() const {return chipID >= 0x8960 || (chipID >= 0x7000 && chipID < 0x8900);}
+
+    static device_profile fromPlist(plist_t profile);
+    plist_t toPlist() const;
+};
+
+/*
+ * Profiles of every device seen on this host, one <ECID>.plist per device.
+ * Provides the BbGoldCertID once the device is in recovery, where it can't be read anymore.
+ * The ApNonce is never stored, it changes between boots. Nothing is stored unless dir is a private_dir.
+ */
+class device_profile_store {
+    std::string _dir;
+    bool _trusted;
+
+    std::string getPath(uint64_t ecid) const;
+
+public:
+    explicit device_profile_store(std::string dir);
+
+    bool load(uint64_t ecid, device_profile &profile) const;
+    //keeps a known BbGoldCertID if profile doesn't have one and the stored chip and board match
+    void save(const device_profile &profile);
+};
+
+#endif /* device_profile_hpp */
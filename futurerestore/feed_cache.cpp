@@ -0,0 +1,172 @@
+//
+//  feed_cache.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <curl/curl.h>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include "feed_cache.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#define FEED_CACHE_MAGIC "FRFC1"
+
+static uint64_t fnv1a64(const std::string &str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c: str) {
+        hash ^= (uint8_t) c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct feed_response {
+    std::string body;
+    std::string etag;
+    std::string lastModified;
+};
+
+static size_t feed_header_cb(char *buffer, size_t size, size_t nitems, void *userdata) {
+    auto *resp = (feed_response *) userdata;
+    size_t len = size * nitems;
+    if (len > 5 && !strncasecmp(buffer, "HTTP/", 5)) {
+        //status line of the next response when following redirects
+        resp->etag.clear();
+        resp->lastModified.clear();
+        return len;
+    }
+    std::string line(buffer, len);
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return len;
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+    if (colon == 4 && !strncasecmp(buffer, "etag", 4)) {
+        resp->etag = value;
+    } else if (colon == 13 && !strncasecmp(buffer, "last-modified", 13)) {
+        resp->lastModified = value;
+    }
+    return len;
+}
+
+static size_t feed_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    auto *resp = (feed_response *) userdata;
+    resp->body.append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+feed_cache::feed_cache(std::string dir, long maxAge)
+        : _dir(std::move(dir)), _maxAge(maxAge), _requests(0), _notModified(0) {}
+
+std::string feed_cache::getPath(const std::string &url, const char *ext) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".%s", fnv1a64(url), ext);
+    return _dir + name;
+}
+
+bool feed_cache::load(const std::string &url, entry &e) const {
+    std::ifstream metaStream(getPath(url, "meta"));
+    std::string magic;
+    std::string cachedUrl;
+    if (!std::getline(metaStream, magic) || magic != FEED_CACHE_MAGIC) return false;
+    if (!(metaStream >> e.fetched) || metaStream.get() != '\n') return false;
+    if (!std::getline(metaStream, e.etag) || !std::getline(metaStream, e.lastModified)) return false;
+    if (!std::getline(metaStream, cachedUrl) || cachedUrl != url) return false;
+
+    std::ifstream bodyStream(getPath(url, "json"), std::ios::binary);
+    if (!bodyStream.good()) return false;
+    std::ostringstream body;
+    body << bodyStream.rdbuf();
+    e.body = body.str();
+    return !e.body.empty();
+}
+
+void feed_cache::save(const std::string &url, const entry &e, bool metaOnly) const {
+    mkdir_with_parents(_dir.c_str(), 0755);
+    if (!metaOnly) {
+        std::string bodyPath = getPath(url, "json");
+        std::ofstream bodyStream(bodyPath + ".tmp", std::ios::binary | std::ios::trunc);
+        bodyStream.write(e.body.data(), (std::streamsize) e.body.size());
+        bodyStream.close();
+        if (bodyStream.fail() || rename((bodyPath + ".tmp").c_str(), bodyPath.c_str())) {
+            remove((bodyPath + ".tmp").c_str());
+            return;
+        }
+    }
+    std::string metaPath = getPath(url, "meta");
+    std::ofstream metaStream(metaPath + ".tmp", std::ios::trunc);
+    metaStream << FEED_CACHE_MAGIC << '\n' << e.fetched << '\n' << e.etag << '\n' << e.lastModified << '\n'
+               << url << '\n';
+    metaStream.close();
+    if (metaStream.fail() || rename((metaPath + ".tmp").c_str(), metaPath.c_str()))
+        remove((metaPath + ".tmp").c_str());
+}
+
+char *feed_cache::get(const std::string &url) {
+    entry cached{};
+    bool haveCached = load(url, cached);
+    time_t now = time(nullptr);
+    if (haveCached && _maxAge > 0 && now >= cached.fetched && now - cached.fetched < _maxAge) {
+        debug("[FEED] using cached %s (%ld seconds old)\n", url.c_str(), (long) (now - cached.fetched));
+        return strdup(cached.body.c_str());
+    }
+
+    feed_response resp;
+    struct curl_slist *headers = nullptr;
+    CURL *curl = curl_easy_init();
+    retassure(curl, "failed to init curl\n");
+    cleanup([&] {
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(curl);
+    });
+    if (haveCached && !cached.etag.empty())
+        headers = curl_slist_append(headers, ("If-None-Match: " + cached.etag).c_str());
+    if (haveCached && !cached.lastModified.empty())
+        headers = curl_slist_append(headers, ("If-Modified-Since: " + cached.lastModified).c_str());
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "futurerestore");
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, feed_header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &resp);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, feed_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
+    CURLcode res = curl_easy_perform(curl);
+    _requests++;
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    if (res == CURLE_OK && status == 304 && haveCached) {
+        _notModified++;
+        debug("[FEED] %s not modified\n", url.c_str());
+        cached.fetched = now;
+        save(url, cached, true);
+        return strdup(cached.body.c_str());
+    }
+    if (res == CURLE_OK && status == 200 && !resp.body.empty()) {
+        debug("[FEED] downloaded %s (%zu bytes)\n", url.c_str(), resp.body.size());
+        save(url, {now, resp.etag, resp.lastModified, resp.body}, false);
+        return strdup(resp.body.c_str());
+    }
+
+    if (res != CURLE_OK) {
+        error("[FEED] failed to fetch %s: %s\n", url.c_str(), curl_easy_strerror(res));
+    } else {
+        error("[FEED] failed to fetch %s: HTTP %ld\n", url.c_str(), status);
+    }
+    if (!haveCached) return nullptr;
+    info("[FEED] using cached copy of %s from %ld seconds ago\n", url.c_str(), (long) (now - cached.fetched));
+    return strdup(cached.body.c_str());
+}
@@ -0,0 +1,49 @@
+//
+//  feed_cache.hpp
+//  futurerestore
+//
+
+#ifndef feed_cache_hpp
+#define feed_cache_hpp
+
+#include <stddef.h>
+#include <time.h>
+#include <string>
+
+/*
+ * On-disk cache of the firmware feeds (firmware.json, beta lists).
+ * Copies younger than maxAge are used without a request, older ones are revalidated with
+ * If-None-Match/If-Modified-Since and only downloaded again if the server has a newer version.
+ */
+class feed_cache {
+    struct entry {
+        time_t fetched;
+        std::string etag;
+        std::string lastModified;
+        std::string body;
+    };
+
+    std::string _dir;
+    long _maxAge;
+    size_t _requests;
+    size_t _notModified;
+
+    std::string getPath(const std::string &url, const char *ext) const;
+    bool load(const std::string &url, entry &e) const;
+    void save(const std::string &url, const entry &e, bool metaOnly) const;
+
+public:
+    //maxAge in seconds, 0 revalidates on every use
+    feed_cache(std::string dir, long maxAge = 0);
+
+    /*
+     * Returns a malloc'd, NUL terminated copy of the feed like tsschecker's getters do.
+     * Falls back to a stale copy if the server can't be reached, nullptr if there is no copy at all.
+     */
+    char *get(const std::string &url);
+
+    size_t requests() const {return _requests;}
+    size_t notModified() const {return _notModified;}
+};
+
+#endif /* feed_cache_hpp */
@@ -0,0 +1,406 @@
+//
+//  fs_cache.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <utility>
+#include "fs_cache.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#define FS_CACHE_MAGIC      "FRFS2"
+#define FS_CACHE_INDEX      ".futurerestore-fscache"
+#define FS_CACHE_OBJECTS    ".objects/"
+#define FS_CACHE_LOCK_POLL  250 //ms
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static bool lockFd(int fd, bool exclusive, bool wait) {
+#ifdef WIN32
+    OVERLAPPED ov{};
+    DWORD flags = (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+    return LockFileEx((HANDLE) _get_osfhandle(fd), flags, 0, MAXDWORD, MAXDWORD, &ov);
+#else
+    int ret;
+    while ((ret = flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB))) == -1 && errno == EINTR);
+    return ret == 0;
+#endif
+}
+
+static int openLockFile(const std::string &path) {
+    return open(path.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+}
+
+static bool getFileSize(const std::string &path, uint64_t &size) {
+    struct stat st{};
+    if (stat(path.c_str(), &st)) return false;
+    size = (uint64_t) st.st_size;
+    return true;
+}
+
+static bool reflinkFile(const std::string &src, const std::string &dst) {
+#if defined(__APPLE__)
+    return !clonefile(src.c_str(), dst.c_str(), 0);
+#elif defined(FICLONE)
+    int sfd = open(src.c_str(), O_RDONLY);
+    if (sfd == -1) return false;
+    int dfd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ret = dfd != -1 && !ioctl(dfd, FICLONE, sfd);
+    if (dfd != -1) close(dfd);
+    close(sfd);
+    if (!ret) remove(dst.c_str());
+    return ret;
+#else
+    return false;
+#endif
+}
+
+static bool hardlinkFile(const std::string &src, const std::string &dst) {
+#ifdef WIN32
+    return CreateHardLinkA(dst.c_str(), src.c_str(), nullptr);
+#else
+    return !link(src.c_str(), dst.c_str());
+#endif
+}
+
+static void copyFile(const std::string &src, const std::string &dst) {
+    FILE *in = fopen(src.c_str(), "rb");
+    retassure(in, "failed to open %s\n", src.c_str());
+    cleanup([&] {
+        fclose(in);
+    });
+    FILE *out = fopen(dst.c_str(), "wb");
+    retassure(out, "failed to create %s\n", dst.c_str());
+    cleanup([&] {
+        if (out) fclose(out);
+    });
+    std::vector<char> buf(0x100000);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        retassure(fwrite(buf.data(), 1, n, out) == n, "failed to write %s\n", dst.c_str());
+    }
+    retassure(!ferror(in), "failed to read %s\n", src.c_str());
+    FILE *f = out;
+    out = nullptr;
+    retassure(!fclose(f), "failed to write %s\n", dst.c_str());
+}
+
+static void mkdirForName(const std::string &dir, const std::string &name) {
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) mkdir_with_parents((dir + "/" + name.substr(0, slash)).c_str(), 0755);
+}
+
+#pragma mark fs_cache::entry
+
+fs_cache::entry::entry() : _fd(-1) {}
+
+fs_cache::entry::entry(std::string path, int fd) : _path(std::move(path)), _fd(fd) {}
+
+fs_cache::entry::entry(entry &&other) noexcept : _path(std::move(other._path)), _fd(other._fd) {
+    other._fd = -1;
+}
+
+fs_cache::entry &fs_cache::entry::operator=(entry &&other) noexcept {
+    if (this != &other) {
+        if (_fd != -1) close(_fd);
+        _path = std::move(other._path);
+        _fd = other._fd;
+        other._fd = -1;
+    }
+    return *this;
+}
+
+fs_cache::entry::~entry() {
+    if (_fd != -1) close(_fd); //drops the shared lock
+}
+
+#pragma mark fs_cache
+
+fs_cache::fs_cache(std::string dir, uint64_t budget)
+        : _dir(std::move(dir)), _budget(budget), _usable(false), _hits(0), _misses(0), _waits(0), _linked(0) {
+    struct stat st{};
+    if (stat(_dir.c_str(), &st)) mkdir_with_parents(_dir.c_str(), 0755);
+    _usable = !stat(_dir.c_str(), &st) && S_ISDIR(st.st_mode) && !access(_dir.c_str(), W_OK);
+}
+
+uint64_t fs_cache::record::diskUsage() const {
+    uint64_t ret = size;
+    for (auto &a: aliases) {
+        if (a.kind == link_copy) ret += size;
+    }
+    return ret;
+}
+
+fs_cache::link_kind fs_cache::linkFile(const std::string &src, const std::string &dst) {
+    std::string tmp = dst + ".link";
+    remove(tmp.c_str());
+    link_kind kind;
+    if (reflinkFile(src, tmp)) {
+        kind = link_reflink;
+    } else if (hardlinkFile(src, tmp)) {
+        kind = link_hardlink;
+    } else {
+        try {
+            copyFile(src, tmp);
+        } catch (...) {
+            remove(tmp.c_str());
+            throw;
+        }
+        kind = link_copy;
+    }
+    remove(dst.c_str());
+    if (rename(tmp.c_str(), dst.c_str())) {
+        remove(tmp.c_str());
+        reterror("failed to move %s into place\n", dst.c_str());
+    }
+    return kind;
+}
+
+std::string fs_cache::indexPath() const {
+    return _dir + "/" FS_CACHE_INDEX;
+}
+
+std::vector<fs_cache::record> fs_cache::loadIndex() const {
+    std::vector<record> records;
+    std::ifstream index(indexPath());
+    std::string magic;
+    if (!std::getline(index, magic) || magic != FS_CACHE_MAGIC) return records;
+    record r{};
+    std::string line;
+    //size lastUse name[\t<kind>:alias]...
+    while (index >> r.size >> r.lastUse && index.get() == ' ' && std::getline(index, line)) {
+        size_t tab = line.find('\t');
+        r.name = line.substr(0, tab);
+        r.aliases.clear();
+        while (tab != std::string::npos) {
+            size_t next = line.find('\t', tab + 1);
+            std::string a = line.substr(tab + 1, next == std::string::npos ? std::string::npos : next - tab - 1);
+            if (a.size() > 2 && a[1] == ':') r.aliases.push_back({a.substr(2), (link_kind) a[0]});
+            tab = next;
+        }
+        if (!r.name.empty()) records.push_back(r);
+    }
+    return records;
+}
+
+void fs_cache::saveIndex(const std::vector<record> &records) const {
+    std::string path = indexPath();
+    std::ofstream index(path + ".tmp", std::ios::trunc);
+    index << FS_CACHE_MAGIC << '\n';
+    for (auto &r: records) {
+        index << r.size << ' ' << r.lastUse << ' ' << r.name;
+        for (auto &a: r.aliases) {
+            index << '\t' << (char) a.kind << ':' << a.name;
+        }
+        index << '\n';
+    }
+    index.close();
+    if (index.fail() || rename((path + ".tmp").c_str(), path.c_str())) {
+        remove((path + ".tmp").c_str());
+        error("[FSCACHE] failed to write %s\n", path.c_str());
+    }
+}
+
+bool fs_cache::evictRecord(const record &r) const {
+    std::string path = _dir + "/" + r.name;
+    //the entry lock is held by whoever is extracting, the image itself by whoever is using it
+    int lfd = openLockFile(path + ".lock");
+    if (lfd == -1) return false;
+    cleanup([&] {
+        close(lfd);
+    });
+    if (!lockFd(lfd, true, false)) return false;
+
+    int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+    if (fd == -1) return errno == ENOENT;
+    cleanup([&] {
+        close(fd);
+    });
+    if (!lockFd(fd, true, false)) return false;
+    for (auto &a: r.aliases) {
+        uint64_t aliasSize = 0;
+        if (getFileSize(_dir + "/" + a.name, aliasSize) && aliasSize == r.size) unlink((_dir + "/" + a.name).c_str());
+    }
+    return !unlink(path.c_str());
+}
+
+bool fs_cache::adopt(const std::string &name, const std::string &objectName, uint64_t size) {
+    //an image extracted before it had a content key, moved instead of extracted again
+    uint64_t nameSize = 0;
+    if (!getFileSize(_dir + "/" + name, nameSize) || nameSize != size) return false;
+    return !rename((_dir + "/" + name).c_str(), (_dir + "/" + objectName).c_str());
+}
+
+void fs_cache::recordUse(const std::string &name, uint64_t size, const alias *linked) {
+    int ifd = openLockFile(indexPath() + ".lock");
+    retassure(ifd != -1, "failed to open fs cache index lock in %s\n", _dir.c_str());
+    cleanup([&] {
+        close(ifd);
+    });
+    retassure(lockFd(ifd, true, true), "failed to lock fs cache index in %s\n", _dir.c_str());
+
+    auto records = loadIndex();
+    auto it = std::find_if(records.begin(), records.end(), [&](const record &r) {return r.name == name;});
+    if (it == records.end()) it = records.insert(records.end(), record{name, size, 0});
+    it->size = size;
+    it->lastUse = time(nullptr);
+    if (linked) {
+        for (auto &r: records) {
+            r.aliases.erase(std::remove_if(r.aliases.begin(), r.aliases.end(), [&](const alias &a) {
+                return a.name == linked->name;
+            }), r.aliases.end());
+        }
+        it->aliases.push_back(*linked);
+    }
+
+    //forget entries which were removed by hand
+    uint64_t total = 0;
+    records.erase(std::remove_if(records.begin(), records.end(), [&](record &r) {
+        uint64_t actual = 0;
+        if (!getFileSize(_dir + "/" + r.name, actual) || actual != r.size) return true;
+        r.aliases.erase(std::remove_if(r.aliases.begin(), r.aliases.end(), [&](const alias &a) {
+            return !getFileSize(_dir + "/" + a.name, actual) || actual != r.size;
+        }), r.aliases.end());
+        return false;
+    }), records.end());
+    for (auto &r: records) total += r.diskUsage();
+
+    if (_budget && total > _budget) {
+        std::stable_sort(records.begin(), records.end(), [](const record &a, const record &b) {
+            return a.lastUse < b.lastUse;
+        });
+        for (auto r = records.begin(); r != records.end() && total > _budget;) {
+            if (r->name != name && evictRecord(*r)) {
+                info("[FSCACHE] evicted %s (%" PRIu64 " bytes)\n", r->name.c_str(), r->diskUsage());
+                total -= r->diskUsage();
+                r = records.erase(r);
+            } else {
+                ++r;
+            }
+        }
+        if (total > _budget)
+            info("[FSCACHE] cache is over its budget, the remaining entries are in use\n");
+    }
+    saveIndex(records);
+}
+
+fs_cache::entry fs_cache::acquire(const std::string &name, uint64_t size,
+                                  const std::function<void(const std::string &path)> &extract, const std::string &key,
+                                  const std::function<bool()> &cancelled) {
+    retassure(_usable, "fs cache directory %s is not writable\n", _dir.c_str());
+    std::string objectName = key.empty() ? name : FS_CACHE_OBJECTS + key;
+    std::string path = _dir + "/" + objectName;
+    mkdirForName(_dir, objectName);
+    mkdirForName(_dir, name);
+
+    int lfd = openLockFile(path + ".lock");
+    retassure(lfd != -1, "failed to open %s.lock\n", path.c_str());
+    cleanup([&] {
+        close(lfd);
+    });
+    if (!lockFd(lfd, true, false)) {
+        _waits++;
+        info("[FSCACHE] waiting for another process to finish extracting %s\n", name.c_str());
+        //polled instead of blocking in the lock, so giving up doesn't have to wait for the other process
+        while (!lockFd(lfd, true, false)) {
+            retassure(!cancelled || !cancelled(), "gave up waiting for %s\n", name.c_str());
+            std::this_thread::sleep_for(std::chrono::milliseconds(FS_CACHE_LOCK_POLL));
+        }
+    }
+
+    uint64_t cachedSize = 0;
+    bool hit = getFileSize(path, cachedSize) && cachedSize == size;
+    if (!hit && objectName != name && adopt(name, objectName, size)) {
+        info("[FSCACHE] moved previously extracted %s into the shared store\n", name.c_str());
+        hit = true;
+    }
+    if (hit) {
+        _hits++;
+        info("Using cached filesystem from '%s'\n", path.c_str());
+    } else {
+        _misses++;
+        std::string tmp = path + ".extract";
+        bool extracted = false;
+        cleanup([&] {
+            if (!extracted) remove(tmp.c_str());
+        });
+        remove(tmp.c_str());
+        extract(tmp);
+        retassure(getFileSize(tmp, cachedSize) && cachedSize == size,
+                  "extracted %s has %" PRIu64 " bytes, expected %" PRIu64 "\n", name.c_str(), cachedSize, size);
+        remove(path.c_str());
+        retassure(!rename(tmp.c_str(), path.c_str()), "failed to move %s into the fs cache\n", name.c_str());
+        extracted = true;
+    }
+
+    //taken before the entry lock is released, so the image can't be evicted in between
+    int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+    retassure(fd != -1, "failed to open %s\n", path.c_str());
+    entry ret(path, fd);
+    retassure(lockFd(fd, false, true), "failed to lock %s\n", path.c_str());
+
+    //the per-IPSW name only needs to be linked again if it isn't a known alias of this object anymore
+    alias linked{name, link_copy};
+    bool relink = false;
+    if (objectName != name) {
+        uint64_t aliasSize = 0;
+        relink = !getFileSize(_dir + "/" + name, aliasSize) || aliasSize != size;
+        if (!relink) {
+            auto records = loadIndex();
+            relink = std::none_of(records.begin(), records.end(), [&](const record &r) {
+                return r.name == objectName && std::any_of(r.aliases.begin(), r.aliases.end(), [&](const alias &a) {
+                    return a.name == name;
+                });
+            });
+        }
+        if (relink) {
+            try {
+                linked.kind = linkFile(path, _dir + "/" + name);
+                if (hit) _linked++;
+                debug("[FSCACHE] %s is a %s of %s\n", name.c_str(),
+                      linked.kind == link_reflink ? "reflink" : linked.kind == link_hardlink ? "hardlink" : "copy",
+                      objectName.c_str());
+            } catch (tihmstar::exception &e) {
+                error("[FSCACHE] failed to link %s: %s", name.c_str(), e.what());
+                relink = false;
+            }
+        }
+    }
+
+    try {
+        recordUse(objectName, size, relink ? &linked : nullptr);
+    } catch (tihmstar::exception &e) {
+        error("[FSCACHE] failed to update the cache index: %s", e.what());
+    }
+    return ret;
+}
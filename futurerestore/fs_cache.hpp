@@ -0,0 +1,116 @@
+//
+//  fs_cache.hpp
+//  futurerestore
+//
+
+#ifndef fs_cache_hpp
+#define fs_cache_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+#ifndef FS_CACHE_DEFAULT_LIMIT
+#define FS_CACHE_DEFAULT_LIMIT (20ULL << 30)
+#endif
+
+/*
+ * Filesystem images extracted from IPSWs, shared between futurerestore processes on the same host.
+ * Every entry has a <name>.lock which is held exclusively while it is looked up and extracted, so one process
+ * extracts and the others wait for it. Entries in use are held with a shared lock on the image itself, the
+ * least recently used ones that nobody holds are evicted once the cache grows past its byte budget.
+ * Only entries listed in the cache's index are ever evicted.
+ *
+ * Entries with a content key are stored once under .objects/<key>, the per-IPSW names are reflinks, hardlinks
+ * or (if the filesystem supports neither) copies of that object and are evicted together with it.
+ */
+class fs_cache {
+public:
+    //keeps an extracted image from being evicted until it is destroyed
+    class entry {
+        friend class fs_cache;
+        std::string _path;
+        int _fd;
+
+        entry(std::string path, int fd);
+
+    public:
+        entry();
+        entry(const entry &) = delete;
+        entry &operator=(const entry &) = delete;
+        entry(entry &&other) noexcept;
+        entry &operator=(entry &&other) noexcept;
+        ~entry();
+
+        const std::string &path() const {return _path;}
+        explicit operator bool() const {return _fd != -1;}
+    };
+
+public:
+    enum link_kind {
+        link_reflink = 'r',
+        link_hardlink = 'h',
+        link_copy = 'c'
+    };
+
+private:
+    struct alias {
+        std::string name;
+        link_kind kind;
+    };
+    struct record {
+        std::string name;
+        uint64_t size;
+        time_t lastUse;
+        std::vector<alias> aliases;
+
+        //copies take up space of their own
+        uint64_t diskUsage() const;
+    };
+
+    std::string _dir;
+    uint64_t _budget;
+    bool _usable;
+    size_t _hits;
+    size_t _misses;
+    size_t _waits;
+    size_t _linked;
+
+    std::string indexPath() const;
+    std::vector<record> loadIndex() const;
+    void saveIndex(const std::vector<record> &records) const;
+    bool evictRecord(const record &r) const;
+    void recordUse(const std::string &name, uint64_t size, const alias *linked);
+    bool adopt(const std::string &name, const std::string &objectName, uint64_t size);
+
+public:
+    //budget in bytes, 0 never evicts
+    fs_cache(std::string dir, uint64_t budget);
+
+    //false if the cache directory can't be created or written to
+    bool usable() const {return _usable;}
+
+    /*
+     * Returns the cached image called name (relative to the cache directory, may contain one subdirectory).
+     * If there is none of the expected size, extract is called with a temporary path to write it to.
+     * With a content key the returned image is the shared object and name is linked to it.
+     * While another process holds the entry, cancelled is polled and acquire throws once it returns true.
+     */
+    entry acquire(const std::string &name, uint64_t size, const std::function<void(const std::string &path)> &extract,
+                  const std::string &key = "", const std::function<bool()> &cancelled = nullptr);
+
+    //reflinks, hardlinks or copies src to dst, replacing dst
+    static link_kind linkFile(const std::string &src, const std::string &dst);
+
+    size_t hits() const {return _hits;}
+    size_t misses() const {return _misses;}
+    //acquires which had to wait for another process
+    size_t waits() const {return _waits;}
+    //names which were satisfied by linking an existing object
+    size_t linked() const {return _linked;}
+};
+
+#endif /* fs_cache_hpp */
@@ -8,10 +8,30 @@
 
 #include <libgeneral/macros.h>
 #include <libgen.h>
+#include <inttypes.h>
 #include <zlib.h>
 #include <utility>
 #include <fstream>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
 #include "futurerestore.hpp"
+#include "im4m_matcher.hpp"
+#include "remote_zip.hpp"
+#include "collision_stats.hpp"
+#include "component_verifier.hpp"
+#include "progress.hpp"
+#include "mapped_file.hpp"
+#include "feed_cache.hpp"
+#include "ipsw_archive.hpp"
+#include "threadpool.hpp"
+#include "decrypted_cache.hpp"
+#include "signature_cache.hpp"
+#include "private_dir.hpp"
+#include "img4_builder.hpp"
 
 #ifdef HAVE_LIBIPATCHER
 #include <libipatcher/libipatcher.hpp>
@@ -93,15 +113,38 @@ std::string futurerestoreTempPath("download");
 std::string tempPath("/tmp");
 std::string futurerestoreTempPath(tempPath + "/futurerestore");
 #endif
+#ifdef WIN32
+std::string userTempPath = futurerestoreTempPath;
+#else
+//caches trusted without checking their contents again, see private_dir
+std::string userTempPath = futurerestoreTempPath + "/user-" + std::to_string(getuid());
+#endif
 
 std::string roseTempPath = futurerestoreTempPath + "/rose.bin";
 std::string seTempPath = futurerestoreTempPath + "/se.sefw";
+std::array<std::string, 6> savageTempPaths{futurerestoreTempPath + "/savageB0PP.fw",
+                                           futurerestoreTempPath + "/savageB0DP.fw",
+                                           futurerestoreTempPath + "/savageB2PP.fw",
+                                           futurerestoreTempPath + "/savageB2DP.fw",
+                                           futurerestoreTempPath + "/savageBAPP.fw",
+                                           futurerestoreTempPath + "/savageBADP.fw"};
 std::string veridianDGMTempPath = futurerestoreTempPath + "/veridianDGM.der";
 std::string veridianFWMTempPath = futurerestoreTempPath + "/veridianFWM.plist";
 std::string basebandTempPath = futurerestoreTempPath + "/baseband.bbfw";
 std::string basebandManifestTempPath = futurerestoreTempPath + "/basebandManifest.plist";
 std::string sepTempPath = futurerestoreTempPath + "/sep.im4p";
 std::string sepManifestTempPath = futurerestoreTempPath + "/sepManifest.plist";
+std::string remoteZipCachePath = futurerestoreTempPath + "/zipcache";
+std::string digestCachePath = userTempPath + "/digestcache";
+std::string plistCachePath = userTempPath + "/plistcache";
+std::string feedCachePath = futurerestoreTempPath + "/feedcache";
+std::string ipswCachePath = userTempPath + "/ipswcache";
+std::string sessionsPath = futurerestoreTempPath + "/sessions";
+std::string profilesPath = userTempPath + "/profiles";
+std::string decryptedCachePath = userTempPath + "/decrypted";
+std::string signatureCachePath = userTempPath + "/signatures.bplist";
+
+#define PLIST_SIDECAR_MIN_SIZE 0x10000 //below this parsing the XML is about as fast as hashing it
 
 #ifdef __APPLE__
 
@@ -125,6 +168,62 @@ void irecv_event_cb(const irecv_device_event_t *event, void *userdata);
 void idevice_event_cb(const idevice_event_t *event, void *userdata);
 }
 
+static void reportDeviceMode(struct idevicerestore_client_t *client) {
+    progress_stream::shared().deviceMode((client->mode && client->mode->string) ? client->mode->string : "Unknown");
+}
+
+static void restore_progress_cb(int step, double step_progress, void *userdata) {
+    static const char *stepNames[] = {"detect", "prepare", "upload filesystem", "verify filesystem",
+                                      "flash firmware", "flash baseband", "firmware updates"};
+    if (step < 0 || step >= (int) (sizeof(stepNames) / sizeof(*stepNames))) return;
+    uint64_t fsSize = *(uint64_t *) userdata;
+    if (step == RESTORE_STEP_UPLOAD_FS && fsSize) {
+        progress_stream::shared().progress(stepNames[step], (uint64_t) (step_progress * fsSize), fsSize);
+    } else {
+        progress_stream::shared().progress(stepNames[step], (uint64_t) (step_progress * 100), 100, "percent");
+    }
+}
+
+static const char *uploadPhase = nullptr;
+static unsigned long uploadSize = 0;
+
+//outside of sendBootloader this does what idevicerestore's dfu_progress_callback does
+static int irecv_upload_progress_cb(irecv_client_t client, const irecv_event_t *event) {
+    if (event->type == IRECV_PROGRESS) {
+        print_progress_bar(event->progress);
+        if (uploadPhase) {
+            progress_stream::shared().progress(uploadPhase, (uint64_t) (event->progress / 100 * uploadSize),
+                                               uploadSize);
+        }
+    }
+    return 0;
+}
+
+//irecv_send_buffer, with the upload reported to the progress stream
+static irecv_error_t sendBootloader(irecv_client_t client, const char *name, const char *buf, unsigned long size) {
+    info("Sending %s (%lu bytes)...\n", name, size);
+    std::string phase = std::string("upload ") + name;
+    uploadPhase = phase.c_str();
+    uploadSize = size;
+    //libirecovery keeps one callback per event and doesn't hand out the current one, so dfu_client_new's
+    //can't be put back afterwards. Ours stays subscribed instead of leaving the client without any
+    irecv_event_subscribe(client, IRECV_PROGRESS, irecv_upload_progress_cb, nullptr);
+    irecv_error_t err = irecv_send_buffer(client, (unsigned char *) buf, size, 1);
+    uploadPhase = nullptr;
+    return err;
+}
+
+static std::string hexString(const unsigned char *data, size_t size, const char *separator) {
+    std::string ret;
+    char buf[3];
+    for (size_t i = 0; i < size; i++) {
+        snprintf(buf, sizeof(buf), "%02x", data[i]);
+        ret += buf;
+        ret += separator;
+    }
+    return ret;
+}
+
 #pragma mark futurerestore
 
 futurerestore::futurerestore(bool isUpdateInstall, bool isPwnDfu, bool noIBSS, bool setNonce, bool serial,
@@ -145,6 +244,37 @@ futurerestore::futurerestore(bool isUpdateInstall, bool isPwnDfu, bool noIBSS, b
     _customLatestBuildID = std::string("");
 }
 
+//idevicerestore's device event callbacks, which also drop cached device info and report mode changes
+void futurerestore::irecvEventCallback(const irecv_device_event_t *event, void *userdata) {
+    auto self = (futurerestore *) userdata;
+    idevicerestore_mode_t *previous = self->_client->mode;
+    irecv_event_cb(event, self->_client);
+    if (self->_client->mode != previous) {
+        self->_deviceInfo.invalidate();
+        self->_autoboot = -1;
+    }
+    reportDeviceMode(self->_client);
+}
+
+void futurerestore::ideviceEventCallback(const idevice_event_t *event, void *userdata) {
+    auto self = (futurerestore *) userdata;
+    idevicerestore_mode_t *previous = self->_client->mode;
+    idevice_event_cb(event, self->_client);
+    if (self->_client->mode != previous) {
+        self->_deviceInfo.invalidate();
+        self->_autoboot = -1;
+    }
+    reportDeviceMode(self->_client);
+}
+
+void futurerestore::subscribeDeviceEvents() {
+    if (!_client->irecv_e_ctx) irecv_device_event_subscribe(&_client->irecv_e_ctx, irecvEventCallback, this);
+    if (!_client->idevice_e_ctx) {
+        idevice_event_subscribe(ideviceEventCallback, this);
+        _client->idevice_e_ctx = (void *) ideviceEventCallback;
+    }
+}
+
 bool futurerestore::init() {
     if (_didInit) return _didInit;
 //    If device is in an invalid state, don't check if it supports img4
@@ -154,15 +284,59 @@ bool futurerestore::init() {
         } else {
             info("[INFO] 64-bit device detected\n");
         }
+        //device queries are cached until these report a change
+        subscribeDeviceEvents();
+        loadKnownDeviceProfile();
     }
     return _didInit;
 }
 
+void futurerestore::useProfileDevice() {
+    //everything that would otherwise be queried from the device comes from the profile
+    _profileDevice.product_type = _profile.productType.c_str();
+    _profileDevice.hardware_model = _profile.boardConfig.c_str();
+    _profileDevice.board_id = _profile.boardID;
+    _profileDevice.chip_id = _profile.chipID;
+    _profileDevice.display_name = _profile.productType.c_str();
+    _client->device = &_profileDevice;
+}
+
+void futurerestore::loadKnownDeviceProfile() {
+    device_profile_store store(profilesPath);
+    try {
+        uint64_t ecid = getDeviceEcid();
+        _profile = device_profile();
+        _profile.ecid = ecid;
+        getDeviceModelNoCopy();
+        _profile.productType = _client->device->product_type;
+        _profile.boardConfig = _client->device->hardware_model;
+        _profile.chipID = _client->device->chip_id;
+        _profile.boardID = _client->device->board_id;
+        //the device itself stays the source of truth, a stored profile only adds what can't be queried anymore
+        device_profile stored;
+        if (store.load(ecid, stored)) {
+            if (stored.chipID == _profile.chipID && stored.boardID == _profile.boardID) {
+                _profile.bbgcid = stored.bbgcid;
+                info("[PROFILE] %s (%s) was seen before, using its stored profile\n", _profile.productType.c_str(),
+                     _profile.boardConfig.c_str());
+                return;
+            }
+            info("[PROFILE] stored profile of %016" PRIx64 " doesn't match the device, replacing it\n", ecid);
+        }
+        store.save(_profile);
+    } catch (tihmstar::exception &e) {
+        debug("[PROFILE] not storing the device profile: %s", e.what());
+    }
+}
+
 uint64_t futurerestore::getDeviceEcid() {
     retassure(_didInit, "did not init\n");
-    uint64_t ecid;
-    get_ecid(_client, &ecid);
-    return ecid;
+    if (_preflight) return _profile.ecid;
+    return _deviceInfo.ecid(deviceEventsSubscribed(), [this] {
+        uint64_t ecid = 0;
+        get_ecid(_client, &ecid);
+        return ecid;
+    });
 }
 
 int futurerestore::getDeviceMode(bool reRequest) {
@@ -172,10 +346,32 @@ int futurerestore::getDeviceMode(bool reRequest) {
     } else {
         dfu_client_free(_client);
         recovery_client_free(_client);
-        return check_mode(_client);
+        return _deviceInfo.mode(deviceEventsSubscribed(), [this] {
+            int mode = check_mode(_client);
+            reportDeviceMode(_client);
+            return mode;
+        });
     }
 }
 
+//for loops waiting on a device that might not send events
+int futurerestore::pollDeviceMode() {
+    _deviceInfo.invalidate();
+    return getDeviceMode(true);
+}
+
+std::string futurerestore::getApNonce() {
+    return _deviceInfo.apNonce(deviceEventsSubscribed(), [this] {
+        unsigned char *nonce = nullptr;
+        int nonceSize = 0;
+        cleanup([&] {
+            safeFree(nonce);
+        });
+        recovery_get_ap_nonce(_client, &nonce, &nonceSize);
+        return (nonce && nonceSize > 0) ? std::string((char *) nonce, nonceSize) : std::string();
+    });
+}
+
 void futurerestore::putDeviceIntoRecovery() {
     retassure(_didInit, "did not init\n");
 
@@ -186,9 +382,7 @@ void futurerestore::putDeviceIntoRecovery() {
     getDeviceMode(false);
     info("Found device in %s mode\n", _client->mode->string);
     if (_client->mode == MODE_NORMAL) {
-        irecv_device_event_subscribe(&_client->irecv_e_ctx, irecv_event_cb, _client);
-        idevice_event_subscribe(idevice_event_cb, _client);
-        _client->idevice_e_ctx = (void *) idevice_event_cb;
+        subscribeDeviceEvents();
 #ifdef HAVE_LIBIPATCHER
         retassure(!_isPwnDfu, "isPwnDfu enabled, but device was found in normal mode\n");
 #endif
@@ -224,17 +418,120 @@ void futurerestore::setAutoboot(bool val) {
     if (!_client->recovery) {
         retassure(!recovery_client_new(_client), "Could not connect to device in recovery mode.\n");
     }
+    //auto-boot lives in nvram, it only has to be written again once the device went through another mode
+    if (_autoboot == (int) val) return;
     retassure(!recovery_set_autoboot(_client, val), "Setting auto-boot failed?!\n");
+    _autoboot = val;
 }
 
 void futurerestore::exitRecovery() {
     setAutoboot(true);
     recovery_send_reset(_client);
     recovery_client_free(_client);
+    _deviceInfo.invalidate();
+}
+
+void futurerestore::loadDeviceProfile(const std::string &profilePath) {
+    plist_t profile = loadPlistFromFile(profilePath.c_str());
+    cleanup([&] {
+        safeFreeCustom(profile, plist_free);
+    });
+    retassure(profile, "failed to load device profile %s\n", profilePath.c_str());
+    _profile = device_profile::fromPlist(profile);
+    retassure(_profile.isImage4Supported(), "preflight is only supported for 64-bit devices\n");
+
+    useProfileDevice();
+    _client->ecid = _profile.ecid;
+    _client->image4supported = 1;
+    _preflight = true;
+    _didInit = true;
+    info("[PREFLIGHT] using device profile %s for %s (%s)\n", profilePath.c_str(), _profile.productType.c_str(),
+         _profile.boardConfig.c_str());
+}
+
+void futurerestore::saveDeviceProfile(const std::string &profilePath) {
+    retassure(_didInit, "did not init\n");
+    device_profile profile;
+    getDeviceModelNoCopy();
+    profile.ecid = getDeviceEcid();
+    profile.productType = _client->device->product_type;
+    profile.boardConfig = _client->device->hardware_model;
+    profile.chipID = _client->device->chip_id;
+    profile.boardID = _client->device->board_id;
+    if (getDeviceMode(false) == _MODE_NORMAL) {
+        profile.bbgcid = getBasebandGoldCertIDFromDevice();
+    } else {
+        info("[PREFLIGHT] BasebandGoldCertID can only be read in normal mode, not saving it\n");
+    }
+    if (getDeviceMode(false) == _MODE_RECOVERY) {
+        unsigned char *nonce = nullptr;
+        int nonceSize = 0;
+        if (!_client->recovery) recovery_client_new(_client);
+        if (_client->recovery && !recovery_get_ap_nonce(_client, &nonce, &nonceSize) && nonce)
+            profile.apNonce.assign((char *) nonce, nonceSize);
+        safeFree(nonce);
+    }
+    plist_t plist = profile.toPlist();
+    char *xml = nullptr;
+    uint32_t xmlSize = 0;
+    cleanup([&] {
+        safeFree(xml);
+        plist_free(plist);
+    });
+    plist_to_xml(plist, &xml, &xmlSize);
+    saveStringToFile(std::string(xml, xmlSize), profilePath);
+    info("Saved device profile of %s to %s\n", profile.productType.c_str(), profilePath.c_str());
+}
+
+void futurerestore::openSession(const char *resumeId, uint64_t ecid) {
+    delete _session;
+    _session = nullptr;
+    _session = new restore_session(sessionsPath, resumeId ? resumeId : "");
+    _sessionEcid = ecid;
+    if (_session->resumed()) {
+        info("Resuming session %s\n", _session->id().c_str());
+    } else {
+        info("Session %s (pass --resume %s to skip the phases that completed if this restore fails)\n",
+             _session->id().c_str(), _session->id().c_str());
+    }
+}
+
+static std::string getPhaseInputs(const std::string &phase, uint64_t ecid, const std::vector<std::string> &inputs) {
+    std::vector<std::string> all{phase, std::to_string(ecid)};
+    all.insert(all.end(), inputs.begin(), inputs.end());
+    return restore_session::hashInputs(all);
+}
+
+bool futurerestore::isPhaseDone(const std::string &phase, const std::vector<std::string> &inputs,
+                                restore_session::values *outputs) {
+    restore_session::values recorded;
+    if (!_session || !_session->lookup(phase, getPhaseInputs(phase, _sessionEcid, inputs), recorded)) return false;
+    if (outputs) *outputs = std::move(recorded);
+    info("Skipping %s, it completed in session %s\n", phase.c_str(), _session->id().c_str());
+    return true;
+}
+
+void futurerestore::setPhaseDone(const std::string &phase, const std::vector<std::string> &inputs,
+                                 const std::vector<std::string> &files, const restore_session::values &outputs) {
+    if (_session) _session->checkpoint(phase, getPhaseInputs(phase, _sessionEcid, inputs), outputs, files);
+}
+
+int futurerestore::preflightNonceMatch() {
+    if (_profile.apNonce.empty()) {
+        //without a nonce any loaded ticket could end up being used, validate the first one like pwnDFU does
+        warning("[PREFLIGHT] device profile has no ApNonce, validating the first APTicket\n");
+        return _im4ms.empty() ? -1 : 0;
+    }
+    auto matches = _nonceTable.find(_profile.apNonce.data(), _profile.apNonce.size());
+    return matches ? (int) matches->front() : -1;
 }
 
 plist_t futurerestore::nonceMatchesApTickets() {
     retassure(_didInit, "did not init\n");
+    if (_preflight) {
+        auto match = preflightNonceMatch();
+        return (match == -1) ? nullptr : _aptickets[match];
+    }
 
     if (getDeviceMode(true) != _MODE_RECOVERY) {
         if (getDeviceMode(false) != _MODE_DFU || *_client->version != '9')
@@ -243,29 +540,22 @@ plist_t futurerestore::nonceMatchesApTickets() {
             _rerestoreiOS9 = (info("Detected iOS 9.x 32-bit re-restore, proceeding in DFU mode\n"), true);
     }
 
-    unsigned char *realnonce;
-    int realNonceSize = 0;
+    std::string realnonce;
     if (_rerestoreiOS9) {
         info("Skipping ApNonce check\n");
     } else {
-        recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
+        realnonce = getApNonce();
 
-        info("Got ApNonce from device: ");
-        int i = 0;
-        for (i = 0; i < realNonceSize; i++) {
-            info("%02x ", ((unsigned char *) realnonce)[i]);
-        }
-        info("\n");
+        info("Got ApNonce from device: %s\n",
+             hexString((const unsigned char *) realnonce.data(), realnonce.size(), " ").c_str());
     }
+    size_t realNonceSize = realnonce.size();
 
     vector<const char *> nonces;
 
     if (_client->image4supported) {
-        for (int i = 0; i < _im4ms.size(); i++) {
-            auto nonce = img4tool::getValFromIM4M({_im4ms[i].first, _im4ms[i].second}, 'BNCH');
-            if (nonce.payloadSize() == realNonceSize && memcmp(realnonce, nonce.payload(), realNonceSize) == 0)
-                return _aptickets[i];
-        }
+        if (auto matches = _nonceTable.find((const unsigned char *) realnonce.data(), realNonceSize))
+            return _aptickets[matches->front()];
     } else {
         for (int i = 0; i < _im4ms.size(); i++) {
             size_t ticketNonceSize = 0;
@@ -276,7 +566,8 @@ plist_t futurerestore::nonceMatchesApTickets() {
                 ticketNonceSize = n.second;
                 nonce = n.first;
             } catch (...) {}
-            if (memcmp(realnonce, nonce, ticketNonceSize) == 0 &&
+            if ((!ticketNonceSize || (ticketNonceSize <= realNonceSize &&
+                                      memcmp(realnonce.data(), nonce, ticketNonceSize) == 0)) &&
                 ((ticketNonceSize == realNonceSize && realNonceSize + ticketNonceSize > 0) ||
                  (!ticketNonceSize && *_client->version == '9' &&
                   (getDeviceMode(false) == _MODE_DFU ||
@@ -296,21 +587,20 @@ plist_t futurerestore::nonceMatchesApTickets() {
 
 std::pair<const char *, size_t> futurerestore::nonceMatchesIM4Ms() {
     retassure(_didInit, "did not init\n");
+    if (_preflight) {
+        auto match = preflightNonceMatch();
+        return (match == -1) ? std::pair<const char *, size_t>{NULL, 0} : _im4ms[match];
+    }
 
     retassure(getDeviceMode(true) == _MODE_RECOVERY, "Device is not in recovery mode, can't check ApNonce\n");
 
-    unsigned char *realnonce;
-    int realNonceSize = 0;
-    recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
+    std::string realnonce = getApNonce();
 
     vector<const char *> nonces;
 
     if (_client->image4supported) {
-        for (auto &_im4m: _im4ms) {
-            auto nonce = img4tool::getValFromIM4M({_im4m.first, _im4m.second}, 'BNCH');
-            if (nonce.payloadSize() == realNonceSize && memcmp(realnonce, nonce.payload(), realNonceSize) == 0)
-                return _im4m;
-        }
+        if (auto matches = _nonceTable.find((const unsigned char *) realnonce.data(), realnonce.size()))
+            return _im4ms[matches->front()];
     } else {
         for (auto &_im4m: _im4ms) {
             size_t ticketNonceSize = 0;
@@ -323,47 +613,86 @@ std::pair<const char *, size_t> futurerestore::nonceMatchesIM4Ms() {
             } catch (...) {
                 //
             }
-            if (memcmp(realnonce, nonce, ticketNonceSize) == 0) return _im4m;
+            if (ticketNonceSize <= realnonce.size() && memcmp(realnonce.data(), nonce, ticketNonceSize) == 0)
+                return _im4m;
         }
     }
 
     return {NULL, 0};
 }
 
+bool futurerestore::waitForRecoveryReconnect(unsigned int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    bool disconnected = false;
+    while (true) {
+        if (_client->mode == MODE_UNKNOWN) {
+            disconnected = true;
+        } else if (disconnected && _client->mode == MODE_RECOVERY) {
+            return true;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) return false;
+        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, (unsigned int) remaining);
+    }
+}
+
 void futurerestore::waitForNonce(vector<const char *> nonces, size_t nonceSize) {
     retassure(_didInit, "did not init\n");
     setAutoboot(false);
 
-    unsigned char *realnonce;
-    int realNonceSize = 0;
+    std::string realnonce;
+    collision_stats stats;
+    cleanup([&] {
+        stats.printHistogram("[COLLISION]");
+    });
+
+    std::unordered_map<std::string, int> wanted;
+    for (int i = 0; i < nonces.size(); i++) {
+        wanted.emplace(std::string(nonces[i], nonceSize), i);
+    }
 
     for (auto nonce: nonces) {
-        info("waiting for ApNonce: ");
-        int i = 0;
-        for (i = 0; i < nonceSize; i++) {
-            info("%02x ", ((unsigned char *) nonce)[i]);
-        }
-        info("\n");
+        info("waiting for ApNonce: %s\n", hexString((const unsigned char *) nonce, nonceSize, " ").c_str());
     }
 
+    //follow the reboots through usb events instead of polling, which needs the ECID to match them to our device
+    if (!_client->ecid) get_ecid(_client, &_client->ecid);
+    subscribeDeviceEvents();
+
     do {
-        if (realNonceSize) {
+        if (!realnonce.empty()) {
+            auto resetTime = std::chrono::steady_clock::now();
+            mutex_lock(&_client->device_event_mutex);
             recovery_send_reset(_client);
             recovery_client_free(_client);
-            usleep(1 * USEC_PER_SEC);
-        }
-        while (getDeviceMode(true) != _MODE_RECOVERY) usleep(USEC_PER_SEC * 0.5);
-        retassure(!recovery_client_new(_client), "Could not connect to device in recovery mode\n");
-
-        recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
-        info("Got ApNonce from device: ");
-        for (int i = 0; i < realNonceSize; i++) {
-            info("%02x ", realnonce[i]);
+            _deviceInfo.invalidate();
+            bool reconnected = waitForRecoveryReconnect(30000);
+            mutex_unlock(&_client->device_event_mutex);
+            if (!reconnected) {
+                debug("[COLLISION] no reconnect event, falling back to polling\n");
+                while (pollDeviceMode() != _MODE_RECOVERY) usleep(USEC_PER_SEC * 0.5);
+            }
+            stats.addAttempt(std::chrono::duration<double>(std::chrono::steady_clock::now() - resetTime).count());
+        } else if (getDeviceMode(false) != _MODE_RECOVERY) {
+            while (pollDeviceMode() != _MODE_RECOVERY) usleep(USEC_PER_SEC * 0.5);
         }
-        info("\n");
-        for (int i = 0; i < nonces.size(); i++) {
-            if (memcmp(realnonce, (unsigned const char *) nonces[i], realNonceSize) == 0) _foundnonce = i;
+        if (!_client->recovery) {
+            retassure(!recovery_client_new(_client), "Could not connect to device in recovery mode\n");
         }
+
+        realnonce = getApNonce();
+        retassure(!realnonce.empty(), "Failed to read ApNonce from device\n");
+        info("Got ApNonce from device: %s\n",
+             hexString((const unsigned char *) realnonce.data(), realnonce.size(), " ").c_str());
+        if (stats.attempts()) stats.printProgress("[COLLISION]");
+        progress_stream::shared().event("apnonce", {
+                {"nonce",    progress_stream::quote(hexString((const unsigned char *) realnonce.data(), realnonce.size(), ""))},
+                {"attempts", std::to_string(stats.attempts())},
+                {"rate",     std::to_string(stats.attemptsPerMinute())}
+        });
+        auto match = wanted.find(realnonce);
+        if (match != wanted.end()) _foundnonce = match->second;
     } while (_foundnonce == -1);
     info("Device has requested ApNonce now\n");
 
@@ -378,57 +707,112 @@ void futurerestore::waitForNonce() {
 
     retassure(_client->image4supported, "Error: ApNonce collision function is not supported on 32-bit devices\n");
 
-    for (auto im4m: _im4ms) {
-        auto nonce = img4tool::getValFromIM4M({im4m.first, im4m.second}, 'BNCH');
+    for (size_t i = 0; i < _nonceTable.size(); i++) {
+        auto &nonce = _nonceTable.at(i).bnch;
+        retassure(!nonce.empty(), "IM4M does not contain an ApNonce!");
         if (!nonceSize) {
-            nonceSize = nonce.payloadSize();
+            nonceSize = nonce.size();
         }
-        retassure(nonceSize == nonce.payloadSize(), "Nonces have different lengths!");
-        nonces.push_back((const char *) nonce.payload());
+        retassure(nonceSize == nonce.size(), "Nonces have different lengths!");
+        nonces.push_back(nonce.data());
     }
 
     waitForNonce(nonces, nonceSize);
 }
 
-void futurerestore::loadAPTickets(const vector<const char *> &apticketPaths) {
-    for (auto apticketPath: apticketPaths) {
-        plist_t apticket = nullptr;
-        char *im4m = nullptr;
-        struct stat fst{};
-
-        retassure(!stat(apticketPath, &fst), "failed to load APTicket at %s\n", apticketPath);
-
-        gzFile zf = gzopen(apticketPath, "rb");
-        if (zf) {
-            int blen = 0;
-            int readsize = 16384; //0x4000
-            int bufsize = readsize;
-            std::allocator<uint8_t> alloc;
-            char *bin = (char *)alloc.allocate(bufsize);
-            char *p = bin;
-            do {
-                int bytes_read = gzread(zf, p, readsize);
-                retassure(bytes_read > 0, "Error reading gz compressed data\n");
-                blen += bytes_read;
-                if (bytes_read < readsize) {
-                    if (gzeof(zf)) {
-                        bufsize += bytes_read;
-                        break;
-                    }
+//set while idevicerestore may call get_custom_component, which has no way to reach the futurerestore owning it
+static ipsw_archive *customComponentArchive = nullptr;
+
+//the IPSW is opened and its central directory parsed once, every later lookup is served from that.
+//archives stay open as long as this futurerestore, so the returned pointer can't go stale
+ipsw_archive *futurerestore::getSessionIPSW(const char *ipswPath) {
+    std::lock_guard<std::mutex> guard(_ipswArchivesLock);
+    if (!ipswPath) return nullptr;
+    auto known = _ipswArchives.find(ipswPath);
+    if (known != _ipswArchives.end()) return known->second.get();
+    auto &archive = _ipswArchives[ipswPath];
+    try {
+        archive.reset(new ipsw_archive(ipswPath, ipswCachePath));
+    } catch (tihmstar::exception &e) {
+        //e.g. an extracted IPSW directory, idevicerestore handles those
+        debug("[IPSW] not opening %s directly: %s", ipswPath, e.what());
+    }
+    return archive.get();
+}
+
+static plist_t loadBuildManifestFrom(ipsw_archive *archive, const char *ipswPath) {
+    plist_t buildmanifest = nullptr;
+    if (archive) {
+        try {
+            buildmanifest = archive->getBuildManifest();
+            if (archive->manifestFromCache()) debug("[IPSW] using cached BuildManifest of %s\n", ipswPath);
+        } catch (tihmstar::exception &e) {
+            debug("[IPSW] %s", e.what());
+        }
+    }
+    if (!buildmanifest) {
+        int unused;
+        retassure(!ipsw_extract_build_manifest(ipswPath, &buildmanifest, &unused) && buildmanifest,
+                  "ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", ipswPath);
+    }
+    return buildmanifest;
+}
+
+plist_t futurerestore::loadBuildManifest(const char *ipswPath) {
+    std::unique_ptr<ipsw_archive> archive;
+    try {
+        archive.reset(new ipsw_archive(ipswPath, ipswCachePath));
+    } catch (tihmstar::exception &e) {
+        //not a zip, idevicerestore knows how to read it
+    }
+    return loadBuildManifestFrom(archive.get(), ipswPath);
+}
+
+plist_t futurerestore::loadAPTicketFile(const char *apticketPath) {
+    plist_t apticket = nullptr;
+    struct stat fst{};
+
+    retassure(!stat(apticketPath, &fst), "failed to load APTicket at %s\n", apticketPath);
+
+    gzFile zf = gzopen(apticketPath, "rb");
+    if (zf) {
+        int blen = 0;
+        int readsize = 16384; //0x4000
+        int bufsize = readsize;
+        std::allocator<uint8_t> alloc;
+        char *bin = (char *)alloc.allocate(bufsize);
+        char *p = bin;
+        do {
+            int bytes_read = gzread(zf, p, readsize);
+            retassure(bytes_read > 0, "Error reading gz compressed data\n");
+            blen += bytes_read;
+            if (bytes_read < readsize) {
+                if (gzeof(zf)) {
+                    bufsize += bytes_read;
+                    break;
                 }
-                bufsize += readsize;
-                bin = (char *) realloc(bin, bufsize);
-                p = bin + blen;
-            } while (!gzeof(zf));
-            gzclose(zf);
-            if (blen > 0) {
-                if (memcmp(bin, "bplist00", 8) == 0)
-                    plist_from_bin(bin, blen, &apticket);
-                else
-                    plist_from_xml(bin, blen, &apticket);
             }
-            free(bin);
+            bufsize += readsize;
+            bin = (char *) realloc(bin, bufsize);
+            p = bin + blen;
+        } while (!gzeof(zf));
+        gzclose(zf);
+        if (blen > 0) {
+            if (memcmp(bin, "bplist00", 8) == 0)
+                plist_from_bin(bin, blen, &apticket);
+            else
+                plist_from_xml(bin, blen, &apticket);
         }
+        free(bin);
+    }
+    retassure(apticket, "failed to parse APTicket at %s\n", apticketPath);
+    return apticket;
+}
+
+void futurerestore::loadAPTickets(const vector<const char *> &apticketPaths) {
+    for (auto apticketPath: apticketPaths) {
+        plist_t apticket = loadAPTicketFile(apticketPath);
+        char *im4m = nullptr;
 
         if (_isUpdateInstall) {
             if (plist_t update = plist_dict_get_item(apticket, "updateInstall")) {
@@ -455,11 +839,65 @@ void futurerestore::loadAPTickets(const vector<const char *> &apticketPaths) {
         _aptickets.push_back(apticket);
         printf("reading signing ticket %s is done\n", apticketPath);
     }
+    std::vector<std::string> ticketNames(apticketPaths.begin(), apticketPaths.end());
+
+    if (_client->image4supported && !_skipBlob) {
+        //forged or corrupted tickets are dropped here instead of failing the restore once they were selected
+        signature_cache signatures(signatureCachePath);
+        auto valid = signatures.validate(_im4ms);
+        signatures.save();
+        size_t kept = 0;
+        for (size_t i = 0; i < _im4ms.size(); i++) {
+            if (!valid[i]) {
+                error("[SIGNATURE] %s has an invalid IM4M signature, not using it\n", ticketNames[i].c_str());
+                safeFree(_im4ms[i].first);
+                safeFreeCustom(_aptickets[i], plist_free);
+                continue;
+            }
+            _im4ms[kept] = _im4ms[i];
+            _aptickets[kept] = _aptickets[i];
+            ticketNames[kept] = ticketNames[i];
+            kept++;
+        }
+        if (kept != _im4ms.size()) info("%zu of %zu APTickets have a valid signature\n", kept, _im4ms.size());
+        _im4ms.resize(kept);
+        _aptickets.resize(kept);
+        ticketNames.resize(kept);
+        retassure(!_im4ms.empty(), "none of the APTickets has a valid IM4M signature\n");
+    }
+
+    if (_client->image4supported) {
+        std::vector<nonce_table::ticket> tickets;
+        tickets.reserve(_im4ms.size());
+        for (size_t i = 0; i < _im4ms.size(); i++) {
+            nonce_table::ticket ticket;
+            ticket.name = ticketNames[i];
+            try {
+                auto nonce = img4tool::getValFromIM4M({_im4ms[i].first, _im4ms[i].second}, 'BNCH');
+                ticket.bnch.assign((const char *) nonce.payload(), nonce.payloadSize());
+            } catch (tihmstar::exception &e) {
+                //tickets without a nonce can still be used with --use-pwndfu
+            }
+            if (plist_t pGenerator = plist_dict_get_item(_aptickets[i], "generator")) {
+                char *generator = nullptr;
+                if (plist_get_node_type(pGenerator) == PLIST_STRING) plist_get_string_val(pGenerator, &generator);
+                if (generator) ticket.generator = generator;
+                safeFree(generator);
+            }
+            tickets.push_back(std::move(ticket));
+        }
+        _nonceTable.build(tickets);
+    }
 }
 
 uint64_t futurerestore::getBasebandGoldCertIDFromDevice() {
+    if (_preflight) return _profile.bbgcid;
     if (!_client->preflight_info) {
         if (normal_get_preflight_info(_client, &_client->preflight_info) == -1) {
+            if (_profile.bbgcid) {
+                info("[PROFILE] device is not in normal mode, using the BasebandGoldCertID stored for it\n");
+                return _profile.bbgcid;
+            }
             printf("[WARNING] failed to read BasebandGoldCertID from device! Is it already in recovery?\n");
             return 0;
         }
@@ -472,22 +910,32 @@ uint64_t futurerestore::getBasebandGoldCertIDFromDevice() {
     }
     uint64_t val = 0;
     plist_get_uint_val(node, &val);
+    if (val && val != _profile.bbgcid && _profile.ecid) {
+        _profile.bbgcid = val;
+        device_profile_store(profilesPath).save(_profile);
+    }
     return val;
 }
 
-char *futurerestore::getiBootBuild() {
-    if (!_ibootBuild) {
+const char *futurerestore::getiBootBuild() {
+    _ibootBuild = _deviceInfo.ibootBuild(deviceEventsSubscribed(), [this] {
         if (_client->recovery == nullptr) {
             retassure(!recovery_client_new(_client), "Error: can't create new recovery client");
         }
-        irecv_getenv(_client->recovery->client, "build-version", &_ibootBuild);
-        retassure(_ibootBuild, "Error: can't get a build-version");
-    }
-    return _ibootBuild;
+        char *build = nullptr;
+        cleanup([&] {
+            safeFree(build);
+        });
+        irecv_getenv(_client->recovery->client, "build-version", &build);
+        retassure(build, "Error: can't get a build-version");
+        return std::string(build);
+    });
+    return _ibootBuild.c_str();
 }
 
 pair<ptr_smart<char *>, size_t>
-getIPSWComponent(struct idevicerestore_client_t *client, plist_t build_identity, const string &component) {
+getIPSWComponent(struct idevicerestore_client_t *client, ipsw_archive *archive, plist_t build_identity,
+                 const string &component) {
     ptr_smart<char *> path;
     unsigned char *component_data = nullptr;
     unsigned int component_size = 0;
@@ -497,6 +945,16 @@ getIPSWComponent(struct idevicerestore_client_t *client, plist_t build_identity,
                   "ERROR: Unable to get path for component '%s'\n", component.c_str());
     }
 
+    if (archive) {
+        if (archive->exists((char *) path)) {
+            auto data = archive->extract((char *) path);
+            retassure(component_data = (unsigned char *) malloc(data.size() ? data.size() : 1),
+                      "ERROR: Out of memory extracting component: %s\n", component.c_str());
+            memcpy(component_data, data.data(), data.size());
+            return {(char *) component_data, data.size()};
+        }
+    }
+
     retassure(!extract_component(client->ipsw, (char *) path, &component_data, &component_size),
               "ERROR: Unable to extract component: %s\n", component.c_str());
 
@@ -523,9 +981,7 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, std::string bootarg
     std::string ibec_name(futurerestoreTempPath + "/ibec.");
 
     /* Assure device is in dfu */
-    irecv_device_event_subscribe(&_client->irecv_e_ctx, irecv_event_cb, _client);
-    idevice_event_subscribe(idevice_event_cb, _client);
-    _client->idevice_e_ctx = (void *) idevice_event_cb;
+    subscribeDeviceEvents();
     getDeviceMode(true);
     mutex_lock(&_client->device_event_mutex);
     cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 1000);
@@ -607,47 +1063,53 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, std::string bootarg
 
     if (!iBSS.first && !_noIBSS) {
         info("Patching iBSS\n");
-        iBSS = getIPSWComponent(_client, build_identity, "iBSS");
+        iBSS = getIPSWComponent(_client, getSessionIPSW(_client->ipsw), build_identity, "iBSS");
         iBSS = move(libipatcher::patchiBSS((char *) iBSS.first, iBSS.second, iBSSKeys));
     }
     if (!iBEC.first) {
         info("Patching iBEC\n");
-        iBEC = getIPSWComponent(_client, build_identity, "iBEC");
+        iBEC = getIPSWComponent(_client, getSessionIPSW(_client->ipsw), build_identity, "iBEC");
         iBEC = move(libipatcher::patchiBEC((char *) iBEC.first, iBEC.second, iBECKeys, std::move(bootargs)));
     }
 
     if (_client->image4supported) {
         /* if this is 64-bit, we need to back IM4P to IMG4
            also due to the nature of iBoot64Patchers sigpatches we need to stich a valid signed im4m to it (but nonce is ignored) */
+        auto repack = [&](const char *name, pair<ptr_smart<char *>, size_t> &im4p, const std::string &path) {
+            info("Repacking patched %s as IMG4\n", name);
+            img4_builder img4((char *) im4p.first, im4p.second, _im4ms[0].first, _im4ms[0].second);
+            img4.writeTo(path);
+            pair<ptr_smart<char *>, size_t> packed;
+            packed = move(img4.assemble());
+            debug("[IMG4] %s: %zu bytes, %zu copied in memory\n", name, img4.size(), img4.copied());
+            std::swap(im4p, packed); //frees the IM4P once packed goes out of scope
+        };
+        if (!cache1 && !_noIBSS) repack("iBSS", iBSS, ibss_name);
+        if (!cache2) repack("iBEC", iBEC, ibec_name);
+    } else {
         if (!cache1 && !_noIBSS) {
-            info("Repacking patched iBSS as IMG4\n");
-            iBSS = move(libipatcher::packIM4PToIMG4(iBSS.first, iBSS.second, _im4ms[0].first, _im4ms[0].second));
+            retassure(ibss = fopen(ibss_name.c_str(), "wb"), "can't save patched ibss at %s\n", ibss_name.c_str());
+            retassure(rv = fwrite(iBSS.first, iBSS.second, 1, ibss), "can't save patched ibss at %s\n",
+                      ibss_name.c_str());
+            fflush(ibss);
+            fclose(ibss);
         }
         if (!cache2) {
-            info("Repacking patched iBEC as IMG4\n");
-            iBEC = move(libipatcher::packIM4PToIMG4(iBEC.first, iBEC.second, _im4ms[0].first, _im4ms[0].second));
+            retassure(ibec = fopen(ibec_name.c_str(), "wb"), "can't save patched ibec at %s\n", ibec_name.c_str());
+            retassure(rv = fwrite(iBEC.first, iBEC.second, 1, ibec), "can't save patched ibec at %s\n",
+                      ibec_name.c_str());
+            fflush(ibec);
+            fclose(ibec);
         }
     }
 
-    if (!_noIBSS) {
-        retassure(ibss = fopen(ibss_name.c_str(), "wb"), "can't save patched ibss at %s\n", ibss_name.c_str());
-        retassure(rv = fwrite(iBSS.first, iBSS.second, 1, ibss), "can't save patched ibss at %s\n", ibss_name.c_str());
-        fflush(ibss);
-        fclose(ibss);
-    }
-    retassure(ibec = fopen(ibec_name.c_str(), "wb"), "can't save patched ibec at %s\n", ibec_name.c_str());
-    retassure(rv = fwrite(iBEC.first, iBEC.second, 1, ibec), "can't save patched ibec at %s\n", ibec_name.c_str());
-    fflush(ibec);
-    fclose(ibec);
-
     /* Send and boot bootloaders */
     irecv_error_t err = IRECV_E_UNKNOWN_ERROR;
     if (!_noIBSS) {
         /* send iBSS */
-        info("Sending %s (%lu bytes)...\n", "iBSS", iBSS.second);
         mutex_lock(&_client->device_event_mutex);
-        err = irecv_send_buffer(_client->dfu->client, (unsigned char *) (char *) iBSS.first,
-                                (unsigned long) iBSS.second, 1);
+        err = sendBootloader(_client->dfu->client, "iBSS", (const char *) iBSS.first,
+                             (unsigned long) iBSS.second);
         retassure(err == IRECV_E_SUCCESS, "ERROR: Unable to send %s component: %s\n", "iBSS", irecv_strerror(err));
 
         info("Booting iBSS, waiting for device to disconnect...\n");
@@ -670,10 +1132,9 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, std::string bootarg
                       "Failed to connect to device in DFU Mode!");
             retassure(irecv_usb_set_configuration(_client->dfu->client, 1) >= 0, "ERROR: set configuration failed\n");
             /* send iBEC */
-            info("Sending %s (%lu bytes)...\n", "iBEC", iBEC.second);
             mutex_lock(&_client->device_event_mutex);
-            err = irecv_send_buffer(_client->dfu->client, (unsigned char *) (char *) iBEC.first,
-                                    (unsigned long) iBEC.second, 1);
+            err = sendBootloader(_client->dfu->client, "iBEC", (const char *) iBEC.first,
+                                 (unsigned long) iBEC.second);
             retassure(err == IRECV_E_SUCCESS, "ERROR: Unable to send %s component: %s\n", "iBEC", irecv_strerror(err));
 
             info("Booting iBEC, waiting for device to disconnect...\n");
@@ -760,10 +1221,9 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, std::string bootarg
             retassure(irecv_usb_set_configuration(_client->dfu->client, 1) >= 0, "ERROR: set configuration failed\n");
 
             /* send iBEC */
-            info("Sending %s (%lu bytes)...\n", "iBEC", iBEC.second);
             mutex_lock(&_client->device_event_mutex);
-            err = irecv_send_buffer(_client->dfu->client, (unsigned char *) (char *) iBEC.first,
-                                    (unsigned long) iBEC.second, 1);
+            err = sendBootloader(_client->dfu->client, "iBEC", (const char *) iBEC.first,
+                                 (unsigned long) iBEC.second);
             retassure(err == IRECV_E_SUCCESS, "ERROR: Unable to send %s component: %s\n", "iBEC", irecv_strerror(err));
             retassure(((irecv_send_command(_client->dfu->client, "go") == IRECV_E_SUCCESS) ||
                        (mutex_unlock(&_client->device_event_mutex), 0)),
@@ -795,10 +1255,9 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, std::string bootarg
                       "Failed to connect to device in Recovery Mode!");
             retassure(irecv_usb_set_configuration(_client->dfu->client, 1) >= 0, "ERROR: set configuration failed\n");
             /* send iBEC */
-            info("Sending %s (%lu bytes)...\n", "iBEC", iBEC.second);
             mutex_lock(&_client->device_event_mutex);
-            err = irecv_send_buffer(_client->dfu->client, (unsigned char *) (char *) iBEC.first,
-                                    (unsigned long) iBEC.second, 1);
+            err = sendBootloader(_client->dfu->client, "iBEC", (const char *) iBEC.first,
+                                 (unsigned long) iBEC.second);
             retassure(err == IRECV_E_SUCCESS, "ERROR: Unable to send %s component: %s\n", "iBEC", irecv_strerror(err));
             retassure(((irecv_send_command(_client->dfu->client, "go") == IRECV_E_SUCCESS) ||
                        (mutex_unlock(&_client->device_event_mutex), 0)),
@@ -860,10 +1319,20 @@ void get_custom_component(struct idevicerestore_client_t *client, plist_t build_
     reterror("compiled without libipatcher");
 #else
     try {
-        auto comp = getIPSWComponent(client, build_identity, component);
+        auto comp = getIPSWComponent(client, customComponentArchive, build_identity, component);
+        decrypted_cache cache(decryptedCachePath);
+        auto key = decrypted_cache::getKey(client->device->product_type, client->build, component,
+                                           (char *) comp.first, comp.second);
+        size_t cachedSize = 0;
+        if (char *cached = cache.load(key, cachedSize)) {
+            *data = (unsigned char *) cached;
+            *size = (unsigned int) cachedSize;
+            return;
+        }
         comp = move(libipatcher::decryptFile3((char *) comp.first, comp.second,
                                               libipatcher::getFirmwareKey(client->device->product_type, client->build,
                                                                           component)));
+        cache.store(key, (char *) comp.first, comp.second);
         *data = (unsigned char *) (char *) comp.first;
         *size = comp.second;
         comp.first = NULL; //don't free on destruction
@@ -874,50 +1343,117 @@ void get_custom_component(struct idevicerestore_client_t *client, plist_t build_
 #endif
 }
 
-void futurerestore::doRestore(const char *ipsw) {
+//what idevicerestore sends through get_custom_component on the way to restore mode
+static const char *pwnRecoveryComponents[] = {"RestoreLogo", "RestoreDeviceTree", "RestoreRamDisk",
+                                              "RestoreKernelCache"};
+
+void futurerestore::decryptComponents(const char *ipsw) {
+#ifndef HAVE_LIBIPATCHER
+    reterror("compiled without libipatcher");
+#else
+    retassure(!_client->image4supported, "only 32-bit pwnDFU restores send decrypted components\n");
     plist_t buildmanifest = nullptr;
-    int delete_fs = 0;
-    char *filesystem = nullptr;
     cleanup([&] {
-        info("Cleaning up...\n");
         safeFreeCustom(buildmanifest, plist_free);
-        if (delete_fs && filesystem) unlink(filesystem);
     });
-    struct idevicerestore_client_t *client = _client;
-    plist_t build_identity = nullptr;
-
-    client->ipsw = strdup(ipsw);
-    if (_noRestore) client->flags |= FLAG_NO_RESTORE;
-    if (!_isUpdateInstall) client->flags |= FLAG_ERASE;
-
-    irecv_device_event_subscribe(&client->irecv_e_ctx, irecv_event_cb, client);
-    idevice_event_subscribe(idevice_event_cb, client);
-    client->idevice_e_ctx = (void *) idevice_event_cb;
-
-    mutex_lock(&client->device_event_mutex);
-    cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
+    retassure(buildmanifest = loadBuildManifestFrom(getSessionIPSW(ipsw), ipsw), "failed to load BuildManifest\n");
+    safeFree(_client->ipsw);
+    _client->ipsw = strdup(ipsw);
+    build_manifest_get_version_information(buildmanifest, _client);
+    plist_t build_identity = getBuildidentityWithBoardconfig(buildmanifest, getDeviceBoardNoCopy(), _isUpdateInstall);
+    retassure(build_identity, "ERROR: Unable to find any build identities for iPSW\n");
+    std::string productType = getDeviceModelNoCopy();
+    std::string build = _client->build;
+
+    struct job {
+        const char *component;
+        pair<ptr_smart<char *>, size_t> source;
+        std::string key;
+        std::string error;
+    };
+    decrypted_cache cache(decryptedCachePath);
+    std::vector<job> jobs;
+    //extracting is served from the mapped iPSW, only fetching keys and decrypting are spread over the cores
+    for (auto component: pwnRecoveryComponents) {
+        if (!plist_dict_get_item(plist_dict_get_item(build_identity, "Manifest"), component)) continue;
+        job j{component, getIPSWComponent(_client, getSessionIPSW(_client->ipsw), build_identity, component), "", ""};
+        j.key = decrypted_cache::getKey(productType, build, component, (char *) j.source.first, j.source.second);
+        if (cache.contains(j.key)) {
+            info("[DECRYPT] %s is already cached\n", component);
+            continue;
+        }
+        jobs.push_back(std::move(j));
+    }
+    threadpool::shared().parallelFor(jobs.size(), [&](size_t i) {
+        auto &j = jobs[i];
+        try {
+            pair<ptr_smart<char *>, size_t> comp;
+            comp = move(libipatcher::decryptFile3((char *) j.source.first, j.source.second,
+                                                  libipatcher::getFirmwareKey(productType, build, j.component)));
+            cache.store(j.key, (char *) comp.first, comp.second);
+        } catch (tihmstar::exception &e) {
+            j.error = e.what();
+            j.error.erase(j.error.find_last_not_of('\n') + 1);
+        }
+    });
+    size_t failed = 0;
+    for (auto &j: jobs) {
+        if (j.error.empty()) {
+            info("[DECRYPT] decrypted %s\n", j.component);
+        } else {
+            error("[DECRYPT] %s: %s\n", j.component, j.error.c_str());
+            failed++;
+        }
+    }
+    retassure(!failed, "failed to decrypt %zu components of %s %s\n", failed, productType.c_str(), build.c_str());
+    info("[DECRYPT] all components of %s %s are cached in %s\n", productType.c_str(), build.c_str(),
+         decryptedCachePath.c_str());
+#endif
+}
 
-    retassure(client->mode != MODE_UNKNOWN, "Unable to discover device mode. Please make sure a device is attached.\n");
-    if (client->mode != MODE_RECOVERY) {
-        retassure(client->mode == MODE_DFU, "Device is in unexpected mode detected!");
-        retassure(_enterPwnRecoveryRequested, "Device is in DFU mode detected, but we were expecting recovery mode!");
-    } else {
-        retassure(!_enterPwnRecoveryRequested, "--use-pwndfu was specified, but device found in recovery mode!");
+void futurerestore::verifyIPSW(const char *ipswPath) {
+    ipsw_archive *archive = getSessionIPSW(ipswPath);
+    if (!archive) {
+        info("Not verifying %s, it is not a zip file\n", ipswPath);
+        return;
+    }
+    if (archive->isVerified()) {
+        info("iPSW was verified before, skipping integrity check\n");
+        return;
     }
+    info("Verifying iPSW integrity\n");
+    auto start = std::chrono::steady_clock::now();
+    uint64_t checked = archive->verify(threadpool::shared(), [](uint64_t done, uint64_t total) {
+        progress_stream::shared().progress("iPSW verification", done, total);
+    });
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    info("Verified %" PRIu64 " MiB in %.2f seconds\n", checked >> 20, elapsed);
+    archive->markVerified();
+}
 
-    info("Found device in %s mode\n", client->mode->string);
-    mutex_unlock(&client->device_event_mutex);
+void futurerestore::prepareIPSW(const char *ipswPath) {
+    plist_t buildmanifest = loadBuildManifestFrom(getSessionIPSW(ipswPath), ipswPath);
+    plist_free(buildmanifest);
+    if (!_skipIPSWVerify) verifyIPSW(ipswPath);
+}
 
-    info("Identified device as %s, %s\n", getDeviceBoardNoCopy(), getDeviceModelNoCopy());
+/*
+ * Everything doRestore checks before it touches the device: ticket selection, ECID,
+ * build identities and component digests. Also used by preflight, where no device is attached.
+ */
+void futurerestore::validateRestore(plist_t &buildmanifest, plist_t &build_identity) {
+    struct idevicerestore_client_t *client = _client;
 
+    _stages.begin("BuildManifest");
     retassure(!access(client->ipsw, F_OK), "ERROR: Firmware file %s does not exist.\n",
               client->ipsw); // verify if ipsw file exists
 
     info("Extracting BuildManifest from iPSW\n");
-    {
-        int unused;
-        retassure(!ipsw_extract_build_manifest(client->ipsw, &buildmanifest, &unused),
-                  "ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+    buildmanifest = loadBuildManifestFrom(getSessionIPSW(client->ipsw), client->ipsw);
+
+    if (!_skipIPSWVerify) {
+        _stages.begin("iPSW verification");
+        verifyIPSW(client->ipsw);
     }
 
     /* check if device type is supported by the given build manifest */
@@ -928,9 +1464,10 @@ void futurerestore::doRestore(const char *ipsw) {
     build_manifest_get_version_information(buildmanifest, client);
     info("Product version: %s\n", client->version);
     info("Product build: %s Major: %d\n", client->build, client->build_major);
-    client->image4supported = is_image4_supported(client);
+    if (!_preflight) client->image4supported = is_image4_supported(client);
     info("Device supports Image4: %s\n", (client->image4supported) ? "true" : "false");
 
+    _stages.begin("ticket selection");
     if (_enterPwnRecoveryRequested) //we are in pwnDFU, so we don't need to check nonces
         client->tss = _aptickets.at(0);
     else if (!(client->tss = nonceMatchesApTickets()))
@@ -945,6 +1482,7 @@ void futurerestore::doRestore(const char *ipsw) {
                   "signing ticket file does not contain generator. But a generator is required for 64-bit pwnDFU restore");
     }
 
+    _stages.begin("build identity lookup");
     retassure(build_identity = getBuildidentityWithBoardconfig(buildmanifest, client->device->hardware_model,
                                                                _isUpdateInstall),
               "ERROR: Unable to find any build identities for iPSW\n");
@@ -968,6 +1506,7 @@ void futurerestore::doRestore(const char *ipsw) {
     printf("checking if the APTicket is valid for this restore...\n"); //if we are in pwnDFU, just use first APTicket. We don't need to check nonces.
     auto im4m = (_enterPwnRecoveryRequested || _rerestoreiOS9) ? _im4ms.at(0) : nonceMatchesIM4Ms();
 
+    _stages.begin("ECID check");
     uint64_t deviceEcid = getDeviceEcid();
     uint64_t im4mEcid = 0;
     if (_client->image4supported) {
@@ -1004,10 +1543,22 @@ void futurerestore::doRestore(const char *ipsw) {
         } else
             printf("Verified ECID in APTicket matches the device's ECID\n");
 
+        _stages.begin("APTicket build identity check");
         plist_t ticketIdentity = nullptr;
+        im4m_matcher::match ticketMatch;
 
         try {
-            ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first, im4m.second}, buildmanifest);
+            //score every loaded ticket in one pass, so we can tell the user which ones would fit
+            im4m_matcher matcher(buildmanifest);
+            auto matches = matcher.matchIM4Ms(_im4ms);
+            int validTickets = 0;
+            for (int i = 0; i < _im4ms.size(); i++) {
+                if (matches[i].exact || matches[i].fallback) validTickets++;
+                if (_im4ms[i].first == im4m.first) ticketMatch = matches[i];
+            }
+            if (_im4ms.size() > 1)
+                info("%d of %zu loaded APTickets are valid for this BuildManifest\n", validTickets, _im4ms.size());
+            ticketIdentity = ticketMatch.exact;
         } catch (tihmstar::exception &e) {
             if (_skipBlob) {
                 info("[WARNING] NOT VALIDATING SHSH BLOBS IM4M!\n");
@@ -1017,8 +1568,7 @@ void futurerestore::doRestore(const char *ipsw) {
 
         if (!_skipBlob && !ticketIdentity) {
             printf("Failed to get exact match for build identity, using fallback to ignore certain values\n");
-            ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first, im4m.second}, buildmanifest,
-                                                               {"RestoreRamDisk", "RestoreTrustCache"});
+            ticketIdentity = ticketMatch.fallback;
         }
 
         /* TODO: make this nicer!
@@ -1073,6 +1623,7 @@ void futurerestore::doRestore(const char *ipsw) {
         }
     }
 
+    _stages.begin("baseband build identity lookup");
     if (_basebandbuildmanifest) {
         if (!(client->basebandBuildIdentity = getBuildidentityWithBoardconfig(_basebandbuildmanifest,
                                                                               client->device->hardware_model,
@@ -1096,35 +1647,245 @@ void futurerestore::doRestore(const char *ipsw) {
         warning("WARNING: we don't have a BasebandBuildManifest, won't flash baseband!\n");
     }
 
-    if (_client->image4supported) {
-        //check SEP
-        plist_t sep_manifest = plist_dict_get_item(client->sepBuildIdentity, "Manifest");
-        plist_t sep_sep = plist_copy(plist_dict_get_item(sep_manifest, "SEP"));
-        plist_dict_set_item(manifest, "SEP", sep_sep);
-        unsigned char genHash[48]; //SHA384 digest length
-        ptr_smart<unsigned char *> sephash = NULL;
-        uint64_t sephashlen = 0;
-        plist_t digest = plist_dict_get_item(sep_sep, "Digest");
+    {
+        //hash everything we are about to send before any device time is spent on it
+        _stages.begin("component digests");
+        digest_cache digestCache(digestCachePath);
+        component_verifier verifier(&digestCache);
+        if (_client->image4supported) {
+            plist_t sep_manifest = plist_dict_get_item(client->sepBuildIdentity, "Manifest");
+            plist_t sep_sep = plist_copy(plist_dict_get_item(sep_manifest, "SEP"));
+            plist_dict_set_item(manifest, "SEP", sep_sep);
+            retassure(verifier.add("SEP", client->sepBuildIdentity, _client->sepfwdata, _client->sepfwdatasize,
+                                   _sepPath), "ERROR: can't find SEP digest\n");
+        }
+        if (_client->basebandBuildIdentity)
+            verifier.add("BasebandFirmware", _client->basebandBuildIdentity, nullptr, 0, _basebandPath);
+        //custom ramdisk and kernel are usually patched, a mismatch is expected there
+        if (_client->ramdiskdata)
+            verifier.add("RestoreRamDisk", build_identity, _client->ramdiskdata, _client->ramdiskdatasize,
+                         _ramdiskPath, false);
+        if (_client->kerneldata)
+            verifier.add("RestoreKernelCache", build_identity, _client->kerneldata, _client->kerneldatasize,
+                         _kernelPath, false);
+        if (_latestManifest) {
+            plist_t latestManifest = nullptr;
+            plist_from_xml(_latestManifest, (uint32_t) strlen(_latestManifest), &latestManifest);
+            cleanup([&] {
+                safeFreeCustom(latestManifest, plist_free);
+            });
+            if (plist_t latestIdentity = getBuildidentityWithBoardconfig(latestManifest, getDeviceBoardNoCopy(), 0)) {
+                verifier.add("Rap,RTKitOS", latestIdentity, _client->rosefwdata, _client->rosefwdatasize, _rosePath);
+                verifier.add("SE,UpdatePayload", latestIdentity, _client->sefwdata, _client->sefwdatasize, _sePath);
+                static const char *savageComponents[6] = {"Savage,B0-Prod-Patch", "Savage,B0-Dev-Patch",
+                                                          "Savage,B2-Prod-Patch", "Savage,B2-Dev-Patch",
+                                                          "Savage,BA-Prod-Patch", "Savage,BA-Dev-Patch"};
+                for (int i = 0; i < 6; i++) {
+                    verifier.add(savageComponents[i], latestIdentity, _client->savagefwdata[i],
+                                 _client->savagefwdatasize[i], _savagePaths[i]);
+                }
+                verifier.add("BMU,DigestMap", latestIdentity, _client->veridiandgmfwdata,
+                             _client->veridiandgmfwdatasize, _veridianDGMPath);
+                verifier.add("BMU,FirmwareMap", latestIdentity, _client->veridianfwmfwdata,
+                             _client->veridianfwmfwdatasize, _veridianFWMPath);
+            }
+        }
+        verifier.verify();
+    }
+    _stages.end();
+}
 
-        retassure(digest && plist_get_node_type(digest) == PLIST_DATA, "ERROR: can't find SEP digest\n");
+void futurerestore::preflight(const char *ipsw) {
+    plist_t buildmanifest = nullptr;
+    plist_t build_identity = nullptr;
+    cleanup([&] {
+        safeFreeCustom(buildmanifest, plist_free);
+    });
+    retassure(_preflight, "preflight requires a device profile\n");
+    _client->ipsw = strdup(ipsw);
+    if (!_isUpdateInstall) _client->flags |= FLAG_ERASE;
+    info("Preflight for %s, %s (ECID %" PRIu64 ")\n", getDeviceBoardNoCopy(), getDeviceModelNoCopy(), _profile.ecid);
+    validateRestore(buildmanifest, build_identity);
+    build_identity_print_information(build_identity);
+}
 
-        plist_get_data_val(digest, reinterpret_cast<char **>(&sephash), &sephashlen);
+void futurerestore::doRestore(const char *ipsw) {
+    plist_t buildmanifest = nullptr;
+    int delete_fs = 0;
+    char *filesystem = nullptr;
+    fs_cache::entry fsCacheEntry; //keeps the filesystem from being evicted until the restore is done
+    cleanup([&] {
+        info("Cleaning up...\n");
+        safeFreeCustom(buildmanifest, plist_free);
+        if (delete_fs && filesystem) unlink(filesystem);
+    });
+    struct idevicerestore_client_t *client = _client;
+    plist_t build_identity = nullptr;
+    uint64_t fssize = 0;
+    idevicerestore_set_progress_callback(client, restore_progress_cb, &fssize);
+    cleanup([&] {
+        idevicerestore_set_progress_callback(client, nullptr, nullptr);
+    });
 
-        if (sephashlen == 20)
-            SHA1((unsigned char *) _client->sepfwdata, (unsigned int) _client->sepfwdatasize, genHash);
-        else
-            SHA384((unsigned char *) _client->sepfwdata, (unsigned int) _client->sepfwdatasize, genHash);
-        retassure(!memcmp(genHash, sephash, sephashlen), "ERROR: SEP does not match sepmanifest\n");
+    client->ipsw = strdup(ipsw);
+    if (_noRestore) client->flags |= FLAG_NO_RESTORE;
+    if (!_isUpdateInstall) client->flags |= FLAG_ERASE;
+
+    subscribeDeviceEvents();
+
+    mutex_lock(&client->device_event_mutex);
+    cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
+
+    retassure(client->mode != MODE_UNKNOWN, "Unable to discover device mode. Please make sure a device is attached.\n");
+    if (client->mode != MODE_RECOVERY) {
+        retassure(client->mode == MODE_DFU, "Device is in unexpected mode detected!");
+        retassure(_enterPwnRecoveryRequested, "Device is in DFU mode detected, but we were expecting recovery mode!");
+    } else {
+        retassure(!_enterPwnRecoveryRequested, "--use-pwndfu was specified, but device found in recovery mode!");
     }
 
+    info("Found device in %s mode\n", client->mode->string);
+    mutex_unlock(&client->device_event_mutex);
+
+    info("Identified device as %s, %s\n", getDeviceBoardNoCopy(), getDeviceModelNoCopy());
+
+    validateRestore(buildmanifest, build_identity);
+
     build_identity_print_information(build_identity); // print information about current build identity
 
+    // Get filesystem name from build identity
+    char *fsname = nullptr;
+    retassure(!build_identity_get_component_path(build_identity, "OS", &fsname),
+              "ERROR: Unable to get path for filesystem component\n");
+
+    // extracted filesystems live next to the IPSW (or in the cache dir) and are shared with other futurerestores
+    ipsw_archive *ipswArchive = getSessionIPSW(client->ipsw);
+    const zip_entry *fsEntry = ipswArchive ? ipswArchive->directory().getEntry(fsname) : nullptr;
+    if (fsEntry) {
+        fssize = fsEntry->uncompressedSize;
+    } else {
+        ipsw_get_file_size(client->ipsw, fsname, &fssize);
+    }
+    std::string fsCacheDir;
+    std::string fsCacheName;
+    {
+        char *ipswtmp = strdup(client->ipsw);
+        std::string ipswName = basename(ipswtmp);
+        free(ipswtmp);
+        size_t dot = ipswName.rfind('.');
+        if (dot != std::string::npos) ipswName.erase(dot);
+        if (client->cache_dir) {
+            fsCacheDir = client->cache_dir;
+        } else {
+            ipswtmp = strdup(client->ipsw);
+            fsCacheDir = dirname(ipswtmp);
+            free(ipswtmp);
+        }
+        fsCacheName = ipswName + "/" + fsname;
+    }
+    //identical filesystems in different IPSWs are stored once, keyed by the digest the BuildManifest has for them
+    std::string fsCacheKey;
+    plist_t osDigest = plist_dict_get_item(plist_dict_get_item(plist_dict_get_item(build_identity, "Manifest"), "OS"),
+                                           "Digest");
+    if (fsEntry && osDigest && plist_get_node_type(osDigest) == PLIST_DATA) {
+        char *digest = nullptr;
+        uint64_t digestSize = 0;
+        plist_get_data_val(osDigest, &digest, &digestSize);
+        if (digest && digestSize) {
+            char sizeKey[32];
+            snprintf(sizeKey, sizeof(sizeKey), "-%08x-%" PRIx64, fsEntry->crc32, fsEntry->uncompressedSize);
+            fsCacheKey = hexString((const unsigned char *) digest, (size_t) digestSize, "") + sizeKey;
+        }
+        safeFree(digest);
+    }
+    if (fsCacheKey.empty()) debug("[FSCACHE] not deduplicating %s, it has no digest\n", fsname);
+    fs_cache fsCache(fsCacheDir, _fsCacheLimit);
+    std::atomic<bool> cancelExtraction{false};
+    auto extractFilesystem = [&](const std::string &path) {
+        info("Extracting filesystem from iPSW in the background\n");
+        if (!fsEntry) {
+            //idevicerestore can't be interrupted, so it extracts into a file of its own on a detached thread,
+            //which is only moved to path if nobody gave up on it in the meantime
+            struct fallback_state {
+                std::mutex lock;
+                std::condition_variable cond;
+                bool done = false;
+                bool failed = false;
+                bool abandoned = false;
+            };
+            auto state = std::make_shared<fallback_state>();
+            std::string ipswPath = client->ipsw;
+            std::string entryName = fsname;
+            std::string ownPath = path + "." + std::to_string(getpid()) + ".fallback";
+            progress_file_watch watch("extract filesystem", ownPath, fssize);
+            std::thread([state, ipswPath, entryName, ownPath] {
+                bool failed = ipsw_extract_to_file_with_progress(ipswPath.c_str(), entryName.c_str(), ownPath.c_str(),
+                                                                 0) != 0;
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->done = true;
+                state->failed = failed;
+                if (failed || state->abandoned) remove(ownPath.c_str());
+                state->cond.notify_all();
+            }).detach();
+            std::unique_lock<std::mutex> ul(state->lock);
+            while (!state->done && !cancelExtraction) state->cond.wait_for(ul, std::chrono::milliseconds(250));
+            if (!state->done) {
+                state->abandoned = true;
+                reterror("filesystem extraction was cancelled\n");
+            }
+            retassure(!state->failed, "ERROR: Unable to extract filesystem from iPSW\n");
+            retassure(!rename(ownPath.c_str(), path.c_str()), "ERROR: Unable to move the filesystem to %s\n",
+                      path.c_str());
+            return;
+        }
+        progress_file_watch watch("extract filesystem", path, fssize);
+        FILE *f = fopen(path.c_str(), "wb");
+        retassure(f, "ERROR: Unable to create %s\n", path.c_str());
+        cleanup([&] {
+            if (f) fclose(f);
+        });
+        zip_directory::extractEntryFromFile(client->ipsw, *fsEntry, [&](const char *buf, size_t size) {
+            retassure(!cancelExtraction, "filesystem extraction was cancelled\n");
+            retassure(fwrite(buf, 1, size, f) == size, "ERROR: Unable to write %s\n", path.c_str());
+        });
+        FILE *extracted = f;
+        f = nullptr;
+        retassure(!fclose(extracted), "ERROR: Unable to write %s\n", path.c_str());
+    };
+    //extracted while the device boots, the filesystem is only needed once the device is about to enter restore mode
+    std::future<void> fsExtraction = std::async(std::launch::async, [&] {
+        if (fsCache.usable()) {
+            fsCacheEntry = fsCache.acquire(fsCacheName, fssize, extractFilesystem, fsCacheKey, [&] {
+                return cancelExtraction.load();
+            });
+            filesystem = strdup(fsCacheEntry.path().c_str());
+            info("[FSCACHE] %zu hits (%zu linked), %zu misses, %zu waits\n", fsCache.hits(), fsCache.linked(),
+                 fsCache.misses(), fsCache.waits());
+        } else {
+            error("WARNING: Can't write to '%s', extracting filesystem to a temporary file\n", fsCacheDir.c_str());
+            std::string tmpl = futurerestoreTempPath + "/ipsw_XXXXXX";
+            mkdir_with_parents(futurerestoreTempPath.c_str(), 0755);
+            int tmpfd = mkstemp(&tmpl[0]);
+            retassure(tmpfd != -1, "ERROR: Could not create a temporary file for the filesystem\n");
+            close(tmpfd);
+            filesystem = strdup(tmpl.c_str());
+            delete_fs = 1;
+            extractFilesystem(filesystem);
+        }
+    });
+    cleanup([&] {
+        cancelExtraction = true;
+        if (fsExtraction.valid()) fsExtraction.wait();
+    });
+
     //check for enterpwnrecovery, because we could be in DFU mode
     if (_enterPwnRecoveryRequested) {
+        _stages.begin("pwned recovery");
         retassure((getDeviceMode(true) == _MODE_DFU) || (getDeviceMode(false) == _MODE_RECOVERY && _noIBSS),
                   "unexpected device mode\n");
         if(client->irecv_e_ctx) {
             irecv_device_event_unsubscribe(client->irecv_e_ctx);
+            client->irecv_e_ctx = nullptr;
         }
         if(client->idevice_e_ctx != nullptr) {
             client->idevice_e_ctx = nullptr;
@@ -1146,100 +1907,16 @@ void futurerestore::doRestore(const char *ipsw) {
         enterPwnRecovery(build_identity, bootargs);
         if(_client->irecv_e_ctx) {
             irecv_device_event_unsubscribe(_client->irecv_e_ctx);
+            _client->irecv_e_ctx = nullptr;
         }
         if(_client->idevice_e_ctx != nullptr) {
             _client->idevice_e_ctx = nullptr;
         }
-        irecv_device_event_subscribe(&client->irecv_e_ctx, irecv_event_cb, _client);
-        idevice_event_subscribe(idevice_event_cb, client);
-        client->idevice_e_ctx = (void *) idevice_event_cb;
-    }
-
-    // Get filesystem name from build identity
-    char *fsname = nullptr;
-    retassure(!build_identity_get_component_path(build_identity, "OS", &fsname),
-              "ERROR: Unable to get path for filesystem component\n");
-
-    // check if we already have an extracted filesystem
-    struct stat st{};
-    memset(&st, '\0', sizeof(struct stat));
-    char tmpf[1024];
-    if (client->cache_dir) {
-        if (stat(client->cache_dir, &st) < 0) {
-            mkdir_with_parents(client->cache_dir, 0755);
-        }
-        strcpy(tmpf, client->cache_dir);
-        strcat(tmpf, "/");
-        char *ipswtmp = strdup(client->ipsw);
-        strcat(tmpf, basename(ipswtmp));
-        free(ipswtmp);
-    } else {
-        strcpy(tmpf, client->ipsw);
-    }
-    char *p = strrchr(tmpf, '.');
-    if (p) {
-        *p = '\0';
-    }
-
-    if (stat(tmpf, &st) < 0) {
-        safe_mkdir(tmpf, 0755);
-    }
-    strcat(tmpf, "/");
-    strcat(tmpf, fsname);
-
-    memset(&st, '\0', sizeof(struct stat));
-    if (stat(tmpf, &st) == 0) {
-        off_t fssize = 0;
-        ipsw_get_file_size(client->ipsw, fsname, (uint64_t *) &fssize);
-        if ((fssize > 0) && (st.st_size == fssize)) {
-            info("Using cached filesystem from '%s'\n", tmpf);
-            filesystem = strdup(tmpf);
-        }
-    }
-
-    if (!filesystem) {
-        char extfn[1024];
-        strcpy(extfn, tmpf);
-        strcat(extfn, ".extract");
-        char lockfn[1024];
-        strcpy(lockfn, tmpf);
-        strcat(lockfn, ".lock");
-        lock_info_t li;
-
-        lock_file(lockfn, &li);
-        FILE *extf = nullptr;
-        if (access(extfn, F_OK) != 0) {
-            extf = fopen(extfn, "w");
-        }
-        unlock_file(&li);
-        if (!extf) {
-            // use temp filename
-            filesystem = reinterpret_cast<char *>(mkstemp(const_cast<char *>("ipsw_")));
-            if (!filesystem) {
-                error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
-                filesystem = strdup(fsname);
-            }
-            delete_fs = 1;
-        } else {
-            // use <fsname>.extract as filename
-            filesystem = strdup(extfn);
-            fclose(extf);
-        }
-        remove(lockfn);
-
-        info("Extracting filesystem from iPSW\n");
-        retassure(!ipsw_extract_to_file_with_progress(client->ipsw, fsname, filesystem, 1),
-                  "ERROR: Unable to extract filesystem from iPSW\n");
-
-        // rename <fsname>.extract to <fsname>
-        if (strstr(filesystem, ".extract")) {
-            remove(tmpf);
-            rename(filesystem, tmpf);
-            free(filesystem);
-            filesystem = strdup(tmpf);
-        }
+        _deviceInfo.invalidate();
+        subscribeDeviceEvents();
     }
 
+    _stages.begin("boot iBEC");
     if (_rerestoreiOS9) {
         mutex_lock(&_client->device_event_mutex);
         if (dfu_send_component(client, build_identity, "iBSS") < 0) {
@@ -1303,8 +1980,10 @@ void futurerestore::doRestore(const char *ipsw) {
     if (_enterPwnRecoveryRequested) {
         if (!_client->image4supported) {
             if (strncmp(client->version, "10.", 3) ==
-                0)//if pwnrecovery send all components decrypted, unless we're dealing with iOS 10
+                0) { //if pwnrecovery send all components decrypted, unless we're dealing with iOS 10
+                customComponentArchive = getSessionIPSW(client->ipsw);
                 client->recovery_custom_component_function = get_custom_component;
+            }
         }
     } else if (!_rerestoreiOS9) {
 
@@ -1346,6 +2025,12 @@ void futurerestore::doRestore(const char *ipsw) {
     get_ap_nonce(client, &client->nonce, &client->nonce_size);
     get_ecid(client, &client->ecid);
 
+    _stages.begin("filesystem extraction");
+    if (fsExtraction.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        info("Waiting for the filesystem extraction to finish...\n");
+    fsExtraction.get();
+
+    _stages.begin("enter restore mode");
     if (client->mode == MODE_RECOVERY) {
         retassure(client->srnm, "ERROR: could not retrieve device serial number. Can't continue.\n");
 
@@ -1375,25 +2060,29 @@ void futurerestore::doRestore(const char *ipsw) {
               "Unable to place device into restore mode");
     mutex_unlock(&client->device_event_mutex);
 
+    _stages.begin("restore");
     info("About to restore device... \n");
     int result = restore_device(client, build_identity, filesystem);
-    if (result == 2) return;
-    else retassure(!(result), "ERROR: Unable to restore device\n");
+    if (result != 2) retassure(!(result), "ERROR: Unable to restore device\n");
+    _stages.end();
 }
 
 futurerestore::~futurerestore() {
+    customComponentArchive = nullptr;
     recovery_client_free(_client);
     idevicerestore_client_free(_client);
     for (auto im4m: _im4ms) {
         safeFree(im4m.first);
     }
-    safeFree(_ibootBuild);
+    _deviceInfo.printStats();
     safeFree(_firmwareJson);
     safeFree(_betaFirmwareJson);
     safeFree(_firmwareTokens);
     safeFree(_betaFirmwareTokens);
     safeFree(_latestManifest);
     safeFree(_latestFirmwareUrl);
+    delete _latestFirmwareZip;
+    delete _session;
     for (auto plist: _aptickets) {
         safeFreeCustom(plist, plist_free);
     }
@@ -1402,13 +2091,17 @@ futurerestore::~futurerestore() {
 }
 
 void futurerestore::loadFirmwareTokens() {
+    feed_cache feeds(feedCachePath, _feedMaxAge);
     if (!_firmwareTokens) {
+        if (!_firmwareJson) _firmwareJson = feeds.get(FIRMWARE_JSON_URL);
         if (!_firmwareJson) _firmwareJson = getFirmwareJson();
         retassure(_firmwareJson, "[TSSC] could not get firmware.json\n");
         long cnt = parseTokens(_firmwareJson, &_firmwareTokens);
         retassure(cnt > 0, "[TSSC] parsing %s.json failed\n", (0) ? "ota" : "firmware");
     }
     if(!_betaFirmwareTokens) {
+        if (!_betaFirmwareJson)
+            _betaFirmwareJson = feeds.get(std::string(FIRMWARE_BETA_JSON_URL) + getDeviceModelNoCopy());
         if (!_betaFirmwareJson) _betaFirmwareJson = getBetaFirmwareJson(getDeviceModelNoCopy());
         retassure(_betaFirmwareJson, "[TSSC] could not get betas json\n");
         long cnt = parseTokens(_betaFirmwareJson, &_betaFirmwareTokens);
@@ -1468,6 +2161,7 @@ const char *futurerestore::getDeviceBoardNoCopy() {
 }
 
 char *futurerestore::getLatestManifest() {
+    std::lock_guard<std::recursive_mutex> guard(_latestLock);
     if (!_latestManifest) {
         loadFirmwareTokens();
 
@@ -1559,13 +2253,45 @@ char *futurerestore::getLatestFirmwareUrl() {
     return getLatestManifest(), _latestFirmwareUrl;
 }
 
+remote_zip *futurerestore::getLatestFirmwareZip() {
+    std::lock_guard<std::recursive_mutex> guard(_latestLock);
+    if (!_latestFirmwareZip) _latestFirmwareZip = new remote_zip(getLatestFirmwareUrl(), remoteZipCachePath);
+    return _latestFirmwareZip;
+}
+
+void futurerestore::prefetchLatestFirmwareComponents(const std::vector<std::pair<std::string, std::string>> &files) {
+    if (files.empty()) return;
+    std::lock_guard<std::recursive_mutex> guard(_latestLock);
+    try {
+        getLatestFirmwareZip()->downloadFiles(files, _rangeGap);
+        for (auto &file: files) {
+            _prefetchedComponents.insert(file.second);
+        }
+    } catch (tihmstar::exception &e) {
+        error("%s: failed to prefetch firmware components (%s), fetching them one by one\n", __func__, e.what());
+    }
+}
+
+int futurerestore::downloadLatestFirmwareComponent(const char *path, const char *dst) {
+    std::lock_guard<std::recursive_mutex> guard(_latestLock);
+    if (_prefetchedComponents.erase(dst)) return 0;
+    try {
+        getLatestFirmwareZip()->downloadFile(path, dst);
+        return 0;
+    } catch (tihmstar::exception &e) {
+        error("%s: failed to fetch %s over the cached session (%s), falling back to partialzip\n", __func__, path,
+              e.what());
+    }
+    return downloadPartialzip(getLatestFirmwareUrl(), path, dst);
+}
+
 void futurerestore::downloadLatestRose() {
     char *manifeststr = getLatestManifest();
     char *roseStr = (elemExists("Rap,RTKitOS", manifeststr, getDeviceBoardNoCopy(), 0) ? getPathOfElementInManifest(
             "Rap,RTKitOS", manifeststr, getDeviceBoardNoCopy(), 0) : nullptr);
     if (roseStr) {
         info("downloading Rose firmware\n\n");
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), roseStr, roseTempPath.c_str()),
+        retassure(!downloadLatestFirmwareComponent(roseStr, roseTempPath.c_str()),
                   "could not download Rose\n");
         loadRose(roseTempPath);
     }
@@ -1577,7 +2303,7 @@ void futurerestore::downloadLatestSE() {
             "SE,UpdatePayload", manifeststr, getDeviceBoardNoCopy(), 0) : nullptr);
     if (seStr) {
         info("downloading SE firmware\n\n");
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), seStr, seTempPath.c_str()), "could not download SE\n");
+        retassure(!downloadLatestFirmwareComponent(seStr, seTempPath.c_str()), "could not download SE\n");
         loadSE(seTempPath);
     }
 }
@@ -1606,38 +2332,38 @@ void futurerestore::downloadLatestSavage() {
 
     if (savageB0ProdStr) {
         info("downloading Savage,B0-Prod-Patch\n\n");
-        savagePaths[0] = futurerestoreTempPath + "/savageB0PP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageB0ProdStr, savagePaths[0].c_str()),
+        savagePaths[0] = savageTempPaths[0];
+        retassure(!downloadLatestFirmwareComponent(savageB0ProdStr, savagePaths[0].c_str()),
                   "could not download Savage,B0-Prod-Patch\n");
     }
     if (savageB0DevStr) {
         info("downloading Savage,B0-Dev-Patch\n\n");
-        savagePaths[1] = futurerestoreTempPath + "//savageB0DP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageB0DevStr, savagePaths[1].c_str()),
+        savagePaths[1] = savageTempPaths[1];
+        retassure(!downloadLatestFirmwareComponent(savageB0DevStr, savagePaths[1].c_str()),
                   "could not download Savage,B0-Dev-Patch\n");
     }
     if (savageB2ProdStr) {
         info("downloading Savage,B2-Prod-Patch\n\n");
-        savagePaths[2] = futurerestoreTempPath + "//savageB2PP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageB2ProdStr, savagePaths[2].c_str()),
+        savagePaths[2] = savageTempPaths[2];
+        retassure(!downloadLatestFirmwareComponent(savageB2ProdStr, savagePaths[2].c_str()),
                   "could not download Savage,B2-Prod-Patch\n");
     }
     if (savageB2DevStr) {
         info("downloading Savage,B2-Dev-Patch\n\n");
-        savagePaths[3] = futurerestoreTempPath + "//savageB2DP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageB2DevStr, savagePaths[3].c_str()),
+        savagePaths[3] = savageTempPaths[3];
+        retassure(!downloadLatestFirmwareComponent(savageB2DevStr, savagePaths[3].c_str()),
                   "could not download Savage,B2-Dev-Patch\n");
     }
     if (savageBAProdStr) {
         info("downloading Savage,BA-Prod-Patch\n\n");
-        savagePaths[4] = futurerestoreTempPath + "//savageBAPP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageBAProdStr, savagePaths[4].c_str()),
+        savagePaths[4] = savageTempPaths[4];
+        retassure(!downloadLatestFirmwareComponent(savageBAProdStr, savagePaths[4].c_str()),
                   "could not download Savage,BA-Prod-Patch\n");
     }
     if (savageBADevStr) {
         info("downloading Savage,BA-Dev-Patch\n\n");
-        savagePaths[5] = futurerestoreTempPath + "//savageBADP.fw";
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), savageBADevStr, savagePaths[5].c_str()),
+        savagePaths[5] = savageTempPaths[5];
+        retassure(!downloadLatestFirmwareComponent(savageBADevStr, savagePaths[5].c_str()),
                   "could not download Savage,BA-Dev-Patch\n");
     }
     if (savageB0ProdStr &&
@@ -1660,12 +2386,12 @@ void futurerestore::downloadLatestVeridian() {
                             : nullptr);
     if (veridianDGMStr) {
         info("downloading Veridian DigestMap\n\n");
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), veridianDGMStr, veridianDGMTempPath.c_str()),
+        retassure(!downloadLatestFirmwareComponent(veridianDGMStr, veridianDGMTempPath.c_str()),
                   "could not download Veridian DigestMap\n");
     }
     if (veridianFWMStr) {
         info("downloading Veridian FirmwareMap\n\n");
-        retassure(!downloadPartialzip(getLatestFirmwareUrl(), veridianFWMStr, veridianFWMTempPath.c_str()),
+        retassure(!downloadLatestFirmwareComponent(veridianFWMStr, veridianFWMTempPath.c_str()),
                   "could not download Veridian FirmwareMap\n");
     }
     if (veridianDGMStr && veridianFWMStr)
@@ -1673,12 +2399,49 @@ void futurerestore::downloadLatestVeridian() {
 }
 
 void futurerestore::downloadLatestFirmwareComponents() {
+    std::vector<std::string> inputs{getDeviceBoardNoCopy(), getLatestFirmwareUrl()};
+    restore_session::values loaded;
+    if (isPhaseDone("latest firmware components", inputs, &loaded)) {
+        if (loaded.count("Rose")) loadRose(roseTempPath);
+        if (loaded.count("SE")) loadSE(seTempPath);
+        if (loaded.count("Savage")) loadSavage(savageTempPaths);
+        if (loaded.count("Veridian")) loadVeridian(veridianDGMTempPath, veridianFWMTempPath);
+        return;
+    }
     info("Downloading the latest firmware components...\n");
     char *manifeststr = getLatestManifest();
-    if (elemExists("Rap,RTKitOS", manifeststr, getDeviceBoardNoCopy(), 0))
+    std::vector<std::string> files;
+    {
+        //these are small and sit close together in the IPSW, so fetch them with as few range requests as possible
+        std::vector<std::pair<std::string, std::string>> prefetch;
+        std::vector<std::pair<const char *, std::string>> components{{"Rap,RTKitOS",          roseTempPath},
+                                                                     {"SE,UpdatePayload",     seTempPath},
+                                                                     {"BMU,DigestMap",        veridianDGMTempPath},
+                                                                     {"BMU,FirmwareMap",      veridianFWMTempPath}};
+        static const char *savageComponents[6] = {"Savage,B0-Prod-Patch", "Savage,B0-Dev-Patch",
+                                                  "Savage,B2-Prod-Patch", "Savage,B2-Dev-Patch",
+                                                  "Savage,BA-Prod-Patch", "Savage,BA-Dev-Patch"};
+        for (int i = 0; i < 6; i++) {
+            components.emplace_back(savageComponents[i], savageTempPaths[i]);
+        }
+        for (auto &component: components) {
+            if (!elemExists(component.first, manifeststr, getDeviceBoardNoCopy(), 0)) continue;
+            char *path = getPathOfElementInManifest(component.first, manifeststr, getDeviceBoardNoCopy(), 0);
+            prefetch.emplace_back(path, component.second);
+            safeFree(path);
+        }
+        prefetchLatestFirmwareComponents(prefetch);
+    }
+    if (elemExists("Rap,RTKitOS", manifeststr, getDeviceBoardNoCopy(), 0)) {
         downloadLatestRose();
-    if (elemExists("SE,UpdatePayload", manifeststr, getDeviceBoardNoCopy(), 0))
+        loaded["Rose"] = roseTempPath;
+        files.push_back(roseTempPath);
+    }
+    if (elemExists("SE,UpdatePayload", manifeststr, getDeviceBoardNoCopy(), 0)) {
         downloadLatestSE();
+        loaded["SE"] = seTempPath;
+        files.push_back(seTempPath);
+    }
     if (elemExists("Savage,B0-Prod-Patch", manifeststr, getDeviceBoardNoCopy(), 0) &&
         elemExists("Savage,B0-Dev-Patch", manifeststr, getDeviceBoardNoCopy(), 0) &&
         elemExists("Savage,B2-Prod-Patch", manifeststr, getDeviceBoardNoCopy(), 0) &&
@@ -1686,20 +2449,39 @@ void futurerestore::downloadLatestFirmwareComponents() {
         elemExists("Savage,BA-Prod-Patch", manifeststr, getDeviceBoardNoCopy(), 0) &&
         elemExists("Savage,BA-Dev-Patch", manifeststr, getDeviceBoardNoCopy(), 0)) {
         downloadLatestSavage();
+        loaded["Savage"] = savageTempPaths[0];
+        files.insert(files.end(), savageTempPaths.begin(), savageTempPaths.end());
     }
     if (elemExists("BMU,DigestMap", manifeststr, getDeviceBoardNoCopy(), 0) ||
-        elemExists("BMU,FirmwareMap", manifeststr, getDeviceBoardNoCopy(), 0))
+        elemExists("BMU,FirmwareMap", manifeststr, getDeviceBoardNoCopy(), 0)) {
         downloadLatestVeridian();
+        //only loaded if both are there, a lone one is downloaded but never used
+        if (elemExists("BMU,DigestMap", manifeststr, getDeviceBoardNoCopy(), 0) &&
+            elemExists("BMU,FirmwareMap", manifeststr, getDeviceBoardNoCopy(), 0)) {
+            loaded["Veridian"] = veridianDGMTempPath;
+            files.push_back(veridianDGMTempPath);
+            files.push_back(veridianFWMTempPath);
+        }
+    }
+    {
+        std::lock_guard<std::recursive_mutex> guard(_latestLock);
+        _prefetchedComponents.clear();
+    }
+    setPhaseDone("latest firmware components", inputs, files, loaded);
     info("Finished downloading the latest firmware components!\n");
 }
 
 void futurerestore::downloadLatestBaseband() {
-    char *manifeststr = getLatestManifest();
-    char *pathStr = getPathOfElementInManifest("BasebandFirmware", manifeststr, getDeviceBoardNoCopy(), 0);
-    info("downloading Baseband\n\n");
-    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathStr, basebandTempPath.c_str()),
-              "could not download baseband\n");
-    saveStringToFile(manifeststr, basebandManifestTempPath);
+    std::vector<std::string> inputs{getDeviceBoardNoCopy(), getLatestFirmwareUrl()};
+    if (!isPhaseDone("latest baseband", inputs)) {
+        char *manifeststr = getLatestManifest();
+        char *pathStr = getPathOfElementInManifest("BasebandFirmware", manifeststr, getDeviceBoardNoCopy(), 0);
+        info("downloading Baseband\n\n");
+        retassure(!downloadLatestFirmwareComponent(pathStr, basebandTempPath.c_str()),
+                  "could not download baseband\n");
+        saveStringToFile(manifeststr, basebandManifestTempPath);
+        setPhaseDone("latest baseband", inputs, {basebandTempPath, basebandManifestTempPath});
+    }
     setBasebandPath(basebandTempPath);
     setBasebandManifestPath(basebandManifestTempPath);
     loadBaseband(this->_basebandPath);
@@ -1707,11 +2489,16 @@ void futurerestore::downloadLatestBaseband() {
 }
 
 void futurerestore::downloadLatestSep() {
-    std::string manifestString = getLatestManifest();
-    std::string pathString = getPathOfElementInManifest("SEP", manifestString.c_str(), getDeviceBoardNoCopy(), 0);
-    info("downloading SEP\n\n");
-    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathString.c_str(), sepTempPath.c_str()), "could not download SEP\n");
-    saveStringToFile(manifestString, sepManifestTempPath);
+    std::vector<std::string> inputs{getDeviceBoardNoCopy(), getLatestFirmwareUrl()};
+    if (!isPhaseDone("latest SEP", inputs)) {
+        std::string manifestString = getLatestManifest();
+        std::string pathString = getPathOfElementInManifest("SEP", manifestString.c_str(), getDeviceBoardNoCopy(), 0);
+        info("downloading SEP\n\n");
+        retassure(!downloadLatestFirmwareComponent(pathString.c_str(), sepTempPath.c_str()),
+                  "could not download SEP\n");
+        saveStringToFile(manifestString, sepManifestTempPath);
+        setPhaseDone("latest SEP", inputs, {sepTempPath, sepManifestTempPath});
+    }
     setSepPath(sepTempPath);
     setSepManifestPath(sepManifestTempPath);
     loadSep(this->_sepPath);
@@ -1731,6 +2518,7 @@ void futurerestore::loadBasebandManifest(std::string basebandManifestPath) {
 };
 
 void futurerestore::loadRose(std::string rosePath) {
+    _rosePath = rosePath;
     std::ifstream roseFileStream(rosePath);
     retassure(roseFileStream.good(), "%s: failed init file stream for %s!\n", __func__, rosePath.c_str());
     roseFileStream.seekg(0, std::ios_base::end);
@@ -1747,6 +2535,7 @@ void futurerestore::loadRose(std::string rosePath) {
 }
 
 void futurerestore::loadSE(std::string sePath) {
+    _sePath = sePath;
     std::ifstream seFileStream(sePath);
     retassure(seFileStream.good(), "%s: failed init file stream for %s!\n", __func__, sePath.c_str());
     seFileStream.seekg(0, std::ios_base::end);
@@ -1763,6 +2552,7 @@ void futurerestore::loadSE(std::string sePath) {
 }
 
 void futurerestore::loadSavage(std::array<std::string, 6> savagePaths) {
+    _savagePaths = savagePaths;
     int index = 0;
     for (const auto &savagePath: savagePaths) {
         std::ifstream savageFileStream(savagePath);
@@ -1783,6 +2573,8 @@ void futurerestore::loadSavage(std::array<std::string, 6> savagePaths) {
 }
 
 void futurerestore::loadVeridian(std::string veridianDGMPath, std::string veridianFWMPath) {
+    _veridianDGMPath = veridianDGMPath;
+    _veridianFWMPath = veridianFWMPath;
     std::ifstream veridianDGMFileStream(veridianDGMPath);
     std::ifstream veridianFWMFileStream(veridianFWMPath);
     retassure(veridianDGMFileStream.good(), "%s: failed init file stream for %s!\n", __func__, veridianDGMPath.c_str());
@@ -1957,37 +2749,68 @@ std::pair<const char *, size_t> futurerestore::getRamdiskHashFromSCAB(const char
     return {NULL, 0};
 }
 
+static void writeBinarySidecar(plist_t plist, const std::string &sidecarPath) {
+    char *bin = nullptr;
+    uint32_t binSize = 0;
+    cleanup([&] {
+        safeFree(bin);
+    });
+    plist_to_bin(plist, &bin, &binSize);
+    if (!bin || !binSize) return;
+
+    std::string tmpPath = sidecarPath + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream sidecarStream(tmpPath, std::ios::binary | std::ios::trunc);
+    sidecarStream.write(bin, binSize);
+    sidecarStream.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (sidecarStream.fail() || rename(tmpPath.c_str(), sidecarPath.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[PLIST] failed to write binary sidecar %s\n", sidecarPath.c_str());
+    }
+}
+
 plist_t futurerestore::loadPlistFromFile(const char *path) {
     plist_t ret = nullptr;
 
-    FILE *f = fopen(path, "rb");
-    if (!f) {
+    mapped_file file;
+    try {
+        file = mapped_file(path);
+    } catch (tihmstar::exception &e) {
         error("could not open file %s\n", path);
         return nullptr;
     }
-    fseek(f, 0, SEEK_END);
-    size_t bufSize = ftell(f);
-    fseek(f, 0, SEEK_SET);
 
-    char *buf = (char *) malloc(bufSize);
-    if (!buf) {
-        error("failed to alloc memory\n");
-        return nullptr;
+    if (file.startsWith("bplist00", 8)) {
+        plist_from_bin(file.data(), (uint32_t) file.size(), &ret);
+        return ret;
     }
-
-    size_t freadRet = 0;
-    if ((freadRet = fread(buf, 1, bufSize, f)) != bufSize) {
-        error("fread=%zu but bufsize=%zu", freadRet, bufSize);
-        return nullptr;
+    //the sidecar is used in place of the file, e.g. for the manifests signing status is checked against
+    if (file.size() < PLIST_SIDECAR_MIN_SIZE || !private_dir::prepare(plistCachePath)) {
+        plist_from_xml(file.data(), (uint32_t) file.size(), &ret);
+        return ret;
     }
-    fclose(f);
 
-    if (memcmp(buf, "bplist00", 8) == 0)
-        plist_from_bin(buf, (uint32_t) bufSize, &ret);
-    else
-        plist_from_xml(buf, (uint32_t) bufSize, &ret);
-    free(buf);
+    //large XML plists (BuildManifests) are slow to parse, reuse a binary copy of the same content
+    std::string digest = component_verifier::hash(file.data(), file.size(), 20);
+    std::string sidecarPath = plistCachePath + "/" +
+            hexString((const unsigned char *) digest.data(), digest.size(), "") + ".bplist";
+    if (private_dir::isTrusted(sidecarPath)) {
+        try {
+            mapped_file sidecar(sidecarPath);
+            if (sidecar.startsWith("bplist00", 8)) plist_from_bin(sidecar.data(), (uint32_t) sidecar.size(), &ret);
+        } catch (tihmstar::exception &e) {
+            //no sidecar yet
+        }
+    }
+    if (ret) {
+        debug("[PLIST] loaded %s from binary sidecar %s\n", path, sidecarPath.c_str());
+        return ret;
+    }
 
+    plist_from_xml(file.data(), (uint32_t) file.size(), &ret);
+    if (ret) writeBinarySidecar(ret, sidecarPath);
     return ret;
 }
 
@@ -20,7 +20,12 @@
 #include <functional>
 #include <vector>
 #include <array>
+#include <set>
+#include <map>
+#include <memory>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -29,9 +34,18 @@
 #include "idevicerestore.h"
 #include <jssy.h>
 #include <plist/plist.h>
+#include "nonce_table.hpp"
+#include "device_profile.hpp"
+#include "stage_report.hpp"
+#include "restore_session.hpp"
+#include "device_info.hpp"
+#include "fs_cache.hpp"
+#include "ipsw_archive.hpp"
 
 using namespace std;
 
+class remote_zip;
+
 template <typename T>
 class ptr_smart {
     std::function<void(T)> _ptr_free = NULL;
@@ -52,11 +66,14 @@ public:
 
 class futurerestore {
     struct idevicerestore_client_t* _client;
-    char *_ibootBuild = nullptr;
+    device_info _deviceInfo;
+    std::string _ibootBuild;
     bool _didInit = false;
     vector<plist_t> _aptickets;
     vector<pair<char *, size_t>>_im4ms;
+    nonce_table _nonceTable;
     int _foundnonce = -1;
+    std::atomic<int> _autoboot{-1}; //last value we wrote to the device, -1 if unknown. Forgotten on mode changes
     bool _isUpdateInstall = false;
     bool _isPwnDfu = false;
     bool _noIBSS = false;
@@ -70,6 +87,12 @@ class futurerestore {
     jssytok_t *_betaFirmwareTokens = nullptr;
     char *_latestManifest = nullptr;
     char *_latestFirmwareUrl = nullptr;
+    remote_zip *_latestFirmwareZip = nullptr;
+    std::recursive_mutex _latestLock; //the latest firmware may be fetched from several preparation steps at once
+    uint64_t _rangeGap = 0x100000;
+    long _feedMaxAge = 0;
+    uint64_t _fsCacheLimit = FS_CACHE_DEFAULT_LIMIT;
+    std::set<std::string> _prefetchedComponents;
     bool _useCustomLatest = false;
     bool _useCustomLatestBuildID = false;
     bool _useCustomLatestBeta = false;
@@ -84,6 +107,11 @@ class futurerestore {
     std::string _sepPath;
     std::string _sepManifestPath;
     std::string _basebandPath;
+    std::string _rosePath;
+    std::string _sePath;
+    std::array<std::string, 6> _savagePaths;
+    std::string _veridianDGMPath;
+    std::string _veridianFWMPath;
     std::string _basebandManifestPath;
 
     const char *_custom_nonce = nullptr;
@@ -91,24 +119,55 @@ class futurerestore {
 
     bool _noCache = false;
     bool _skipBlob = false;
+    bool _skipIPSWVerify = false;
 
     bool _enterPwnRecoveryRequested = false;
     bool _rerestoreiOS9 = false;
+
+    bool _preflight = false;
+    device_profile _profile;
+    struct irecv_device _profileDevice{};
+    stage_report _stages;
+    restore_session *_session = nullptr;
+    uint64_t _sessionEcid = 0;
+    std::mutex _ipswArchivesLock;
+    std::map<std::string, std::unique_ptr<ipsw_archive>> _ipswArchives; //nullptr where the path isn't a zip
     //methods
+    ipsw_archive *getSessionIPSW(const char *ipswPath);
     void enterPwnRecovery(plist_t build_identity, std::string bootargs);
+    int preflightNonceMatch();
+    static void irecvEventCallback(const irecv_device_event_t *event, void *userdata);
+    static void ideviceEventCallback(const idevice_event_t *event, void *userdata);
+    void subscribeDeviceEvents();
+    bool deviceEventsSubscribed() const {return _client->irecv_e_ctx != nullptr;}
+    int pollDeviceMode();
+    void useProfileDevice();
+    void loadKnownDeviceProfile();
+    std::string getApNonce();
 
 public:
     futurerestore(bool isUpdateInstall = false, bool isPwnDfu = false, bool noIBSS = false, bool setNonce = false, bool serial = false, bool noRestore = false);
     bool init();
+    void loadDeviceProfile(const std::string &profilePath);
+    void saveDeviceProfile(const std::string &profilePath);
+    bool isPreflight(){return _preflight;}
+    stage_report &stages(){return _stages;}
+    void openSession(const char *resumeId, uint64_t ecid);
+    //true if the session already completed phase with the same inputs and unchanged files
+    bool isPhaseDone(const std::string &phase, const std::vector<std::string> &inputs,
+                     restore_session::values *outputs = nullptr);
+    void setPhaseDone(const std::string &phase, const std::vector<std::string> &inputs,
+                      const std::vector<std::string> &files = {}, const restore_session::values &outputs = {});
     int getDeviceMode(bool reRequest);
     uint64_t getDeviceEcid();
     void putDeviceIntoRecovery();
     void setAutoboot(bool val);
+    bool waitForRecoveryReconnect(unsigned int timeoutMs); //needs device_event_mutex held
     void exitRecovery();
     void waitForNonce();
     void waitForNonce(vector<const char *>nonces, size_t nonceSize);
     void loadAPTickets(const vector<const char *> &apticketPaths);
-    char *getiBootBuild();
+    const char *getiBootBuild();
     
     plist_t nonceMatchesApTickets();
     std::pair<const char *,size_t> nonceMatchesIM4Ms();
@@ -118,6 +177,9 @@ public:
     const char *getDeviceBoardNoCopy();
     char *getLatestManifest();
     char *getLatestFirmwareUrl();
+    remote_zip *getLatestFirmwareZip();
+    void prefetchLatestFirmwareComponents(const std::vector<std::pair<std::string, std::string>> &files);
+    int downloadLatestFirmwareComponent(const char *path, const char *dst);
     std::string getSepManifestPath(){return _sepManifestPath;}
     std::string getBasebandManifestPath(){return _basebandManifestPath;}
     void downloadLatestRose();
@@ -150,12 +212,23 @@ public:
     void setNonce(const char *custom_nonce){_custom_nonce = custom_nonce;};
     void setBootArgs(const char *boot_args){_boot_args = boot_args;};
     void disableCache(){_noCache = true;};
+    void setRangeGap(uint64_t rangeGap){_rangeGap = rangeGap;};
+    void setFeedMaxAge(long feedMaxAge){_feedMaxAge = feedMaxAge;};
+    void setFsCacheLimit(uint64_t fsCacheLimit){_fsCacheLimit = fsCacheLimit;};
     void skipBlobValidation(){_skipBlob = true;};
+    void skipIPSWVerification(){_skipIPSWVerify = true;};
 
-    bool is32bit(){return !is_image4_supported(_client);};
+    bool is32bit(){return _preflight ? !_client->image4supported : !is_image4_supported(_client);};
     
     uint64_t getBasebandGoldCertIDFromDevice();
     
+    void verifyIPSW(const char *ipswPath);
+    //opens and verifies the iPSW and caches its BuildManifest, before doRestore needs them
+    void prepareIPSW(const char *ipswPath);
+    void validateRestore(plist_t &buildmanifest, plist_t &build_identity);
+    void preflight(const char *ipsw);
+    //fills the decrypted component cache get_custom_component serves 32-bit pwnDFU restores from
+    void decryptComponents(const char *ipsw);
     void doRestore(const char *ipsw);
 
     ~futurerestore();
@@ -164,6 +237,10 @@ public:
     static std::pair<const char *,size_t> getNonceFromSCAB(const char* scab, size_t scabSize);
     static uint64_t getEcidFromSCAB(const char* scab, size_t scabSize);
     static plist_t loadPlistFromFile(const char *path);
+    //reads a (possibly gzipped) shsh/shsh2 file
+    static plist_t loadAPTicketFile(const char *apticketPath);
+    //BuildManifest of a local IPSW, cached as a binary plist between runs
+    static plist_t loadBuildManifest(const char *ipswPath);
     static void saveStringToFile(std::string str, std::string path);
     static char *getPathOfElementInManifest(const char *element, const char *manifeststr, const char *boardConfig, int isUpdateInstall);
     static bool elemExists(const char *element, const char *manifeststr, const char *boardConfig, int isUpdateInstall);
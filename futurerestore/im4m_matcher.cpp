@@ -0,0 +1,198 @@
+//
+//  im4m_matcher.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "im4m_matcher.hpp"
+
+#include <img4tool/img4tool.hpp>
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static uint64_t getHexValFromIdentity(plist_t identity, const char *key) {
+    char *str = nullptr;
+    uint64_t ret = 0;
+    plist_t node = plist_dict_get_item(identity, key);
+    if (node && plist_get_node_type(node) == PLIST_STRING) {
+        plist_get_string_val(node, &str);
+        if (str) ret = strtoull(str, nullptr, 16);
+        safeFree(str);
+    } else if (node && plist_get_node_type(node) == PLIST_UINT) {
+        plist_get_uint_val(node, &ret);
+    }
+    return ret;
+}
+
+im4m_matcher::im4m_matcher(plist_t buildmanifest, const std::vector<std::string> &fallbackIgnore) {
+    plist_t buildidentities = plist_dict_get_item(buildmanifest, "BuildIdentities");
+    retassure(buildidentities && plist_get_node_type(buildidentities) == PLIST_ARRAY,
+              "BuildManifest does not contain BuildIdentities\n");
+
+    for (uint32_t i = 0; i < plist_array_get_size(buildidentities); i++) {
+        plist_t curr = plist_array_get_item(buildidentities, i);
+        plist_t manifest = plist_dict_get_item(curr, "Manifest");
+        if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) continue;
+
+        identity ident{};
+        ident.node = curr;
+        ident.boardID = getHexValFromIdentity(curr, "ApBoardID");
+        ident.chipID = getHexValFromIdentity(curr, "ApChipID");
+        ident.restoreBehavior = getRestoreBehavior(curr);
+        auto identIdx = (uint32_t) _identities.size();
+
+        plist_dict_iter it = nullptr;
+        plist_dict_new_iter(manifest, &it);
+        cleanup([&] {
+            safeFree(it);
+        });
+        while (true) {
+            char *key = nullptr;
+            plist_t component = nullptr;
+            plist_dict_next_item(manifest, it, &key, &component);
+            if (!key) break;
+            cleanup([&] {
+                safeFree(key);
+            });
+
+            plist_t pdigest = plist_dict_get_item(component, "Digest");
+            if (!pdigest || plist_get_node_type(pdigest) != PLIST_DATA) continue;
+            if (plist_t ptrusted = plist_dict_get_item(component, "Trusted")) {
+                uint8_t trusted = 0;
+                plist_get_bool_val(ptrusted, &trusted);
+                if (!trusted) continue;
+            }
+
+            char *digest = nullptr;
+            uint64_t digestSize = 0;
+            plist_get_data_val(pdigest, &digest, &digestSize);
+            cleanup([&] {
+                safeFree(digest);
+            });
+            if (!digestSize) continue; //components with an empty digest are not personalized
+
+            bool ignored = std::find(fallbackIgnore.begin(), fallbackIgnore.end(), key) != fallbackIgnore.end();
+            auto &postings = _digests[std::string(digest, (size_t) digestSize)];
+            if (!postings.empty() && postings.back().identity == identIdx) {
+                //same digest used by several components of this identity, one probe satisfies all of them
+                if (postings.back().ignoredInFallback && !ignored) {
+                    postings.back().ignoredInFallback = false;
+                    ident.requiredFallback++;
+                }
+                continue;
+            }
+            postings.push_back({identIdx, ignored});
+            ident.required++;
+            if (!ignored) ident.requiredFallback++;
+        }
+        _identities.push_back(ident);
+    }
+    debug("[IM4M] indexed %zu digests of %zu build identities\n", _digests.size(), _identities.size());
+}
+
+std::string im4m_matcher::getRestoreBehavior(plist_t identity) {
+    std::string ret;
+    char *str = nullptr;
+    plist_t node = plist_dict_get_item(plist_dict_get_item(identity, "Info"), "RestoreBehavior");
+    if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &str);
+    if (str) ret = str;
+    safeFree(str);
+    return ret;
+}
+
+std::vector<std::string> im4m_matcher::getDigestsFromIM4M(const char *im4m, size_t im4mSize) {
+    static const char dgstTag[] = {0x16, 0x04, 'D', 'G', 'S', 'T'};
+    std::vector<std::string> ret;
+    retassure(im4m && im4mSize, "Got empty IM4M\n");
+
+    /*
+     * Every component in MANB carries its digest as a 'DGST' property:
+     * SEQUENCE { IA5String "DGST", OCTET STRING digest }
+     */
+    const char *end = im4m + im4mSize;
+    const char *p = im4m;
+    while ((p = std::search(p, end, dgstTag, dgstTag + sizeof(dgstTag))) != end) {
+        p += sizeof(dgstTag);
+        if (end - p < 2 || *p != 0x04) continue;
+        size_t len = (uint8_t) p[1];
+        p += 2;
+        if (len == 0x81) {
+            if (end - p < 1) break;
+            len = (uint8_t) *p++;
+        } else if (len > 0x7f) {
+            continue; //digests never need a multi-byte length
+        }
+        if ((size_t) (end - p) < len) break;
+        if (len) ret.emplace_back(p, len);
+        p += len;
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+im4m_matcher::match im4m_matcher::matchIM4M(const char *im4m, size_t im4mSize, const char *restoreBehavior) const {
+    match ret;
+    uint64_t board = 0;
+    uint64_t chip = 0;
+    try {
+        board = img4tool::getValFromIM4M({im4m, im4mSize}, 'BORD').getIntegerValue();
+        chip = img4tool::getValFromIM4M({im4m, im4mSize}, 'CHIP').getIntegerValue();
+    } catch (tihmstar::exception &e) {
+        debug("[IM4M] ticket does not contain BORD/CHIP, it can't match any build identity\n");
+        return ret;
+    }
+
+    std::vector<size_t> hits(_identities.size(), 0);
+    std::vector<size_t> hitsFallback(_identities.size(), 0);
+    for (auto &digest: getDigestsFromIM4M(im4m, im4mSize)) {
+        auto postings = _digests.find(digest);
+        if (postings == _digests.end()) continue;
+        for (auto &post: postings->second) {
+            hits[post.identity]++;
+            if (!post.ignoredInFallback) hitsFallback[post.identity]++;
+        }
+    }
+
+    for (size_t i = 0; i < _identities.size(); i++) {
+        auto &ident = _identities[i];
+        if (ident.boardID != board || ident.chipID != chip) continue;
+        if (restoreBehavior && ident.restoreBehavior != restoreBehavior) continue;
+        if (hits[i] > ret.hits || !ret.required) {
+            ret.hits = hits[i];
+            ret.required = ident.required;
+        }
+        if (!ret.exact && hits[i] == ident.required) ret.exact = ident.node;
+        if (!ret.fallback && hitsFallback[i] == ident.requiredFallback) ret.fallback = ident.node;
+    }
+    if (ret.exact) {
+        for (auto &ident: _identities) {
+            if (ident.node == ret.exact) {
+                ret.hits = ret.required = ident.required;
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+std::vector<im4m_matcher::match> im4m_matcher::matchIM4Ms(const std::vector<std::pair<char *, size_t>> &im4ms) const {
+    std::vector<match> ret;
+    ret.reserve(im4ms.size());
+    for (auto &im4m: im4ms) {
+        try {
+            ret.push_back(matchIM4M(im4m.first, im4m.second));
+        } catch (tihmstar::exception &e) {
+            debug("[IM4M] failed to score ticket: %s\n", e.what());
+            ret.emplace_back();
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,63 @@
+//
+//  im4m_matcher.hpp
+//  futurerestore
+//
+
+#ifndef im4m_matcher_hpp
+#define im4m_matcher_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <plist/plist.h>
+
+/*
+ * Matches IM4Ms against the build identities of a BuildManifest.
+ * Every identity's trusted component digests are indexed once into a hash table,
+ * so scoring a ticket is a single probe per digest it carries instead of
+ * comparing each manifest digest against each ticket for every identity.
+ */
+class im4m_matcher {
+public:
+    struct match {
+        plist_t exact;      //identity matching every trusted digest
+        plist_t fallback;   //identity matching when ignoring the fallback components
+        size_t hits;        //digests of the best identity found in the ticket
+        size_t required;    //digests the best identity requires
+        match() : exact(nullptr), fallback(nullptr), hits(0), required(0) {}
+    };
+
+private:
+    struct posting {
+        uint32_t identity;
+        bool ignoredInFallback;
+    };
+    struct identity {
+        plist_t node;
+        uint64_t boardID;
+        uint64_t chipID;
+        std::string restoreBehavior;
+        size_t required;
+        size_t requiredFallback;
+    };
+
+    std::vector<identity> _identities;
+    std::unordered_map<std::string, std::vector<posting>> _digests;
+
+public:
+    explicit im4m_matcher(plist_t buildmanifest,
+                          const std::vector<std::string> &fallbackIgnore = {"RestoreRamDisk", "RestoreTrustCache"});
+
+    size_t identityCount() const {return _identities.size();}
+
+    //restoreBehavior ("Erase" or "Update") limits the identities considered
+    match matchIM4M(const char *im4m, size_t im4mSize, const char *restoreBehavior = nullptr) const;
+    std::vector<match> matchIM4Ms(const std::vector<std::pair<char *, size_t>> &im4ms) const;
+
+    static std::vector<std::string> getDigestsFromIM4M(const char *im4m, size_t im4mSize);
+    static std::string getRestoreBehavior(plist_t identity);
+};
+
+#endif /* im4m_matcher_hpp */
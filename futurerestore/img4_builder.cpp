@@ -0,0 +1,100 @@
+//
+//  img4_builder.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#include "img4_builder.hpp"
+
+using namespace tihmstar;
+
+size_t img4_builder::encodeHeader(unsigned char *out, unsigned char tag, size_t length) {
+    out[0] = tag;
+    if (length < 0x80) {
+        out[1] = (unsigned char) length;
+        return 2;
+    }
+    size_t bytes = 0;
+    for (size_t l = length; l; l >>= 8) bytes++;
+    out[1] = (unsigned char) (0x80 | bytes);
+    for (size_t i = 0; i < bytes; i++) out[2 + i] = (unsigned char) (length >> (8 * (bytes - 1 - i)));
+    return 2 + bytes;
+}
+
+img4_builder::img4_builder(const char *im4p, size_t im4pSize, const char *im4m, size_t im4mSize) : _copied(0) {
+    retassure(im4p && im4pSize && im4m && im4mSize, "can't build an IMG4 without IM4P and IM4M\n");
+    _im4mHeaderSize = encodeHeader(_im4mHeader, 0xa0, im4mSize);
+    static const unsigned char magic[] = {0x16, 0x04, 'I', 'M', 'G', '4'};
+    size_t content = sizeof(magic) + im4pSize + _im4mHeaderSize + im4mSize;
+    _headerSize = encodeHeader(_header, 0x30, content);
+    memcpy(_header + _headerSize, magic, sizeof(magic));
+    _headerSize += sizeof(magic);
+    _size = _headerSize + content - sizeof(magic);
+
+    _segments.push_back({(const char *) _header, _headerSize});
+    _segments.push_back({im4p, im4pSize});
+    _segments.push_back({(const char *) _im4mHeader, _im4mHeaderSize});
+    _segments.push_back({im4m, im4mSize});
+}
+
+void img4_builder::writeTo(const std::string &path) const {
+    std::string tmpPath = path + ".tmp";
+#ifndef WIN32
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    retassure(fd >= 0, "can't save %s\n", path.c_str());
+    std::vector<struct iovec> iov;
+    for (auto &s: _segments) iov.push_back({(void *) s.first, s.second});
+    size_t first = 0;
+    bool failed = false;
+    while (first < iov.size()) {
+        ssize_t written = writev(fd, iov.data() + first, (int) (iov.size() - first));
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            failed = true;
+            break;
+        }
+        //skip what was written, partial writes can end anywhere
+        for (auto left = (size_t) written; left;) {
+            size_t n = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = (char *) iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+            left -= n;
+            if (!iov[first].iov_len) first++;
+        }
+        while (first < iov.size() && !iov[first].iov_len) first++;
+    }
+    failed |= close(fd) != 0;
+#else
+    FILE *f = fopen(tmpPath.c_str(), "wb");
+    retassure(f, "can't save %s\n", path.c_str());
+    bool failed = false;
+    for (auto &s: _segments) failed |= fwrite(s.first, 1, s.second, f) != s.second;
+    failed |= fclose(f) != 0;
+#endif
+    if (failed || rename(tmpPath.c_str(), path.c_str())) {
+        remove(tmpPath.c_str());
+        reterror("can't save %s\n", path.c_str());
+    }
+}
+
+std::pair<char *, size_t> img4_builder::assemble() const {
+    char *ret = (char *) malloc(_size);
+    retassure(ret, "failed to allocate %zu bytes for IMG4\n", _size);
+    size_t offset = 0;
+    for (auto &s: _segments) {
+        memcpy(ret + offset, s.first, s.second);
+        offset += s.second;
+    }
+    _copied += offset;
+    return {ret, _size};
+}
@@ -0,0 +1,50 @@
+//
+//  img4_builder.hpp
+//  futurerestore
+//
+
+#ifndef img4_builder_hpp
+#define img4_builder_hpp
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+/*
+ * IMG4 container around an existing IM4P and IM4M without concatenating them:
+ *   SEQUENCE { IA5String "IMG4", IM4P, [0] { IM4M } }
+ * Only the DER headers are computed, the payloads stay in their buffers, which have to outlive the builder.
+ * Writing streams the segments straight to the file, only uploads that need one contiguous buffer copy.
+ */
+class img4_builder {
+public:
+    typedef std::pair<const char *, size_t> segment;
+
+private:
+    unsigned char _header[16];   //SEQUENCE header and the "IMG4" string
+    size_t _headerSize;
+    unsigned char _im4mHeader[8]; //[0] header
+    size_t _im4mHeaderSize;
+    std::vector<segment> _segments;
+    size_t _size;
+    mutable size_t _copied;
+
+    static size_t encodeHeader(unsigned char *out, unsigned char tag, size_t length);
+
+public:
+    img4_builder(const char *im4p, size_t im4pSize, const char *im4m, size_t im4mSize);
+    img4_builder(const img4_builder &) = delete;
+    img4_builder &operator=(const img4_builder &) = delete;
+
+    size_t size() const {return _size;}
+    //payload bytes copied in memory so far
+    size_t copied() const {return _copied;}
+    const std::vector<segment> &segments() const {return _segments;}
+
+    void writeTo(const std::string &path) const;
+    //malloc'ed, the only copy of the payloads
+    std::pair<char *, size_t> assemble() const;
+};
+
+#endif /* img4_builder_hpp */
@@ -0,0 +1,284 @@
+//
+//  ipsw_archive.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <inttypes.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <zlib.h>
+#include <fstream>
+#include <utility>
+#include "ipsw_archive.hpp"
+#include "private_dir.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#define IPSW_MANIFEST_NAME "BuildManifest.plist"
+
+ipsw_archive::ipsw_archive(std::string path, std::string cacheDir)
+        : _path(std::move(path)), _cacheDir(std::move(cacheDir)), _st{}, _f(nullptr), _manifestFromCache(false) {
+    retassure(!stat(_path.c_str(), &_st), "failed to stat %s\n", _path.c_str());
+    retassure(S_ISREG(_st.st_mode), "%s is not a file\n", _path.c_str());
+    //what's cached there is trusted in place of the archive's own contents
+    if (!_cacheDir.empty() && !private_dir::prepare(_cacheDir)) _cacheDir.clear();
+#ifndef WIN32
+    //the mapping is only paged in where entries are read, not the whole multi-GB archive
+    try {
+        _map = mapped_file(_path);
+    } catch (tihmstar::exception &e) {
+        debug("[IPSW] failed to map %s, reading it instead\n", _path.c_str());
+    }
+#endif
+    if (!_map.data()) retassure(_f = fopen(_path.c_str(), "rb"), "failed to open %s\n", _path.c_str());
+
+    auto archiveSize = (uint64_t) _st.st_size;
+    std::vector<char> tail;
+    uint64_t tailSize = std::min<uint64_t>(archiveSize, (uint64_t) zip_directory::maxEOCDSearch);
+    readAt(archiveSize - tailSize, (size_t) tailSize, tail);
+    uint64_t cdOffset = 0;
+    uint64_t cdSize = 0;
+    uint64_t zip64TailOffset = 0;
+    if (!zip_directory::locateCentralDirectory(tail.data(), tail.size(), archiveSize, cdOffset, cdSize,
+                                               zip64TailOffset)) {
+        readAt(zip64TailOffset, (size_t) (archiveSize - zip64TailOffset), tail);
+        retassure(zip_directory::locateCentralDirectory(tail.data(), tail.size(), archiveSize, cdOffset, cdSize,
+                                                        zip64TailOffset),
+                  "failed to locate central directory of %s\n", _path.c_str());
+    }
+    std::vector<char> cd;
+    readAt(cdOffset, (size_t) cdSize, cd);
+    _directory.parseCentralDirectory(cd.data(), cd.size());
+    debug("[IPSW] %s has %zu entries\n", _path.c_str(), _directory.size());
+}
+
+ipsw_archive::~ipsw_archive() {
+    if (_f) fclose(_f);
+}
+
+void ipsw_archive::readAt(uint64_t offset, size_t size, std::vector<char> &out) {
+    retassure(offset + size <= (uint64_t) _st.st_size, "read out of bounds in %s\n", _path.c_str());
+    if (_map.data()) {
+        out.assign(_map.data() + offset, _map.data() + offset + size);
+        return;
+    }
+    out.resize(size);
+    std::lock_guard<std::mutex> guard(_fLock);
+    retassure(!fseeko(_f, (off_t) offset, SEEK_SET) && fread(out.data(), 1, size, _f) == size,
+              "failed to read %s\n", _path.c_str());
+}
+
+const zip_entry &ipsw_archive::getEntry(const std::string &name) const {
+    auto entry = _directory.getEntry(name);
+    retassure(entry, "%s not found in %s\n", name.c_str(), _path.c_str());
+    return *entry;
+}
+
+uint64_t ipsw_archive::getFileSize(const std::string &name) const {
+    return getEntry(name).uncompressedSize;
+}
+
+std::vector<char> ipsw_archive::extract(const std::string &name) {
+    auto &entry = getEntry(name);
+    retassure(entry.localHeaderOffset + 30 <= (uint64_t) _st.st_size,
+              "%s is out of bounds in %s\n", name.c_str(), _path.c_str());
+    if (_map.data()) {
+        const char *header = _map.data() + entry.localHeaderOffset;
+        size_t available = (size_t) ((uint64_t) _st.st_size - entry.localHeaderOffset);
+        uint64_t dataOffset = zip_directory::getDataOffsetFromLocalHeader(header, available, entry);
+        retassure(dataOffset <= available, "%s is out of bounds in %s\n", name.c_str(), _path.c_str());
+        return zip_directory::extractEntryData(entry, header + dataOffset, (size_t) (available - dataOffset));
+    }
+    std::vector<char> header;
+    readAt(entry.localHeaderOffset, 30, header);
+    uint64_t dataOffset = zip_directory::getDataOffsetFromLocalHeader(header.data(), header.size(), entry);
+    std::vector<char> data;
+    readAt(entry.localHeaderOffset + dataOffset, (size_t) entry.compressedSize, data);
+    return zip_directory::extractEntryData(entry, data.data(), data.size());
+}
+
+std::string ipsw_archive::getCacheKey() const {
+    char key[80];
+    snprintf(key, sizeof(key), "%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64, (uint64_t) _st.st_dev,
+             (uint64_t) _st.st_ino, (uint64_t) _st.st_size, (uint64_t) _st.st_mtime);
+    return key;
+}
+
+plist_t ipsw_archive::getBuildManifest() {
+    plist_t ret = nullptr;
+    std::string cachePath = _cacheDir.empty() ? "" : _cacheDir + "/" + getCacheKey() + ".bplist";
+    if (!cachePath.empty() && private_dir::isTrusted(cachePath)) {
+        try {
+            mapped_file cached(cachePath);
+            if (cached.startsWith("bplist00", 8)) plist_from_bin(cached.data(), (uint32_t) cached.size(), &ret);
+        } catch (tihmstar::exception &e) {
+            //not cached yet
+        }
+        if ((_manifestFromCache = ret != nullptr)) {
+            debug("[IPSW] using cached BuildManifest %s\n", cachePath.c_str());
+            return ret;
+        }
+    }
+
+    auto manifest = extract(IPSW_MANIFEST_NAME);
+    if (manifest.size() >= 8 && !memcmp(manifest.data(), "bplist00", 8)) {
+        plist_from_bin(manifest.data(), (uint32_t) manifest.size(), &ret);
+    } else {
+        plist_from_xml(manifest.data(), (uint32_t) manifest.size(), &ret);
+    }
+    retassure(ret, "failed to parse BuildManifest of %s\n", _path.c_str());
+    if (cachePath.empty()) return ret;
+
+    char *bin = nullptr;
+    uint32_t binSize = 0;
+    cleanup([&] {
+        safeFree(bin);
+    });
+    plist_to_bin(ret, &bin, &binSize);
+    if (!bin || !binSize) return ret;
+    std::string tmpPath = cachePath + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream cacheStream(tmpPath, std::ios::binary | std::ios::trunc);
+    cacheStream.write(bin, binSize);
+    cacheStream.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (cacheStream.fail() || rename(tmpPath.c_str(), cachePath.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[IPSW] failed to cache BuildManifest at %s\n", cachePath.c_str());
+    }
+    return ret;
+}
+
+uint64_t ipsw_archive::verify(threadpool &pool, const std::function<void(uint64_t done, uint64_t total)> &progress) {
+    struct entry_check {
+        const zip_entry *entry;
+        const char *data;       //only for mapped archives
+        std::vector<uLong> chunkCrcs; //only for stored entries split into chunks
+        bool failed;
+        std::string error;
+    };
+    struct task {
+        size_t check;
+        size_t chunk;
+    };
+    std::vector<entry_check> checks;
+    checks.reserve(_directory.size());
+    uint64_t total = 0;
+    for (auto &e: _directory.entries()) {
+        checks.push_back({&e.second, nullptr, {}, false, ""});
+        total += e.second.uncompressedSize;
+    }
+    //biggest first, so they don't end up as the tail of the run
+    std::sort(checks.begin(), checks.end(), [](const entry_check &a, const entry_check &b) {
+        return a.entry->compressedSize > b.entry->compressedSize;
+    });
+
+    std::vector<task> tasks;
+    for (size_t i = 0; i < checks.size(); i++) {
+        auto &c = checks[i];
+        auto &entry = *c.entry;
+        if (_map.data()) {
+            try {
+                retassure(entry.localHeaderOffset + 30 <= (uint64_t) _st.st_size, "local header out of bounds\n");
+                const char *header = _map.data() + entry.localHeaderOffset;
+                size_t available = (size_t) ((uint64_t) _st.st_size - entry.localHeaderOffset);
+                uint64_t dataOffset = zip_directory::getDataOffsetFromLocalHeader(header, available, entry);
+                retassure(dataOffset + entry.compressedSize <= available, "data out of bounds\n");
+                c.data = header + dataOffset;
+            } catch (tihmstar::exception &e) {
+                c.failed = true;
+                c.error = e.what();
+                continue;
+            }
+        }
+        if (c.data && entry.compression == ZIP_COMPRESSION_STORED && entry.compressedSize > verifyChunkSize) {
+            size_t chunks = (size_t) ((entry.compressedSize + verifyChunkSize - 1) / verifyChunkSize);
+            c.chunkCrcs.resize(chunks);
+            for (size_t j = 0; j < chunks; j++) tasks.push_back({i, j});
+        } else {
+            tasks.push_back({i, 0});
+        }
+    }
+
+    std::atomic<uint64_t> done{0};
+    auto report = [&](uint64_t size) {
+        uint64_t now = done += size;
+        if (progress) progress(now, total);
+    };
+    pool.parallelFor(tasks.size(), [&](size_t t) {
+        auto &c = checks[tasks[t].check];
+        auto &entry = *c.entry;
+        if (!c.chunkCrcs.empty()) {
+            uint64_t offset = tasks[t].chunk * verifyChunkSize;
+            uint64_t size = std::min(verifyChunkSize, entry.compressedSize - offset);
+            c.chunkCrcs[tasks[t].chunk] = crc32(crc32(0L, Z_NULL, 0), (const Bytef *) c.data + offset, (uInt) size);
+            report(size);
+            return;
+        }
+        try {
+            if (c.data) {
+                zip_directory::verifyEntryData(entry, c.data, (size_t) entry.compressedSize);
+            } else {
+                zip_directory::extractEntryFromFile(_path, entry, [](const char *, size_t) {});
+            }
+        } catch (tihmstar::exception &e) {
+            c.failed = true;
+            c.error = e.what();
+        }
+        report(entry.uncompressedSize);
+    });
+
+    std::vector<std::string> corrupt;
+    for (auto &c: checks) {
+        if (!c.chunkCrcs.empty()) {
+            uLong crc = c.chunkCrcs[0];
+            for (size_t j = 1; j < c.chunkCrcs.size(); j++) {
+                uint64_t size = std::min(verifyChunkSize, c.entry->compressedSize - j * verifyChunkSize);
+                crc = crc32_combine(crc, c.chunkCrcs[j], (z_off_t) size);
+            }
+            if (c.entry->compressedSize != c.entry->uncompressedSize) {
+                c.failed = true;
+                c.error = "size mismatch\n";
+            } else if (crc != c.entry->crc32) {
+                c.failed = true;
+                c.error = "CRC-32 mismatch\n";
+            }
+        }
+        if (!c.failed) continue;
+        c.error.erase(c.error.find_last_not_of('\n') + 1);
+        error("[IPSW] %s: %s\n", c.entry->name.c_str(), c.error.c_str());
+        corrupt.push_back(c.entry->name);
+    }
+    retassure(corrupt.empty(), "%s is corrupt, %zu entries failed the CRC-32 check (first: %s)\n", _path.c_str(),
+              corrupt.size(), corrupt.empty() ? "" : corrupt.front().c_str());
+    return total;
+}
+
+bool ipsw_archive::isVerified() const {
+    struct stat st{};
+    std::string stampPath = _cacheDir + "/" + getCacheKey() + ".verified";
+    //a stamp skips the whole CRC check, so it has to be one this user wrote
+    return !_cacheDir.empty() && !stat(stampPath.c_str(), &st) && private_dir::isTrusted(stampPath);
+}
+
+void ipsw_archive::markVerified() {
+    if (_cacheDir.empty()) return;
+    std::string stampPath = _cacheDir + "/" + getCacheKey() + ".verified";
+    std::ofstream stamp(stampPath, std::ios::trunc);
+    stamp << _path << "\n";
+    stamp.close();
+#ifndef WIN32
+    chmod(stampPath.c_str(), 0600);
+#endif
+    if (stamp.fail()) debug("[IPSW] failed to write %s\n", stampPath.c_str());
+}
@@ -0,0 +1,70 @@
+//
+//  ipsw_archive.hpp
+//  futurerestore
+//
+
+#ifndef ipsw_archive_hpp
+#define ipsw_archive_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <plist/plist.h>
+#include "mapped_file.hpp"
+#include "zip_directory.hpp"
+#include "threadpool.hpp"
+
+/*
+ * Local IPSW, opened once per session.
+ * The archive is mapped and its central directory parsed into a name -> entry table once, the BuildManifest,
+ * size queries and component extraction are all served from that instead of reopening the zip every time.
+ * The parsed BuildManifest is kept as a binary plist keyed by the IPSW's (device, inode, size, mtime),
+ * so repeat runs don't inflate and parse the XML again. Nothing is cached unless cacheDir is a private_dir.
+ * verify() checks the CRC-32 of every entry on a threadpool, stored entries are split into chunks whose CRCs are
+ * combined, so one multi-GB image doesn't end up on a single worker. A passed check leaves a stamp under the
+ * same key, so an unchanged IPSW is only checked once.
+ */
+class ipsw_archive {
+    std::string _path;
+    std::string _cacheDir;
+    struct stat _st;
+    mapped_file _map;
+    FILE *_f; //only where the archive isn't mapped
+    std::mutex _fLock; //extract runs on several tasks at once, seek and read have to stay together
+    zip_directory _directory;
+    bool _manifestFromCache;
+
+    void readAt(uint64_t offset, size_t size, std::vector<char> &out);
+    const zip_entry &getEntry(const std::string &name) const;
+    std::string getCacheKey() const;
+
+public:
+    //throws if path is not a zip (e.g. an extracted IPSW directory)
+    explicit ipsw_archive(std::string path, std::string cacheDir = "");
+    ipsw_archive(const ipsw_archive &) = delete;
+    ipsw_archive &operator=(const ipsw_archive &) = delete;
+    ~ipsw_archive();
+
+    const std::string &path() const {return _path;}
+    const zip_directory &directory() const {return _directory;}
+
+    bool exists(const std::string &name) const {return _directory.getEntry(name) != nullptr;}
+    uint64_t getFileSize(const std::string &name) const;
+    std::vector<char> extract(const std::string &name);
+
+    //caller owns the returned plist
+    plist_t getBuildManifest();
+    bool manifestFromCache() const {return _manifestFromCache;}
+
+    static const uint64_t verifyChunkSize = 0x4000000;
+    //throws naming the corrupt entries, returns the number of (uncompressed) bytes checked
+    uint64_t verify(threadpool &pool, const std::function<void(uint64_t done, uint64_t total)> &progress = nullptr);
+    bool isVerified() const;
+    void markVerified();
+};
+
+#endif /* ipsw_archive_hpp */
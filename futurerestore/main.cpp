@@ -7,7 +7,12 @@
 //
 
 #include <getopt.h>
+#include <curl/curl.h>
 #include "futurerestore.hpp"
+#include "progress.hpp"
+#include "compat_matrix.hpp"
+#include "task_graph.hpp"
+#include "nonce_collider.hpp"
 
 extern "C"{
 #include "tsschecker.h"
@@ -29,6 +34,21 @@ extern "C"{
 #endif
 #endif
 
+//long-only options past the digit codes, kept outside the char range so they can't be given as short options
+enum {
+    OPT_RANGE_GAP = 0x100,
+    OPT_PREFLIGHT,
+    OPT_SAVE_PROFILE,
+    OPT_PROGRESS_FD,
+    OPT_FEED_MAX_AGE,
+    OPT_FS_CACHE_LIMIT,
+    OPT_COMPAT_MATRIX,
+    OPT_SKIP_IPSW_VERIFY,
+    OPT_RESUME,
+    OPT_WAIT_ALL,
+    OPT_DECRYPT_COMPONENTS,
+};
+
 static struct option longopts[] = {
         { "apticket",                   required_argument,      nullptr, 't' },
         { "baseband",                   required_argument,      nullptr, 'b' },
@@ -47,6 +67,16 @@ static struct option longopts[] = {
         { "no-restore",                 no_argument,            nullptr, 'z' },
         { "latest-baseband",            no_argument,            nullptr, '1' },
         { "no-baseband",                no_argument,            nullptr, '2' },
+        { "range-gap",                  required_argument,      nullptr, OPT_RANGE_GAP },
+        { "preflight",                  required_argument,      nullptr, OPT_PREFLIGHT },
+        { "save-profile",               required_argument,      nullptr, OPT_SAVE_PROFILE },
+        { "progress-fd",                required_argument,      nullptr, OPT_PROGRESS_FD },
+        { "feed-max-age",               required_argument,      nullptr, OPT_FEED_MAX_AGE },
+        { "fs-cache-limit",             required_argument,      nullptr, OPT_FS_CACHE_LIMIT },
+        { "compat-matrix",              no_argument,            nullptr, OPT_COMPAT_MATRIX },
+        { "skip-ipsw-verify",           no_argument,            nullptr, OPT_SKIP_IPSW_VERIFY },
+        { "resume",                     required_argument,      nullptr, OPT_RESUME },
+        { "wait-all",                   no_argument,            nullptr, OPT_WAIT_ALL },
 #ifdef HAVE_LIBIPATCHER
         { "use-pwndfu",                 no_argument,            nullptr, '3' },
         { "no-ibss",                    no_argument,            nullptr, '4' },
@@ -57,6 +87,7 @@ static struct option longopts[] = {
         { "boot-args",                  required_argument,      nullptr, '9' },
         { "no-cache",                   no_argument,            nullptr, 'a' },
         { "skip-blob",                  no_argument,            nullptr, 'f' },
+        { "decrypt-components",         no_argument,            nullptr, OPT_DECRYPT_COMPONENTS },
 #endif
         { nullptr, 0, nullptr, 0 }
 };
@@ -79,6 +110,14 @@ static struct option longopts[] = {
 #define FLAG_CUSTOM_LATEST          1 << 15
 #define FLAG_CUSTOM_LATEST_BUILDID  1 << 16
 #define FLAG_CUSTOM_LATEST_BETA     1 << 17
+#define FLAG_PREFLIGHT              1 << 18
+#define FLAG_COMPAT_MATRIX          1 << 19
+#define FLAG_SKIP_IPSW_VERIFY       1 << 20
+#define FLAG_WAIT_ALL               1 << 21
+#define FLAG_DECRYPT_COMPONENTS     1 << 22
+#define FLAG_RANGE_GAP              1 << 23
+#define FLAG_FEED_MAX_AGE           1 << 24
+#define FLAG_FS_CACHE_LIMIT         1 << 25
 
 void cmd_help(){
     printf("Usage: futurerestore [OPTIONS] iPSW\n");
@@ -89,12 +128,22 @@ void cmd_help(){
     printf("  -u, --update\t\t\t\tUpdate instead of erase install (requires appropriate APTicket)\n");
     printf("              \t\t\t\tDO NOT use this parameter, if you update from jailbroken firmware!\n");
     printf("  -w, --wait\t\t\t\tKeep rebooting until ApNonce matches APTicket (ApNonce collision, unreliable)\n");
+    printf("      --wait-all\t\t\tApNonce collision for every device in recovery mode with an APTicket for its ECID, then quit\n");
     printf("  -d, --debug\t\t\t\tShow all code, use to save a log for debug testing\n");
     printf("  -e, --exit-recovery\t\t\tExit recovery mode and quit\n");
     printf("  -z, --no-restore\t\t\tDo not restore and end right before NOR data is sent\n");
     printf("  -c, --custom-latest VERSION\t\tSpecify custom latest version to use for SEP, Baseband and other FirmwareUpdater components\n");
     printf("  -g, --custom-latest-buildid BUILDID\tSpecify custom latest buildid to use for SEP, Baseband and other FirmwareUpdater components\n");
-    printf("  -i, --custom-latest-beta\t\tGet custom url from list of beta firmwares");
+    printf("  -i, --custom-latest-beta\t\tGet custom url from list of beta firmwares\n");
+    printf("      --preflight PROFILE\t\tRun all host side checks against a saved device profile, without a device attached\n");
+    printf("      --save-profile PATH\t\tSave the profile of the attached device for --preflight and quit\n");
+    printf("      --progress-fd FD\t\t\tWrite progress events as newline delimited JSON to file descriptor FD\n");
+    printf("      --feed-max-age SECONDS\t\tUse cached firmware feeds younger than SECONDS without revalidating them (default 0)\n");
+    printf("      --compat-matrix\t\t\tShow which of the given APTickets are valid for which of the given iPSWs (Erase and Update) and quit\n");
+    printf("      --fs-cache-limit MIB\t\tEvict the least recently used extracted filesystems once they take more than MIB (default 20480, 0 never evicts)\n");
+    printf("      --resume SESSION\t\t\tSkip the phases that already completed in SESSION (printed at the start of every restore)\n");
+    printf("      --skip-ipsw-verify\t\tDo not check the CRC-32 of every iPSW entry before restoring (only done once per iPSW anyway)\n");
+    printf("      --range-gap BYTES\t\t\tMerge latest firmware component downloads that are at most BYTES apart into one request (default 1MiB, 0 only merges adjacent ones)\n");
 
 #ifdef HAVE_LIBIPATCHER
     printf("\nOptions for downgrading with Odysseus:\n");
@@ -108,6 +157,7 @@ void cmd_help(){
     printf("      --boot-args\t\t\tSet custom restore boot-args(PROCEED WITH CAUTION)(requires use-pwndfu)\n");
     printf("      --no-cache\t\t\tDisable cached patched iBSS/iBEC(requires use-pwndfu)\n");
     printf("      --skip-blob\t\t\tSkip SHSH blob validation(PROCEED WITH CAUTION)(requires use-pwndfu)\n");
+    printf("      --decrypt-components\t\tDecrypt the components of iPSW a 32-bit pwnDFU restore sends into the cache and quit\n");
 #endif
 
     printf("\nOptions for SEP:\n");
@@ -159,6 +209,12 @@ int main_r(int argc, const char * argv[]) {
     const char *ramdiskPath = nullptr;
     const char *kernelPath = nullptr;
     const char *custom_nonce = nullptr;
+    uint64_t rangeGap = 0;
+    long feedMaxAge = 0;
+    uint64_t fsCacheLimit = 0;
+    const char *preflightProfile = nullptr;
+    const char *saveProfilePath = nullptr;
+    const char *resumeSession = nullptr;
 
     vector<const char*> apticketPaths;
 
@@ -208,6 +264,61 @@ int main_r(int argc, const char * argv[]) {
             case 'i': // long option: "custom-latest-beta"; can be called as short option
                 flags |= FLAG_CUSTOM_LATEST_BETA;
                 break;
+            case OPT_RANGE_GAP: { // long option: "range-gap";
+                char *end = nullptr;
+                errno = 0;
+                rangeGap = strtoull(optarg, &end, 0);
+                retassure(*optarg && !strchr(optarg, '-') && !*end && errno != ERANGE, "invalid --range-gap %s\n",
+                          optarg);
+                flags |= FLAG_RANGE_GAP;
+                break;
+            }
+            case OPT_PREFLIGHT: // long option: "preflight";
+                flags |= FLAG_PREFLIGHT;
+                preflightProfile = optarg;
+                break;
+            case OPT_SAVE_PROFILE: // long option: "save-profile";
+                saveProfilePath = optarg;
+                break;
+            case OPT_FEED_MAX_AGE: { // long option: "feed-max-age";
+                char *end = nullptr;
+                errno = 0;
+                feedMaxAge = strtol(optarg, &end, 0);
+                retassure(*optarg && !*end && errno != ERANGE && feedMaxAge >= 0, "invalid --feed-max-age %s\n",
+                          optarg);
+                flags |= FLAG_FEED_MAX_AGE;
+                break;
+            }
+            case OPT_FS_CACHE_LIMIT: { // long option: "fs-cache-limit";
+                char *end = nullptr;
+                errno = 0;
+                fsCacheLimit = strtoull(optarg, &end, 0);
+                retassure(*optarg && !strchr(optarg, '-') && !*end && errno != ERANGE, "invalid --fs-cache-limit %s\n",
+                          optarg);
+                retassure(fsCacheLimit <= UINT64_MAX >> 20, "--fs-cache-limit %s is too large\n", optarg);
+                fsCacheLimit <<= 20;
+                flags |= FLAG_FS_CACHE_LIMIT;
+                break;
+            }
+            case OPT_COMPAT_MATRIX: // long option: "compat-matrix";
+                flags |= FLAG_COMPAT_MATRIX;
+                break;
+            case OPT_WAIT_ALL: // long option: "wait-all";
+                flags |= FLAG_WAIT_ALL;
+                break;
+            case OPT_SKIP_IPSW_VERIFY: // long option: "skip-ipsw-verify";
+                flags |= FLAG_SKIP_IPSW_VERIFY;
+                break;
+            case OPT_RESUME: // long option: "resume";
+                resumeSession = optarg;
+                break;
+            case OPT_PROGRESS_FD: { // long option: "progress-fd";
+                char *end = nullptr;
+                long fd = strtol(optarg, &end, 10);
+                retassure(*optarg && !*end && fd >= 0, "invalid --progress-fd %s\n", optarg);
+                progress_stream::shared().open((int) fd);
+                break;
+            }
             case '0': // long option: "latest-sep";
                 flags |= FLAG_LATEST_SEP;
                 break;
@@ -255,6 +366,9 @@ int main_r(int argc, const char * argv[]) {
             case 'f': // long option: "skip-blob";
                 flags |= FLAG_SKIP_BLOB;
                 break;
+            case OPT_DECRYPT_COMPONENTS: // long option: "decrypt-components";
+                flags |= FLAG_DECRYPT_COMPONENTS;
+                break;
 #endif
             case 'e': // long option: "exit-recovery"; can be called as short option
                 exitRecovery = true;
@@ -271,6 +385,26 @@ int main_r(int argc, const char * argv[]) {
         }
     }
 
+    if (flags & FLAG_WAIT_ALL) {
+        //talks to the devices through libirecovery directly, one futurerestore client only drives one device
+        retassure(argc == optind, "--wait-all doesn't restore, it takes no iPSW\n");
+        retassure(!apticketPaths.empty(), "--wait-all requires the APTickets of the devices\n");
+        nonce_collider collider(apticketPaths);
+        collider.run();
+        return 0;
+    }
+
+    if (flags & FLAG_COMPAT_MATRIX) {
+        //only reads BuildManifests and tickets, no device needed
+        retassure(argc > optind, "--compat-matrix requires at least one iPSW\n");
+        retassure(!apticketPaths.empty(), "--compat-matrix requires at least one APTicket\n");
+        compat_matrix matrix(std::vector<std::string>(argv + optind, argv + argc),
+                             std::vector<std::string>(apticketPaths.begin(), apticketPaths.end()));
+        matrix.build();
+        matrix.print();
+        return 0;
+    }
+
     if (argc-optind == 1) {
         argv += optind;
 
@@ -279,6 +413,8 @@ int main_r(int argc, const char * argv[]) {
         info("User requested to only wait for ApNonce to match, but not for actually restoring\n");
     }else if (exitRecovery){
         info("Exiting from recovery mode to normal mode\n");
+    }else if (argc == optind && saveProfilePath){
+        info("Saving device profile to %s\n", saveProfilePath);
     }else{
         error("argument parsing failed! agrc=%d optind=%d\n",argc,optind);
         if (idevicerestore_debug){
@@ -289,8 +425,22 @@ int main_r(int argc, const char * argv[]) {
         return -5;
     }
 
+    //curl_easy_init does this on first use, which isn't thread safe, and the restore graph runs downloads
+    //and tsschecker's TSS requests on several threads at once
+    curl_global_init(CURL_GLOBAL_ALL);
+    cleanup([&] {
+        curl_global_cleanup();
+    });
+
     futurerestore client(flags & FLAG_UPDATE, flags & FLAG_IS_PWN_DFU, flags & FLAG_NO_IBSS, flags & FLAG_SET_NONCE, flags & FLAG_SERIAL, flags & FLAG_NO_RESTORE_FR);
-    retassure(client.init(),"can't init, no device found\n");
+    if (flags & FLAG_PREFLIGHT) {
+        retassure(!(flags & FLAG_IS_PWN_DFU) && !exitRecovery && !saveProfilePath,
+                  "--preflight can't be combined with --use-pwndfu, --exit-recovery or --save-profile\n");
+        retassure(ipsw, "--preflight requires an iPSW\n");
+        client.loadDeviceProfile(preflightProfile);
+    } else {
+        retassure(client.init(),"can't init, no device found\n");
+    }
 
     printf("futurerestore init done\n");
     if(flags & FLAG_NO_IBSS)
@@ -326,11 +476,30 @@ int main_r(int argc, const char * argv[]) {
         return 0;
     }
 
+    if (saveProfilePath) {
+        client.saveDeviceProfile(saveProfilePath);
+        return 0;
+    }
+
+    if (flags & FLAG_DECRYPT_COMPONENTS) {
+        retassure(ipsw, "--decrypt-components requires an iPSW\n");
+        client.decryptComponents(ipsw);
+        return 0;
+    }
+
     try {
-        if (!apticketPaths.empty()) {
-            client.loadAPTickets(apticketPaths);
+        if(flags & FLAG_RANGE_GAP) {
+            client.setRangeGap(rangeGap);
+        }
+        if(flags & FLAG_FEED_MAX_AGE) {
+            client.setFeedMaxAge(feedMaxAge);
+        }
+        if(flags & FLAG_FS_CACHE_LIMIT) {
+            client.setFsCacheLimit(fsCacheLimit);
+        }
+        if(flags & FLAG_SKIP_IPSW_VERIFY) {
+            client.skipIPSWVerification();
         }
-
         if(!customLatest.empty()) {
             client.setCustomLatest(customLatest);
         }
@@ -350,6 +519,11 @@ int main_r(int argc, const char * argv[]) {
                 cmd_help();
                 err = -2;
             }else{
+                client.stages().begin("load APTickets");
+                if (!apticketPaths.empty()) {
+                    client.loadAPTickets(apticketPaths);
+                }
+                client.stages().begin("enter recovery");
                 client.putDeviceIntoRecovery();
                 client.waitForNonce();
                 info("Done\n");
@@ -357,6 +531,12 @@ int main_r(int argc, const char * argv[]) {
             goto error;
         }
 
+        //only now it's certain a restore runs, waiting for a nonce has nothing to checkpoint
+        if (!client.isPreflight()) {
+            //captured once, checkpoints must not query the device while it reboots into recovery
+            client.openSession(resumeSession, client.getDeviceEcid());
+        }
+
         devVals.deviceModel = (char*)client.getDeviceModelNoCopy();
         devVals.deviceBoard = (char*)client.getDeviceBoardNoCopy();
 
@@ -386,68 +566,147 @@ int main_r(int argc, const char * argv[]) {
             client.skipBlobValidation();
         }
 
-        if (flags & FLAG_LATEST_SEP){
-            info("user specified to use latest signed SEP\n");
-            client.downloadLatestSep();
-        }else if (!client.is32bit()){
-            client.setSepPath(sepPath);
-            client.setSepManifestPath(sepManifestPath);
-            client.loadSep(sepPath);
-            client.loadSepManifest(sepManifestPath);
-        }
-
-        versVals.basebandMode = kBasebandModeWithoutBaseband;
-        if (!client.is32bit() && !(isManifestSignedForDevice(client.getSepManifestPath().c_str(), &devVals, &versVals, nullptr))){
-            reterror("SEP firmware is NOT being signed!\n");
-        }
         if (flags & FLAG_NO_BASEBAND){
             printf("\nWARNING: user specified is not to flash a baseband. This can make the restore fail if the device needs a baseband!\n");
-            printf("if you added this flag by mistake, you can press CTRL-C now to cancel\n");
-            int c = 10;
-            printf("continuing restore in ");
-            while (c) {
-                printf("%d ",c--);
-                fflush(stdout);
-                sleep(1);
+            if (!client.isPreflight()) {
+                printf("if you added this flag by mistake, you can press CTRL-C now to cancel\n");
+                int c = 10;
+                printf("continuing restore in ");
+                while (c) {
+                    printf("%d ",c--);
+                    fflush(stdout);
+                    sleep(1);
+                }
+                printf("\n");
             }
-            printf("\n");
-        }else{
-            if (flags & FLAG_LATEST_BASEBAND){
-                info("user specified to use latest signed baseband\n");
-                client.downloadLatestBaseband();
-            }else{
-                client.setBasebandPath(basebandPath);
-                client.setBasebandManifestPath(basebandManifestPath);
-                client.loadBaseband(basebandPath);
-                client.loadBasebandManifest(basebandManifestPath);
-                printf("Did set SEP+baseband path and firmware\n");
+        }
+
+        //most of these don't depend on each other, so ticket decoding, downloads, TSS requests and the device overlap
+        client.stages().end();
+        //the steps must not query the device themselves while it is rebooting into recovery
+        client.getDeviceEcid();
+        bool is32bit = client.is32bit();
+        task_graph prep;
+        std::vector<task_graph::node_id> recoveryDeps;
+        recoveryDeps.push_back(prep.add("load APTickets", [&] {
+            if (!apticketPaths.empty()) {
+                client.loadAPTickets(apticketPaths);
             }
+        }));
+        recoveryDeps.push_back(prep.add("iPSW", [&] {
+            client.prepareIPSW(ipsw);
+        }));
+        std::vector<task_graph::node_id> latestDeps;
+        if ((flags & FLAG_LATEST_SEP) || (flags & FLAG_LATEST_BASEBAND) || !is32bit) {
+            latestDeps.push_back(prep.add("latest firmware", [&] {
+                client.getLatestManifest();
+            }));
+        }
 
-            versVals.basebandMode = kBasebandModeOnlyBaseband;
-            if (!(devVals.bbgcid = client.getBasebandGoldCertIDFromDevice())){
-                printf("[WARNING] using tsschecker's fallback to get BasebandGoldCertID. This might result in invalid baseband signing status information\n");
+        auto sep = prep.add("SEP", [&] {
+            if (flags & FLAG_LATEST_SEP){
+                info("user specified to use latest signed SEP\n");
+                client.downloadLatestSep();
+            }else if (!is32bit){
+                client.setSepPath(sepPath);
+                client.setSepManifestPath(sepManifestPath);
+                client.loadSep(sepPath);
+                client.loadSepManifest(sepManifestPath);
             }
-            if (!(isManifestSignedForDevice(client.getBasebandManifestPath().c_str(), &devVals, &versVals, nullptr))) {
-                reterror("baseband firmware is NOT being signed!\n");
+        }, (flags & FLAG_LATEST_SEP) ? latestDeps : std::vector<task_graph::node_id>());
+        recoveryDeps.push_back(prep.add("SEP signing status", [&] {
+            //bbgcid is published separately, devVals itself is only read by the steps
+            t_devicevals sepDevVals = devVals;
+            t_iosVersion sepVersVals = versVals;
+            sepVersVals.basebandMode = kBasebandModeWithoutBaseband;
+            //never resumed, signing can stop at any time
+            if (!is32bit && !(isManifestSignedForDevice(client.getSepManifestPath().c_str(), &sepDevVals, &sepVersVals, nullptr))) {
+                reterror("SEP firmware is NOT being signed!\n");
             }
+        }, {sep}));
+
+        uint64_t basebandGoldCertID = 0;
+        if (!(flags & FLAG_NO_BASEBAND)) {
+            auto bbgcid = prep.add("BasebandGoldCertID", [&] {
+                if (!(basebandGoldCertID = client.getBasebandGoldCertIDFromDevice())){
+                    printf("[WARNING] using tsschecker's fallback to get BasebandGoldCertID. This might result in invalid baseband signing status information\n");
+                }
+            });
+            auto baseband = prep.add("baseband", [&] {
+                if (flags & FLAG_LATEST_BASEBAND){
+                    info("user specified to use latest signed baseband\n");
+                    client.downloadLatestBaseband();
+                }else{
+                    client.setBasebandPath(basebandPath);
+                    client.setBasebandManifestPath(basebandManifestPath);
+                    client.loadBaseband(basebandPath);
+                    client.loadBasebandManifest(basebandManifestPath);
+                    printf("Did set SEP+baseband path and firmware\n");
+                }
+            }, (flags & FLAG_LATEST_BASEBAND) ? latestDeps : std::vector<task_graph::node_id>());
+            recoveryDeps.push_back(bbgcid);
+            recoveryDeps.push_back(prep.add("baseband signing status", [&] {
+                t_devicevals basebandDevVals = devVals;
+                basebandDevVals.bbgcid = basebandGoldCertID;
+                t_iosVersion basebandVersVals = versVals;
+                basebandVersVals.basebandMode = kBasebandModeOnlyBaseband;
+                if (!(isManifestSignedForDevice(client.getBasebandManifestPath().c_str(), &basebandDevVals, &basebandVersVals, nullptr))) {
+                    reterror("baseband firmware is NOT being signed!\n");
+                }
+            }, {baseband, bbgcid}));
         }
 
-        if(!client.is32bit())
-            client.downloadLatestFirmwareComponents();
-        client.putDeviceIntoRecovery();
-        if (flags & FLAG_WAIT){
+        if(!is32bit) {
+            //a failed download must not leave the device in recovery
+            recoveryDeps.push_back(prep.add("latest firmware components", [&] {
+                client.downloadLatestFirmwareComponents();
+            }, latestDeps));
+        }
+        //only once everything that can refuse the restore has passed, the device I/O above is done by then
+        if (!client.isPreflight()) {
+            prep.add("enter recovery", [&] {
+                client.putDeviceIntoRecovery();
+            }, recoveryDeps);
+        }
+        try {
+            prep.run(client.stages());
+        } catch (...) {
+            prep.printCriticalPath();
+            throw;
+        }
+        prep.printCriticalPath();
+        if (!client.isPreflight() && (flags & FLAG_WAIT)) {
+            client.stages().begin("wait for ApNonce");
             client.waitForNonce();
         }
+        client.stages().end();
     } catch (int error) {
         err = error;
         printf("[Error] Fail code=%d\n",err);
         goto error;
+    } catch (tihmstar::exception &e) {
+        client.stages().fail(e.what());
+        if (!client.isPreflight()) throw;
+    }
+
+    if (client.isPreflight()) {
+        if (!client.stages().failed()) {
+            try {
+                client.preflight(ipsw);
+            } catch (tihmstar::exception &e) {
+                client.stages().fail(e.what());
+            }
+        }
+        client.stages().print();
+        printf("Done: preflight %s!\n", client.stages().failed() ? "failed" : "passed");
+        return client.stages().failed() ? -10 : 0;
     }
 
     try {
         client.doRestore(ipsw);
         printf("Done: restoring succeeded!\n");
     } catch (tihmstar::exception &e) {
+        client.stages().fail(e.what());
         e.dump();
         printf("Done: restoring failed!\n");
     }
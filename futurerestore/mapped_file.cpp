@@ -0,0 +1,88 @@
+//
+//  mapped_file.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <utility>
+#include "mapped_file.hpp"
+
+using namespace tihmstar;
+
+mapped_file::mapped_file(const std::string &path) : _data(nullptr), _size(0), _mapped(false) {
+#ifdef WIN32
+    FILE *f = fopen(path.c_str(), "rb");
+    retassure(f, "failed to open %s\n", path.c_str());
+    cleanup([&] {
+        fclose(f);
+    });
+    struct stat st{};
+    retassure(!fstat(fileno(f), &st), "failed to stat %s\n", path.c_str());
+    _size = (size_t) st.st_size;
+    if (!_size) return;
+    retassure(_data = (char *) malloc(_size), "failed to alloc memory for %s\n", path.c_str());
+    if (fread(_data, 1, _size, f) != _size) {
+        release();
+        reterror("failed to read %s\n", path.c_str());
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    retassure(fd != -1, "failed to open %s\n", path.c_str());
+    cleanup([&] {
+        close(fd);
+    });
+    struct stat st{};
+    retassure(!fstat(fd, &st), "failed to stat %s\n", path.c_str());
+    _size = (size_t) st.st_size;
+    if (!_size) return; //mmap refuses empty mappings
+    void *map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    retassure(map != MAP_FAILED, "failed to map %s\n", path.c_str());
+    _data = (char *) map;
+    _mapped = true;
+#endif
+}
+
+mapped_file::mapped_file(mapped_file &&other) : _data(other._data), _size(other._size), _mapped(other._mapped) {
+    other._data = nullptr;
+    other._size = 0;
+    other._mapped = false;
+}
+
+mapped_file &mapped_file::operator=(mapped_file &&other) {
+    if (this != &other) {
+        release();
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+        std::swap(_mapped, other._mapped);
+    }
+    return *this;
+}
+
+mapped_file::~mapped_file() {
+    release();
+}
+
+void mapped_file::release() {
+    if (_mapped) {
+#ifndef WIN32
+        munmap(_data, _size);
+#endif
+        _data = nullptr;
+    }
+    safeFree(_data);
+    _size = 0;
+    _mapped = false;
+}
+
+bool mapped_file::startsWith(const char *magic, size_t magicSize) const {
+    return _size >= magicSize && !memcmp(_data, magic, magicSize);
+}
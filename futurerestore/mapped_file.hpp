@@ -0,0 +1,38 @@
+//
+//  mapped_file.hpp
+//  futurerestore
+//
+
+#ifndef mapped_file_hpp
+#define mapped_file_hpp
+
+#include <stddef.h>
+#include <string>
+
+/*
+ * Read-only mapping of a whole file.
+ * Falls back to reading the file into memory where mmap isn't available.
+ */
+class mapped_file {
+    char *_data;
+    size_t _size;
+    bool _mapped;
+
+    void release();
+
+public:
+    mapped_file() : _data(nullptr), _size(0), _mapped(false) {}
+    //throws if the file can't be opened or mapped
+    explicit mapped_file(const std::string &path);
+    mapped_file(mapped_file &&other);
+    mapped_file &operator=(mapped_file &&other);
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file();
+
+    const char *data() const {return _data;}
+    size_t size() const {return _size;}
+    bool startsWith(const char *magic, size_t magicSize) const;
+};
+
+#endif /* mapped_file_hpp */
@@ -0,0 +1,226 @@
+//
+//  nonce_collider.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <img4tool/img4tool.hpp>
+#include <plist/plist.h>
+#include "nonce_collider.hpp"
+#include "futurerestore.hpp"
+#include "progress.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static std::string getDataVal(plist_t dict, const char *key) {
+    std::string ret;
+    char *data = nullptr;
+    uint64_t dataSize = 0;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node && plist_get_node_type(node) == PLIST_DATA) plist_get_data_val(node, &data, &dataSize);
+    if (data) ret.assign(data, (size_t) dataSize);
+    safeFree(data);
+    return ret;
+}
+
+static std::string toHex(const std::string &data) {
+    static const char digits[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(data.size() * 2);
+    for (unsigned char c: data) {
+        ret += digits[c >> 4];
+        ret += digits[c & 0xf];
+    }
+    return ret;
+}
+
+static bool isRecoveryMode(int mode) {
+    return mode == IRECV_K_RECOVERY_MODE_1 || mode == IRECV_K_RECOVERY_MODE_2 || mode == IRECV_K_RECOVERY_MODE_3 ||
+           mode == IRECV_K_RECOVERY_MODE_4;
+}
+
+nonce_collider::nonce_collider(const std::vector<const char *> &apticketPaths) : _remaining(0) {
+    for (auto path: apticketPaths) {
+        plist_t apticket = nullptr;
+        cleanup([&] {
+            safeFreeCustom(apticket, plist_free);
+        });
+        try {
+            apticket = futurerestore::loadAPTicketFile(path);
+            std::string im4m = getDataVal(apticket, "ApImg4Ticket");
+            retassure(!im4m.empty(), "not an IMG4 ticket, ApNonce collision is only supported on 64-bit devices\n");
+            uint64_t ecid = img4tool::getValFromIM4M({im4m.data(), im4m.size()}, 'ECID').getIntegerValue();
+            retassure(ecid, "no ECID in ticket\n");
+            auto bnch = img4tool::getValFromIM4M({im4m.data(), im4m.size()}, 'BNCH');
+            nonce_table::ticket t;
+            t.name = path;
+            t.bnch.assign((const char *) bnch.payload(), bnch.payloadSize());
+            retassure(!t.bnch.empty(), "no ApNonce in ticket\n");
+            if (plist_t pGenerator = plist_dict_get_item(apticket, "generator")) {
+                char *generator = nullptr;
+                if (plist_get_node_type(pGenerator) == PLIST_STRING) plist_get_string_val(pGenerator, &generator);
+                if (generator) t.generator = generator;
+                safeFree(generator);
+            }
+            auto &d = _devices[ecid];
+            d.ecid = ecid;
+            d.names.push_back(path);
+            d.tickets.push_back(std::move(t));
+        } catch (tihmstar::exception &e) {
+            error("[COLLISION] skipping %s: %s", path, e.what());
+        }
+    }
+    retassure(!_devices.empty(), "none of the APTickets can be used for ApNonce collision\n");
+
+    for (auto &entry: _devices) {
+        auto &d = entry.second;
+        d.table.build(d.tickets);
+        d.polling = false;
+        d.resetPending = false;
+        d.autobootDisabled = false;
+        d.seen = false;
+        d.done = false;
+        info("[COLLISION] %016" PRIx64 ": waiting for one of %zu ApNonces\n", d.ecid, d.tickets.size());
+    }
+}
+
+void nonce_collider::eventCallback(const irecv_device_event_t *event, void *userdata) {
+    auto self = (nonce_collider *) userdata;
+    if (event->type != IRECV_DEVICE_ADD || !event->device_info || !isRecoveryMode(event->mode)) return;
+    //the set of devices never changes after construction, only their state does
+    if (!self->_devices.count(event->device_info->ecid)) return;
+    std::lock_guard<std::mutex> guard(self->_lock);
+    self->_arrived.insert(event->device_info->ecid);
+    self->_cond.notify_all();
+}
+
+void nonce_collider::attempt(device &d) {
+    d.polling = false;
+    irecv_client_t client = nullptr;
+    if (irecv_open_with_ecid(&client, d.ecid) != IRECV_E_SUCCESS || !client) {
+        debug("[COLLISION] %016" PRIx64 ": can't connect yet, retrying\n", d.ecid);
+        d.polling = true;
+        d.pollAt = clock::now() + std::chrono::milliseconds(retryMs);
+        return;
+    }
+    cleanup([&] {
+        irecv_close(client);
+    });
+
+    if (d.resetPending) {
+        double latency = std::chrono::duration<double>(clock::now() - d.resetTime).count();
+        d.stats.addAttempt(latency);
+        _total.addAttempt(latency);
+        d.resetPending = false;
+    }
+    if (!d.autobootDisabled) {
+        //auto-boot lives in nvram and survives resets, no need to write it again
+        if (irecv_setenv(client, "auto-boot", "false") == IRECV_E_SUCCESS && irecv_saveenv(client) == IRECV_E_SUCCESS)
+            d.autobootDisabled = true;
+        else
+            error("[COLLISION] %016" PRIx64 ": setting auto-boot failed, the device may leave recovery mode\n", d.ecid);
+    }
+
+    auto devinfo = irecv_get_device_info(client);
+    if (!devinfo || !devinfo->ap_nonce || !devinfo->ap_nonce_size) {
+        error("[COLLISION] %016" PRIx64 ": failed to read ApNonce, retrying\n", d.ecid);
+        d.polling = true;
+        d.pollAt = clock::now() + std::chrono::milliseconds(retryMs);
+        return;
+    }
+    std::string nonce((const char *) devinfo->ap_nonce, devinfo->ap_nonce_size);
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "[COLLISION] %016" PRIx64 ":", d.ecid);
+    info("%s ApNonce %s\n", prefix, toHex(nonce).c_str());
+    if (d.stats.attempts()) d.stats.printProgress(prefix);
+    if (_total.attempts() && _total.attempts() % summaryInterval == 0) _total.printProgress("[COLLISION] all devices:");
+    char ecid[17];
+    snprintf(ecid, sizeof(ecid), "%016" PRIx64, d.ecid);
+    progress_stream::shared().event("apnonce", {
+            {"ecid",     progress_stream::quote(ecid)},
+            {"nonce",    progress_stream::quote(toHex(nonce))},
+            {"attempts", std::to_string(d.stats.attempts())},
+            {"rate",     std::to_string(d.stats.attemptsPerMinute())},
+            {"totalRate", std::to_string(_total.attemptsPerMinute())}
+    });
+
+    if (auto match = d.table.find(nonce.data(), nonce.size())) {
+        if (irecv_setenv(client, "auto-boot", "true") != IRECV_E_SUCCESS || irecv_saveenv(client) != IRECV_E_SUCCESS)
+            error("%s failed to restore auto-boot\n", prefix);
+        d.done = true;
+        _remaining--;
+        info("%s ApNonce matches %s after %zu attempts, leaving it in recovery mode\n", prefix,
+             d.names.at(match->front()).c_str(), d.stats.attempts());
+        return;
+    }
+
+    irecv_send_command(client, "reset");
+    d.resetTime = clock::now();
+    d.resetPending = true;
+    //only polled if the reconnect event doesn't come
+    d.polling = true;
+    d.pollAt = d.resetTime + std::chrono::milliseconds(reconnectTimeoutMs);
+}
+
+void nonce_collider::printSummary() const {
+    for (auto &entry: _devices) {
+        auto &d = entry.second;
+        if (!d.seen) {
+            info("[COLLISION] %016" PRIx64 ": never showed up in recovery mode\n", d.ecid);
+            continue;
+        }
+        info("[COLLISION] %016" PRIx64 ": %s after %zu attempts, %.1f attempts/min\n", d.ecid,
+             d.done ? "matched" : "no match", d.stats.attempts(), d.stats.attemptsPerMinute());
+    }
+    _total.printProgress("[COLLISION] all devices:");
+    _total.printHistogram("[COLLISION]");
+}
+
+void nonce_collider::run() {
+    irecv_device_event_context_t ctx = nullptr;
+    //existing devices are reported as added right after subscribing
+    retassure(irecv_device_event_subscribe(&ctx, eventCallback, this) == IRECV_E_SUCCESS,
+              "failed to subscribe to device events\n");
+    cleanup([&] {
+        irecv_device_event_unsubscribe(ctx);
+        printSummary();
+    });
+
+    auto arrivalDeadline = clock::now() + std::chrono::milliseconds(arrivalWindowMs);
+    std::unique_lock<std::mutex> ul(_lock);
+    while (_remaining || clock::now() < arrivalDeadline) {
+        _cond.wait_for(ul, std::chrono::milliseconds(retryMs), [&] {
+            return !_arrived.empty();
+        });
+        std::set<uint64_t> ready;
+        ready.swap(_arrived);
+        ul.unlock();
+        auto now = clock::now();
+        for (auto &entry: _devices) {
+            auto &d = entry.second;
+            if (d.polling && d.pollAt <= now) {
+                if (d.resetPending) debug("[COLLISION] %016" PRIx64 ": no reconnect event, polling\n", d.ecid);
+                ready.insert(d.ecid);
+            }
+        }
+        for (auto ecid: ready) {
+            auto &d = _devices.at(ecid);
+            if (!d.seen) {
+                d.seen = true;
+                _remaining++;
+            }
+            if (!d.done) attempt(d);
+        }
+        ul.lock();
+    }
+    retassure(std::any_of(_devices.begin(), _devices.end(), [](const std::pair<const uint64_t, device> &entry) {
+        return entry.second.seen;
+    }), "none of the devices with an APTicket showed up in recovery mode\n");
+}
@@ -0,0 +1,74 @@
+//
+//  nonce_collider.hpp
+//  futurerestore
+//
+
+#ifndef nonce_collider_hpp
+#define nonce_collider_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <libirecovery.h>
+#include "nonce_table.hpp"
+#include "collision_stats.hpp"
+
+/*
+ * ApNonce collision for every attached device in recovery mode that has a ticket loaded for its ECID,
+ * driven from one loop instead of one process per device.
+ * Reconnects are picked up from libirecovery's device events, a device is only polled if it didn't show up
+ * again within reconnectTimeoutMs after its reset. Each device is reset as soon as its nonce didn't match
+ * and is left in recovery mode with auto-boot restored once it matched, the others keep going.
+ * Tickets may cover devices that aren't attached, only devices that showed up within arrivalWindowMs of the start
+ * (or later, while others are still colliding) are waited for.
+ */
+class nonce_collider {
+    typedef std::chrono::steady_clock clock;
+
+    struct device {
+        uint64_t ecid;
+        std::vector<std::string> names;
+        std::vector<nonce_table::ticket> tickets;
+        nonce_table table;
+        collision_stats stats;
+        clock::time_point resetTime;
+        clock::time_point pollAt;   //only while polling
+        bool polling;
+        bool resetPending;
+        bool autobootDisabled;
+        bool seen;
+        bool done;
+    };
+
+    std::map<uint64_t, device> _devices;
+    collision_stats _total;
+    size_t _remaining; //devices that showed up and didn't match yet
+    std::set<uint64_t> _arrived; //reported by the event callback, guarded by _lock
+    std::mutex _lock;
+    std::condition_variable _cond;
+
+    static void eventCallback(const irecv_device_event_t *event, void *userdata);
+    void attempt(device &d);
+    void printSummary() const;
+
+public:
+    static const unsigned int reconnectTimeoutMs = 30000;
+    static const unsigned int arrivalWindowMs = 10000;
+    static const unsigned int retryMs = 1000;
+    static const size_t summaryInterval = 25; //aggregate line every this many attempts
+
+    //tickets that aren't IMG4 or lack an ECID or ApNonce are skipped
+    explicit nonce_collider(const std::vector<const char *> &apticketPaths);
+    nonce_collider(const nonce_collider &) = delete;
+    nonce_collider &operator=(const nonce_collider &) = delete;
+
+    //returns once every attached device with a ticket matched, throws if none of them is attached
+    void run();
+};
+
+#endif /* nonce_collider_hpp */
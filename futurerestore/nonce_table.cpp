@@ -0,0 +1,97 @@
+//
+//  nonce_table.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "nonce_table.hpp"
+#include "threadpool.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA384(d, n, md) CC_SHA384(d, n, md)
+#   define SHA384_DIGEST_LENGTH CC_SHA384_DIGEST_LENGTH
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+bool nonce_table::deriveNonce(uint64_t generator, size_t nonceSize, unsigned char *out) {
+    if (nonceSize == 20) {
+        SHA1((unsigned char *) &generator, sizeof(generator), out);
+    } else if (nonceSize == 32) {
+        unsigned char digest[SHA384_DIGEST_LENGTH];
+        SHA384((unsigned char *) &generator, sizeof(generator), digest);
+        memcpy(out, digest, nonceSize);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool nonce_table::parseGenerator(const std::string &generator, uint64_t &out) {
+    const char *str = generator.c_str();
+    char *end = nullptr;
+    if (generator.size() <= 2 || generator.size() > 18 || strncmp(str, "0x", 2) != 0) return false;
+    out = strtoull(str + 2, &end, 16);
+    return end && !*end;
+}
+
+void nonce_table::build(const std::vector<ticket> &tickets) {
+    _entries.assign(tickets.size(), entry{});
+    _byNonce.clear();
+
+    auto derive = [&](size_t begin, size_t end) {
+        unsigned char nonce[32];
+        for (size_t i = begin; i < end; i++) {
+            auto &t = tickets[i];
+            auto &e = _entries[i];
+            e.bnch = t.bnch;
+            if (t.generator.empty() || !parseGenerator(t.generator, e.generator)) continue;
+            if (!deriveNonce(e.generator, t.bnch.size(), nonce)) continue;
+            e.derived.assign((char *) nonce, t.bnch.size());
+            e.generatorMatches = e.derived == e.bnch;
+        }
+    };
+
+    if (tickets.size() <= parallelThreshold) {
+        derive(0, tickets.size());
+    } else {
+        size_t chunks = threadpool::shared().size();
+        size_t chunk = (tickets.size() + chunks - 1) / chunks;
+        threadpool::shared().parallelFor(chunks, [&](size_t i) {
+            derive(std::min(i * chunk, tickets.size()), std::min((i + 1) * chunk, tickets.size()));
+        });
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < _entries.size(); i++) {
+        auto &e = _entries[i];
+        if (!e.bnch.empty()) _byNonce[e.bnch].push_back(i);
+        if (!tickets[i].generator.empty() && !e.generatorMatches) {
+            mismatches++;
+            if (e.derived.empty())
+                error("[NONCE] %s: can't derive an ApNonce from generator %s\n", tickets[i].name.c_str(),
+                      tickets[i].generator.c_str());
+            else
+                error("[NONCE] %s: generator %s does not produce the ApNonce in the ticket\n",
+                      tickets[i].name.c_str(), tickets[i].generator.c_str());
+        }
+    }
+    debug("[NONCE] indexed %zu distinct nonces of %zu tickets (%zu generator mismatches)\n", _byNonce.size(),
+          _entries.size(), mismatches);
+}
+
+const std::vector<size_t> *nonce_table::find(const void *nonce, size_t nonceSize) const {
+    auto it = _byNonce.find(std::string((const char *) nonce, nonceSize));
+    return (it == _byNonce.end()) ? nullptr : &it->second;
+}
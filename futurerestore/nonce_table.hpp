@@ -0,0 +1,60 @@
+//
+//  nonce_table.hpp
+//  futurerestore
+//
+
+#ifndef nonce_table_hpp
+#define nonce_table_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ * ApNonce -> ticket lookup built once when the tickets are loaded.
+ * Each ticket is indexed by the nonce in its BNCH. If the ticket has a generator,
+ * the nonce the device would derive from it is computed too and compared against BNCH,
+ * so a ticket that can't be used with the generator method is known before a restore starts.
+ */
+class nonce_table {
+public:
+    struct ticket {
+        std::string name;      //for messages only
+        std::string bnch;      //empty for tickets without a nonce
+        std::string generator; //empty for tickets without a generator
+    };
+
+    struct entry {
+        std::string bnch;
+        std::string derived;    //nonce derived from the generator, empty if there is none
+        uint64_t generator;
+        bool generatorMatches;
+    };
+
+private:
+    std::vector<entry> _entries;
+    std::unordered_map<std::string, std::vector<size_t>> _byNonce;
+
+public:
+    //parallelize the hashing above this many tickets
+    static const size_t parallelThreshold = 256;
+
+    /*
+     * Derives the ApNonce from a generator like iBoot does:
+     * SHA-1 for 20 byte nonces and SHA-384 truncated to 32 bytes for newer platforms.
+     * Returns false for unknown nonce sizes.
+     */
+    static bool deriveNonce(uint64_t generator, size_t nonceSize, unsigned char *out);
+    static bool parseGenerator(const std::string &generator, uint64_t &out);
+
+    void build(const std::vector<ticket> &tickets);
+
+    size_t size() const {return _entries.size();}
+    const entry &at(size_t index) const {return _entries.at(index);}
+
+    //indices of all tickets whose BNCH is nonce, or nullptr
+    const std::vector<size_t> *find(const void *nonce, size_t nonceSize) const;
+};
+
+#endif /* nonce_table_hpp */
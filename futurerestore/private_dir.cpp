@@ -0,0 +1,45 @@
+//
+//  private_dir.cpp
+//  futurerestore
+//
+
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include "private_dir.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+bool private_dir::prepare(const std::string &dir) {
+#ifdef WIN32
+    mkdir_with_parents(dir.c_str(), 0755);
+    return true;
+#else
+    mkdir_with_parents(dir.c_str(), 0700);
+    struct stat st{};
+    if (lstat(dir.c_str(), &st)) return false;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022)) {
+        debug("[CACHE] not using %s, it isn't private to this user\n", dir.c_str());
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool private_dir::isTrusted(const std::string &path) {
+#ifdef WIN32
+    return true;
+#else
+    struct stat st{};
+    if (lstat(path.c_str(), &st)) return errno == ENOENT;
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022)) {
+        debug("[CACHE] not using %s, it isn't private to this user\n", path.c_str());
+        return false;
+    }
+    return true;
+#endif
+}
@@ -0,0 +1,25 @@
+//
+//  private_dir.hpp
+//  futurerestore
+//
+
+#ifndef private_dir_hpp
+#define private_dir_hpp
+
+#include <string>
+
+/*
+ * Checks for caches whose contents are used without verifying them again, e.g. a signature result or a decrypted
+ * bootloader. Such a cache has to live in a directory of the current user that nobody else can write to, and its
+ * files have to be the user's own, or another local user could have planted them.
+ * On WIN32 the temp directory is per user already, so everything passes there.
+ */
+class private_dir {
+public:
+    //creates dir with mode 0700 if needed, false if it belongs to another user or others can write to it
+    static bool prepare(const std::string &dir);
+    //false if path exists but isn't a regular file of this user that only they can write to
+    static bool isTrusted(const std::string &path);
+};
+
+#endif /* private_dir_hpp */
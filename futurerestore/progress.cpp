@@ -0,0 +1,265 @@
+//
+//  progress.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
+#include <algorithm>
+#include "progress.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#define PROGRESS_MIN_INTERVAL   std::chrono::milliseconds(250)
+#define PROGRESS_RETRY_INTERVAL std::chrono::milliseconds(20)
+
+static std::string formatNumber(double val) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.3f", val);
+    return buf;
+}
+
+static std::string formatNumber(uint64_t val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRIu64, val);
+    return buf;
+}
+
+progress_stream::progress_stream()
+        : _fd(-1), _dropped(0), _writing(false), _stop(false), _start(std::chrono::steady_clock::now()) {}
+
+progress_stream::~progress_stream() {
+    close();
+}
+
+progress_stream &progress_stream::shared() {
+    static progress_stream stream;
+    return stream;
+}
+
+std::string progress_stream::quote(const std::string &str) {
+    std::string ret = "\"";
+    for (unsigned char c: str) {
+        switch (c) {
+            case '"':  ret += "\\\""; break;
+            case '\\': ret += "\\\\"; break;
+            case '\n': ret += "\\n"; break;
+            case '\r': ret += "\\r"; break;
+            case '\t': ret += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    ret += buf;
+                } else {
+                    ret += (char) c;
+                }
+        }
+    }
+    return ret + "\"";
+}
+
+void progress_stream::open(int fd) {
+    retassure(_fd == -1, "progress stream is already open\n");
+#ifdef WIN32
+    retassure(_get_osfhandle(fd) != -1, "invalid progress fd %d\n", fd);
+#else
+    int fl = fcntl(fd, F_GETFL);
+    retassure(fl != -1, "invalid progress fd %d\n", fd);
+    retassure((fl & O_ACCMODE) != O_RDONLY, "progress fd %d is not writable\n", fd);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); //a consumer going away must not kill the restore
+#endif
+    _fd = fd;
+    _stop = false;
+    _writer = std::thread(&progress_stream::write, this);
+}
+
+void progress_stream::close(unsigned int timeoutMs) {
+    if (!_writer.joinable()) return;
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        _cond.wait_for(ul, std::chrono::milliseconds(timeoutMs), [this] {
+            return _fd == -1 || (_queue.empty() && !_writing);
+        });
+        if (_dropped) debug("[PROGRESS] dropped %zu progress updates for a slow consumer\n", _dropped);
+        _stop = true;
+    }
+    _cond.notify_all();
+    _writer.join();
+    _fd = -1;
+}
+
+void progress_stream::write() {
+    std::unique_lock<std::mutex> ul(_lock);
+    std::string pending;
+    size_t off = 0;
+    while (true) {
+        if (off == pending.size()) {
+            _writing = false;
+            _cond.notify_all();
+            _cond.wait(ul, [this] {return _stop || !_queue.empty();});
+            if (_queue.empty()) return;
+            pending.clear();
+            off = 0;
+            for (auto &e: _queue) pending += e.line;
+            _queue.clear();
+            _writing = true;
+        }
+        ul.unlock();
+#ifdef WIN32
+        long n = ::_write(_fd, pending.data() + off, (unsigned int) (pending.size() - off));
+#else
+        ssize_t n = ::write(_fd, pending.data() + off, pending.size() - off);
+#endif
+        int err = errno;
+        ul.lock();
+        if (n > 0) {
+            off += (size_t) n;
+        } else if (n < 0 && (err == EAGAIN || err == EWOULDBLOCK || err == EINTR)) {
+            //consumer is behind, new events keep being coalesced in the queue meanwhile
+            if (_cond.wait_for(ul, PROGRESS_RETRY_INTERVAL, [this] {return _stop;})) return;
+        } else {
+            error("[PROGRESS] failed to write progress events (%s), disabling them\n", strerror(err));
+            _fd = -1;
+            _queue.clear();
+            _writing = false;
+            _cond.notify_all();
+            return;
+        }
+    }
+}
+
+void progress_stream::push(const std::string &event, const fields &values, const std::string &key) {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    std::string line = "{\"time\":" + formatNumber(elapsed) + ",\"event\":" + quote(event);
+    for (auto &v: values) {
+        line += "," + quote(v.first) + ":" + v.second;
+    }
+    line += "}\n";
+
+    if (!key.empty()) {
+        for (auto it = _queue.rbegin(); it != _queue.rend(); ++it) {
+            if (it->key == key) {
+                it->line = std::move(line);
+                return;
+            }
+        }
+        if (_queue.size() >= maxQueued) {
+            _dropped++;
+            return;
+        }
+    }
+    _queue.push_back({std::move(line), key});
+    _cond.notify_all();
+}
+
+void progress_stream::phaseBegin(const std::string &phase) {
+    if (!enabled()) return;
+    std::unique_lock<std::mutex> ul(_lock);
+    if (_fd == -1) return;
+    push("phase", {{"phase", quote(phase)}, {"state", "\"begin\""}}, "");
+}
+
+void progress_stream::phaseEnd(const std::string &phase, bool passed, const std::string &reason) {
+    if (!enabled()) return;
+    std::unique_lock<std::mutex> ul(_lock);
+    if (_fd == -1) return;
+    fields values{{"phase", quote(phase)}, {"state", "\"end\""}, {"passed", passed ? "true" : "false"}};
+    if (!reason.empty()) {
+        size_t len = reason.find_last_not_of('\n');
+        values.emplace_back("reason", quote(reason.substr(0, len == std::string::npos ? 0 : len + 1)));
+    }
+    values.emplace_back("dropped", formatNumber((uint64_t) _dropped));
+    push("phase", values, "");
+}
+
+void progress_stream::progress(const std::string &phase, uint64_t done, uint64_t total, const char *unit) {
+    if (!enabled()) return;
+    auto now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> ul(_lock);
+    if (_fd == -1) return;
+
+    auto it = _counters.find(phase);
+    bool first = it == _counters.end();
+    bool final = total && done >= total;
+    if (first) {
+        it = _counters.emplace(phase, counter{now, done, 0}).first;
+    } else if (!final && now - it->second.lastEmit < PROGRESS_MIN_INTERVAL) {
+        return;
+    }
+
+    auto &c = it->second;
+    double dt = std::chrono::duration<double>(now - c.lastEmit).count();
+    if (done < c.lastDone) {
+        c.rate = 0; //restarted from scratch
+    } else if (!first && dt > 0) {
+        double current = (double) (done - c.lastDone) / dt;
+        c.rate = c.rate ? 0.7 * c.rate + 0.3 * current : current;
+    }
+    c.lastEmit = now;
+    c.lastDone = done;
+
+    fields values{{"phase", quote(phase)}, {"unit", quote(unit)}, {"done", formatNumber(done)},
+                  {"total", total ? formatNumber(total) : "null"}, {"rate", formatNumber(c.rate)}};
+    values.emplace_back("eta", (total && c.rate > 0) ? formatNumber((double) (total - std::min(done, total)) / c.rate)
+                                                     : (final ? "0" : "null"));
+    //the final update must arrive, intermediate ones may be coalesced or dropped
+    push("progress", values, final ? "" : phase);
+    if (final) _counters.erase(it);
+}
+
+void progress_stream::deviceMode(const std::string &mode) {
+    if (!enabled()) return;
+    std::unique_lock<std::mutex> ul(_lock);
+    if (_fd == -1 || mode == _mode) return;
+    _mode = mode;
+    push("mode", {{"mode", quote(mode)}}, "");
+}
+
+void progress_stream::event(const std::string &event, const fields &values) {
+    if (!enabled()) return;
+    std::unique_lock<std::mutex> ul(_lock);
+    if (_fd == -1) return;
+    push(event, values, "");
+}
+
+#pragma mark progress_file_watch
+
+progress_file_watch::progress_file_watch(std::string phase, std::string path, uint64_t total) : _stop(false) {
+    if (!progress_stream::shared().enabled()) return;
+    _thread = std::thread([this, phase, path, total] {
+        std::unique_lock<std::mutex> ul(_lock);
+        while (true) {
+            bool stop = _cond.wait_for(ul, PROGRESS_MIN_INTERVAL, [this] {return _stop;});
+            struct stat st{};
+            if (!stat(path.c_str(), &st)) progress_stream::shared().progress(phase, (uint64_t) st.st_size, total);
+            if (stop) return;
+        }
+    });
+}
+
+progress_file_watch::~progress_file_watch() {
+    if (!_thread.joinable()) return;
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        _stop = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+}
@@ -0,0 +1,98 @@
+//
+//  progress.hpp
+//  futurerestore
+//
+
+#ifndef progress_hpp
+#define progress_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+
+/*
+ * Newline delimited JSON events for wrapping tools (--progress-fd).
+ * Events are queued and written by a background thread to a non-blocking fd, so a slow consumer never stalls
+ * the restore. Byte counter updates of the same phase are coalesced while they wait in the queue and dropped
+ * once it is full, phase and device mode events are always kept.
+ */
+class progress_stream {
+public:
+    typedef std::vector<std::pair<std::string, std::string>> fields;
+    static const size_t maxQueued = 256;
+
+private:
+    struct queued_event {
+        std::string line;
+        std::string key; //non-empty for byte counters, which may be coalesced or dropped
+    };
+    struct counter {
+        std::chrono::steady_clock::time_point lastEmit;
+        uint64_t lastDone;
+        double rate;
+    };
+
+    std::atomic<int> _fd;
+    std::deque<queued_event> _queue;
+    std::map<std::string, counter> _counters;
+    std::string _mode;
+    size_t _dropped;
+    bool _writing;
+    bool _stop;
+    std::chrono::steady_clock::time_point _start;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::thread _writer;
+
+    void push(const std::string &event, const fields &values, const std::string &key);
+    void write();
+
+public:
+    progress_stream();
+    progress_stream(const progress_stream &) = delete;
+    progress_stream &operator=(const progress_stream &) = delete;
+    ~progress_stream();
+
+    static progress_stream &shared();
+    static std::string quote(const std::string &str);
+
+    void open(int fd);
+    //waits up to timeoutMs for queued events to be written, then stops the writer
+    void close(unsigned int timeoutMs = 1000);
+    bool enabled() const {return _fd >= 0;}
+
+    void phaseBegin(const std::string &phase);
+    void phaseEnd(const std::string &phase, bool passed, const std::string &reason = "");
+    //rate limited, the first and the final update of a phase are always sent
+    void progress(const std::string &phase, uint64_t done, uint64_t total, const char *unit = "bytes");
+    //only sent when the mode actually changed
+    void deviceMode(const std::string &mode);
+    //values have to be JSON already, use quote() for strings
+    void event(const std::string &event, const fields &values);
+};
+
+/*
+ * Reports the growth of a file that is written by code we can't hook (e.g. idevicerestore's filesystem extraction).
+ */
+class progress_file_watch {
+    std::thread _thread;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    bool _stop;
+
+public:
+    progress_file_watch(std::string phase, std::string path, uint64_t total);
+    progress_file_watch(const progress_file_watch &) = delete;
+    progress_file_watch &operator=(const progress_file_watch &) = delete;
+    ~progress_file_watch();
+};
+
+#endif /* progress_hpp */
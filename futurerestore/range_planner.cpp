@@ -0,0 +1,41 @@
+//
+//  range_planner.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <algorithm>
+#include "range_planner.hpp"
+
+std::vector<planned_range> range_planner::plan(uint64_t archiveSize) const {
+    std::vector<const zip_entry *> entries = _entries;
+    std::vector<planned_range> ret;
+
+    std::sort(entries.begin(), entries.end(), [](const zip_entry *a, const zip_entry *b) {
+        return a->localHeaderOffset < b->localHeaderOffset;
+    });
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+    for (auto entry: entries) {
+        uint64_t start = entry->localHeaderOffset;
+        uint64_t end = std::min(start + entry->estimatedRecordSize() + _headerSlack, archiveSize);
+        if (!ret.empty() && start <= ret.back().offset + ret.back().length + _maxGap) {
+            auto &last = ret.back();
+            last.length = std::max(last.offset + last.length, end) - last.offset;
+            last.entries.push_back(entry);
+        } else {
+            planned_range range;
+            range.offset = start;
+            range.length = end - start;
+            range.entries.push_back(entry);
+            ret.push_back(range);
+        }
+    }
+    return ret;
+}
+
+uint64_t range_planner::requiredBytes() const {
+    uint64_t ret = 0;
+    for (auto entry: _entries) ret += entry->estimatedRecordSize();
+    return ret;
+}
@@ -0,0 +1,43 @@
+//
+//  range_planner.hpp
+//  futurerestore
+//
+
+#ifndef range_planner_hpp
+#define range_planner_hpp
+
+#include <stdint.h>
+#include <vector>
+#include "zip_directory.hpp"
+
+struct planned_range {
+    uint64_t offset;
+    uint64_t length;
+    std::vector<const zip_entry *> entries;
+};
+
+/*
+ * Plans as few HTTP range requests as possible for a set of zip entries.
+ * Entries are ordered by their local header offset and neighbouring records are merged
+ * into one range as long as the bytes in between don't exceed maxGap.
+ */
+class range_planner {
+    uint64_t _maxGap;
+    uint64_t _headerSlack;
+    std::vector<const zip_entry *> _entries;
+
+public:
+    static const uint64_t defaultMaxGap = 0x100000;
+
+    range_planner(uint64_t maxGap = defaultMaxGap, uint64_t headerSlack = 0x400)
+            : _maxGap(maxGap), _headerSlack(headerSlack) {}
+
+    void addEntry(const zip_entry *entry) {_entries.push_back(entry);}
+
+    std::vector<planned_range> plan(uint64_t archiveSize) const;
+
+    //bytes the entries actually need (local headers + compressed data)
+    uint64_t requiredBytes() const;
+};
+
+#endif /* range_planner_hpp */
@@ -0,0 +1,543 @@
+//
+//  remote_zip.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+#include "remote_zip.hpp"
+#include "range_planner.hpp"
+#include "progress.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#define REMOTE_ZIP_TAIL_SIZE        0x80000 //the central directory of an IPSW usually fits in here
+#define REMOTE_ZIP_HEADER_SLACK     0x400   //local extra fields may be larger than the central ones
+#define REMOTE_ZIP_CACHE_MAGIC      "FRZC"
+#define REMOTE_ZIP_JOURNAL_MAGIC    "FRPJ"
+#define REMOTE_ZIP_MAX_ATTEMPTS     5       //consecutive attempts without progress before giving up
+#define REMOTE_ZIP_CHECKPOINT_SIZE  0x400000 //journal the received bytes every 4MiB
+
+static uint64_t fnv1a64(const std::string &str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c: str) {
+        hash ^= (uint8_t) c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct range_response {
+    std::vector<char> *body;
+    long expectedStatus;
+    uint64_t archiveSize;
+    CURL *curl;
+    //when set, the body is streamed to this file instead
+    FILE *file;
+    uint64_t written;
+    uint64_t checkpointed;
+    const std::function<void(uint64_t)> *checkpoint;
+    //called with the number of body bytes received so far
+    const std::function<void(uint64_t)> *received;
+};
+
+static size_t range_header_cb(char *buffer, size_t size, size_t nitems, void *userdata) {
+    auto *resp = (range_response *) userdata;
+    size_t len = size * nitems;
+    static const char contentRange[] = "content-range:";
+    if (len > sizeof(contentRange) - 1 && !strncasecmp(buffer, contentRange, sizeof(contentRange) - 1)) {
+        std::string line(buffer + sizeof(contentRange) - 1, len - (sizeof(contentRange) - 1));
+        size_t slash = line.find('/');
+        if (slash != std::string::npos && line[slash + 1] != '*')
+            resp->archiveSize = strtoull(line.c_str() + slash + 1, nullptr, 10);
+    }
+    return len;
+}
+
+static size_t range_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    auto *resp = (range_response *) userdata;
+    long status = 0;
+    curl_easy_getinfo(resp->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status != resp->expectedStatus) return 0; //server ignored our range, don't download the whole IPSW
+    if (!resp->file) {
+        resp->body->insert(resp->body->end(), ptr, ptr + size * nmemb);
+        if (resp->received) (*resp->received)(resp->body->size());
+        return size * nmemb;
+    }
+    size_t written = fwrite(ptr, 1, size * nmemb, resp->file);
+    resp->written += written;
+    if (resp->received) (*resp->received)(resp->written);
+    if (resp->checkpoint && resp->written - resp->checkpointed >= REMOTE_ZIP_CHECKPOINT_SIZE) {
+        if (fflush(resp->file) == 0) {
+            (*resp->checkpoint)(resp->written);
+            resp->checkpointed = resp->written;
+        }
+    }
+    return written;
+}
+
+remote_zip::remote_zip(std::string url, std::string cacheDir)
+        : _url(std::move(url)), _cacheDir(std::move(cacheDir)), _curl(nullptr), _archiveSize(0), _loaded(false),
+          _loadedFromCache(false), _requestCount(0), _bytesReceived(0) {
+    retassure(_curl = curl_easy_init(), "failed to init curl\n");
+    curl_easy_setopt((CURL *) _curl, CURLOPT_URL, _url.c_str());
+    curl_easy_setopt((CURL *) _curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_USERAGENT, "futurerestore");
+    curl_easy_setopt((CURL *) _curl, CURLOPT_FAILONERROR, 1L);
+}
+
+remote_zip::~remote_zip() {
+    if (_curl) curl_easy_cleanup((CURL *) _curl);
+    if (_requestCount)
+        debug("[RZIP] %zu requests, %" PRIu64 " bytes received for %s\n", _requestCount, _bytesReceived, _url.c_str());
+}
+
+void remote_zip::fetchRange(uint64_t offset, uint64_t length, std::vector<char> &out,
+                            const std::function<void(uint64_t)> *received) {
+    retassure(length, "refusing to fetch an empty range\n");
+    char range[64];
+    snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, offset, offset + length - 1);
+
+    range_response resp{&out, 206, 0, (CURL *) _curl, nullptr, 0, 0, nullptr, received};
+    out.clear();
+    out.reserve(length);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_RANGE, range);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERFUNCTION, range_header_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERDATA, &resp);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEDATA, &resp);
+    CURLcode res = curl_easy_perform((CURL *) _curl);
+    _requestCount++;
+    _bytesReceived += out.size();
+    retassure(res == CURLE_OK, "[RZIP] failed to fetch range %s of %s: %s\n", range, _url.c_str(),
+              curl_easy_strerror(res));
+    retassure(out.size() == length, "[RZIP] short read for range %s (got %zu bytes)\n", range, out.size());
+}
+
+void remote_zip::fetchRangeToFile(uint64_t offset, uint64_t length, FILE *f, uint64_t &written,
+                                  const std::function<void(uint64_t)> &checkpoint,
+                                  const std::function<void(uint64_t)> *received) {
+    retassure(length, "refusing to fetch an empty range\n");
+    char range[64];
+    snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, offset, offset + length - 1);
+
+    range_response resp{nullptr, 206, 0, (CURL *) _curl, f, 0, 0, &checkpoint, received};
+    curl_easy_setopt((CURL *) _curl, CURLOPT_RANGE, range);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERFUNCTION, range_header_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERDATA, &resp);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEDATA, &resp);
+    CURLcode res = curl_easy_perform((CURL *) _curl);
+    _requestCount++;
+    _bytesReceived += resp.written;
+    written = resp.written;
+    retassure(fflush(f) == 0, "[RZIP] failed to write downloaded data\n");
+    retassure(res == CURLE_OK, "[RZIP] failed to fetch range %s of %s: %s\n", range, _url.c_str(),
+              curl_easy_strerror(res));
+    retassure(written == length, "[RZIP] short read for range %s (got %" PRIu64 " bytes)\n", range, written);
+}
+
+void remote_zip::fetchTail(uint64_t length, std::vector<char> &out) {
+    char range[64];
+    snprintf(range, sizeof(range), "-%" PRIu64, length);
+
+    range_response resp{&out, 206, 0, (CURL *) _curl};
+    out.clear();
+    curl_easy_setopt((CURL *) _curl, CURLOPT_RANGE, range);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERFUNCTION, range_header_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_HEADERDATA, &resp);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+    curl_easy_setopt((CURL *) _curl, CURLOPT_WRITEDATA, &resp);
+    CURLcode res = curl_easy_perform((CURL *) _curl);
+    _requestCount++;
+    _bytesReceived += out.size();
+    retassure(res == CURLE_OK, "[RZIP] failed to fetch end of %s: %s\n", _url.c_str(), curl_easy_strerror(res));
+    retassure(resp.archiveSize >= out.size() && out.size(), "[RZIP] server did not report the size of %s\n",
+              _url.c_str());
+    _archiveSize = resp.archiveSize;
+}
+
+std::string remote_zip::getCachePath() const {
+    if (_cacheDir.empty()) return {};
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".cd", fnv1a64(_url));
+    return _cacheDir + name;
+}
+
+bool remote_zip::loadCachedCentralDirectory() {
+    std::string path = getCachePath();
+    if (path.empty()) return false;
+    std::ifstream cacheStream(path, std::ios::binary);
+    if (!cacheStream.good()) return false;
+
+    char magic[4] = {};
+    uint64_t archiveSize = 0;
+    uint64_t cdSize = 0;
+    uint32_t urlLength = 0;
+    cacheStream.read(magic, sizeof(magic));
+    cacheStream.read((char *) &archiveSize, sizeof(archiveSize));
+    cacheStream.read((char *) &cdSize, sizeof(cdSize));
+    cacheStream.read((char *) &urlLength, sizeof(urlLength));
+    if (!cacheStream.good() || memcmp(magic, REMOTE_ZIP_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        urlLength != _url.size() || cdSize > archiveSize)
+        return false;
+    std::string url(urlLength, '\0');
+    cacheStream.read(&url[0], urlLength);
+    if (url != _url) return false;
+    std::vector<char> cd((size_t) cdSize);
+    cacheStream.read(cd.data(), (std::streamsize) cd.size());
+    if (!cacheStream.good()) return false;
+
+    try {
+        _directory.parseCentralDirectory(cd.data(), cd.size());
+    } catch (tihmstar::exception &e) {
+        return false;
+    }
+    _archiveSize = archiveSize;
+    return true;
+}
+
+void remote_zip::saveCachedCentralDirectory(const std::vector<char> &cd) {
+    std::string path = getCachePath();
+    if (path.empty()) return;
+    mkdir_with_parents(_cacheDir.c_str(), 0755);
+    std::string tmpPath = path + ".tmp";
+    std::ofstream cacheStream(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!cacheStream.good()) return;
+    uint64_t cdSize = cd.size();
+    auto urlLength = (uint32_t) _url.size();
+    cacheStream.write(REMOTE_ZIP_CACHE_MAGIC, 4);
+    cacheStream.write((const char *) &_archiveSize, sizeof(_archiveSize));
+    cacheStream.write((const char *) &cdSize, sizeof(cdSize));
+    cacheStream.write((const char *) &urlLength, sizeof(urlLength));
+    cacheStream.write(_url.data(), urlLength);
+    cacheStream.write(cd.data(), (std::streamsize) cd.size());
+    cacheStream.close();
+    if (!cacheStream.fail()) rename(tmpPath.c_str(), path.c_str());
+    else remove(tmpPath.c_str());
+}
+
+void remote_zip::loadCentralDirectory() {
+    if (_loaded) return;
+    if (loadCachedCentralDirectory()) {
+        debug("[RZIP] using cached central directory for %s\n", _url.c_str());
+        _loaded = _loadedFromCache = true;
+        return;
+    }
+
+    std::vector<char> tail;
+    fetchTail(REMOTE_ZIP_TAIL_SIZE, tail);
+    uint64_t tailOffset = _archiveSize - tail.size();
+    uint64_t cdOffset = 0;
+    uint64_t cdSize = 0;
+    uint64_t zip64TailOffset = 0;
+    if (!zip_directory::locateCentralDirectory(tail.data(), tail.size(), _archiveSize, cdOffset, cdSize,
+                                               zip64TailOffset)) {
+        //zip64 record is outside of what we fetched, extend the tail down to it
+        std::vector<char> head;
+        fetchRange(zip64TailOffset, tailOffset - zip64TailOffset, head);
+        head.insert(head.end(), tail.begin(), tail.end());
+        tail.swap(head);
+        tailOffset = zip64TailOffset;
+        retassure(zip_directory::locateCentralDirectory(tail.data(), tail.size(), _archiveSize, cdOffset, cdSize,
+                                                        zip64TailOffset), "[RZIP] failed to locate central directory\n");
+    }
+    retassure(cdOffset + cdSize <= _archiveSize, "[RZIP] central directory is out of bounds\n");
+
+    std::vector<char> cd;
+    if (cdOffset >= tailOffset) {
+        cd.assign(tail.begin() + (cdOffset - tailOffset), tail.begin() + (cdOffset - tailOffset + cdSize));
+    } else {
+        fetchRange(cdOffset, cdSize, cd);
+    }
+    _directory.parseCentralDirectory(cd.data(), cd.size());
+    debug("[RZIP] loaded central directory with %zu entries in %zu requests\n", _directory.size(), _requestCount);
+    saveCachedCentralDirectory(cd);
+    _loaded = true;
+}
+
+const zip_directory &remote_zip::directory() {
+    loadCentralDirectory();
+    return _directory;
+}
+
+const zip_entry *remote_zip::getEntry(const std::string &name) {
+    return directory().getEntry(name);
+}
+
+bool remote_zip::discardStaleCentralDirectory() {
+    if (!_loadedFromCache) return false;
+    //the cached directory doesn't match the remote file anymore, throw it away and load a fresh one
+    info("[RZIP] cached central directory of %s is stale, reloading\n", _url.c_str());
+    remove(getCachePath().c_str());
+    _loaded = _loadedFromCache = false;
+    return true;
+}
+
+std::vector<char> remote_zip::extractRecord(const zip_entry &entry, const char *record, size_t recordSize) {
+    uint64_t dataOffset = zip_directory::getDataOffsetFromLocalHeader(record, recordSize, entry);
+    if (dataOffset + entry.compressedSize <= recordSize)
+        return zip_directory::extractEntryData(entry, record + dataOffset, recordSize - dataOffset);
+
+    //local extra field was larger than we guessed, fetch what's missing
+    std::vector<char> full(record, record + recordSize);
+    std::vector<char> rest;
+    fetchRange(entry.localHeaderOffset + recordSize, dataOffset + entry.compressedSize - recordSize, rest);
+    full.insert(full.end(), rest.begin(), rest.end());
+    return zip_directory::extractEntryData(entry, full.data() + dataOffset, full.size() - dataOffset);
+}
+
+bool remote_zip::loadJournal(const std::string &journalPath, const zip_entry &entry, uint64_t &received) const {
+    std::ifstream journalStream(journalPath, std::ios::binary);
+    if (!journalStream.good()) return false;
+
+    char magic[4] = {};
+    uint64_t localHeaderOffset = 0;
+    uint64_t compressedSize = 0;
+    uint32_t crc = 0;
+    uint32_t urlLength = 0;
+    journalStream.read(magic, sizeof(magic));
+    journalStream.read((char *) &localHeaderOffset, sizeof(localHeaderOffset));
+    journalStream.read((char *) &compressedSize, sizeof(compressedSize));
+    journalStream.read((char *) &crc, sizeof(crc));
+    journalStream.read((char *) &received, sizeof(received));
+    journalStream.read((char *) &urlLength, sizeof(urlLength));
+    if (!journalStream.good() || memcmp(magic, REMOTE_ZIP_JOURNAL_MAGIC, sizeof(magic)) != 0 ||
+        urlLength != _url.size())
+        return false;
+    std::string url(urlLength, '\0');
+    journalStream.read(&url[0], urlLength);
+    //the partial file is only usable if it belongs to the very same entry of the very same archive
+    return journalStream.good() && url == _url && localHeaderOffset == entry.localHeaderOffset &&
+           compressedSize == entry.compressedSize && crc == entry.crc32;
+}
+
+void remote_zip::saveJournal(const std::string &journalPath, const zip_entry &entry, uint64_t received) const {
+    std::string tmpPath = journalPath + ".tmp";
+    std::ofstream journalStream(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!journalStream.good()) return;
+    auto urlLength = (uint32_t) _url.size();
+    journalStream.write(REMOTE_ZIP_JOURNAL_MAGIC, 4);
+    journalStream.write((const char *) &entry.localHeaderOffset, sizeof(entry.localHeaderOffset));
+    journalStream.write((const char *) &entry.compressedSize, sizeof(entry.compressedSize));
+    journalStream.write((const char *) &entry.crc32, sizeof(entry.crc32));
+    journalStream.write((const char *) &received, sizeof(received));
+    journalStream.write((const char *) &urlLength, sizeof(urlLength));
+    journalStream.write(_url.data(), urlLength);
+    journalStream.close();
+    if (!journalStream.fail()) rename(tmpPath.c_str(), journalPath.c_str());
+    else remove(tmpPath.c_str());
+}
+
+/*
+ * Downloads the raw (still compressed) record of an entry to savePath.part, with a journal next to it
+ * saying which entry the bytes belong to and how many of them are known to be good.
+ * Interrupted transfers continue with a ranged request, both on retry and on the next run.
+ * Inflating only happens once the whole record is on disk.
+ */
+bool remote_zip::downloadRecord(const zip_entry &entry, const std::string &savePath, bool allowResume) {
+    std::string partPath = savePath + ".part";
+    std::string journalPath = partPath + ".journal";
+    uint64_t length = std::min<uint64_t>(entry.estimatedRecordSize() + REMOTE_ZIP_HEADER_SLACK,
+                                         _archiveSize - entry.localHeaderOffset);
+    uint64_t received = 0;
+    struct stat st{};
+    if (allowResume && loadJournal(journalPath, entry, received) && !stat(partPath.c_str(), &st)) {
+        received = std::min<uint64_t>(received, (uint64_t) st.st_size);
+    } else {
+        received = 0;
+    }
+    bool resumed = received != 0;
+    if (resumed) {
+        info("[RZIP] resuming %s at %" PRIu64 " bytes\n", entry.name.c_str(), received);
+        retassure(!truncate(partPath.c_str(), (off_t) received), "[RZIP] failed to truncate %s\n", partPath.c_str());
+    }
+
+    FILE *f = fopen(partPath.c_str(), resumed ? "r+b" : "wb");
+    retassure(f, "[RZIP] failed to open %s for writing\n", partPath.c_str());
+    cleanup([&] {
+        if (f) fclose(f);
+    });
+    retassure(!fseeko(f, (off_t) received, SEEK_SET), "[RZIP] failed to seek in %s\n", partPath.c_str());
+    saveJournal(journalPath, entry, received);
+
+    uint64_t dataOffset = 0;
+    int failures = 0;
+    std::string phase = "download " + entry.name;
+    progress_stream::shared().progress(phase, received, length);
+    while (true) {
+        if (received < length) {
+            uint64_t written = 0;
+            std::function<void(uint64_t)> checkpoint = [&](uint64_t n) {
+                saveJournal(journalPath, entry, received + n);
+            };
+            std::function<void(uint64_t)> report = [&](uint64_t n) {
+                progress_stream::shared().progress(phase, received + n, length);
+            };
+            try {
+                fetchRangeToFile(entry.localHeaderOffset + received, length - received, f, written, checkpoint,
+                                 &report);
+                received += written;
+                saveJournal(journalPath, entry, received);
+            } catch (tihmstar::exception &e) {
+                received += written;
+                saveJournal(journalPath, entry, received);
+                if (written) failures = 0;
+                retassure(++failures < REMOTE_ZIP_MAX_ATTEMPTS,
+                          "[RZIP] giving up on %s after %d attempts at %" PRIu64 " of %" PRIu64 " bytes (%s)\n",
+                          entry.name.c_str(), failures, received, length, e.what());
+                error("[RZIP] download of %s interrupted at %" PRIu64 " of %" PRIu64 " bytes, retrying (%d/%d)\n",
+                      entry.name.c_str(), received, length, failures, REMOTE_ZIP_MAX_ATTEMPTS - 1);
+                sleep(failures);
+                clearerr(f);
+                retassure(!fseeko(f, (off_t) received, SEEK_SET), "[RZIP] failed to seek in %s\n",
+                          partPath.c_str());
+                continue;
+            }
+        }
+
+        char header[30];
+        retassure(!fseeko(f, 0, SEEK_SET) && fread(header, 1, sizeof(header), f) == sizeof(header),
+                  "[RZIP] failed to read back local header of %s\n", entry.name.c_str());
+        if (!zip_directory::matchesLocalHeader(header, sizeof(header), entry)) {
+            fclose(f);
+            f = nullptr;
+            remove(partPath.c_str());
+            remove(journalPath.c_str());
+            if (resumed) return downloadRecord(entry, savePath, false);
+            return false;
+        }
+        dataOffset = zip_directory::getDataOffsetFromLocalHeader(header, sizeof(header), entry);
+        if (dataOffset + entry.compressedSize <= length) break;
+        //local extra field was larger than we guessed, fetch what's missing
+        length = dataOffset + entry.compressedSize;
+        retassure(!fseeko(f, (off_t) received, SEEK_SET), "[RZIP] failed to seek in %s\n", partPath.c_str());
+    }
+    fclose(f);
+    f = nullptr;
+
+    std::vector<char> record;
+    try {
+        std::ifstream partStream(partPath, std::ios::binary);
+        record.resize((size_t) (dataOffset + entry.compressedSize));
+        partStream.read(record.data(), (std::streamsize) record.size());
+        retassure(partStream.good(), "[RZIP] failed to read back %s\n", partPath.c_str());
+
+        FILE *out = fopen(savePath.c_str(), "wb");
+        retassure(out, "[RZIP] failed to open %s for writing\n", savePath.c_str());
+        cleanup([&] {
+            fclose(out);
+        });
+        zip_directory::extractEntryData(entry, record.data() + dataOffset, record.size() - dataOffset, out);
+    } catch (tihmstar::exception &e) {
+        remove(partPath.c_str());
+        remove(journalPath.c_str());
+        if (!resumed) throw;
+        //bytes from a previous run didn't check out, start over once from a clean slate
+        error("[RZIP] resumed data of %s is corrupt (%s), downloading it again\n", entry.name.c_str(), e.what());
+        return downloadRecord(entry, savePath, false);
+    }
+    remove(partPath.c_str());
+    remove(journalPath.c_str());
+    return true;
+}
+
+std::vector<char> remote_zip::getFile(const std::string &remotePath) {
+    const zip_entry *entry = getEntry(remotePath);
+    retassure(entry, "[RZIP] %s does not exist in %s\n", remotePath.c_str(), _url.c_str());
+
+    std::vector<char> record;
+    uint64_t length = std::min<uint64_t>(entry->estimatedRecordSize() + REMOTE_ZIP_HEADER_SLACK,
+                                         _archiveSize - entry->localHeaderOffset);
+    fetchRange(entry->localHeaderOffset, length, record);
+    if (!zip_directory::matchesLocalHeader(record.data(), record.size(), *entry) && discardStaleCentralDirectory())
+        return getFile(remotePath);
+    return extractRecord(*entry, record.data(), record.size());
+}
+
+void remote_zip::downloadFiles(const std::vector<std::pair<std::string, std::string>> &files, uint64_t maxGap) {
+    range_planner planner(maxGap, REMOTE_ZIP_HEADER_SLACK);
+    std::unordered_map<const zip_entry *, std::vector<std::string>> savePaths;
+    for (auto &file: files) {
+        const zip_entry *entry = getEntry(file.first);
+        retassure(entry, "[RZIP] %s does not exist in %s\n", file.first.c_str(), _url.c_str());
+        planner.addEntry(entry);
+        savePaths[entry].push_back(file.second);
+    }
+
+    size_t requestCount = _requestCount;
+    uint64_t bytesReceived = _bytesReceived;
+    std::vector<char> buf;
+    auto ranges = planner.plan(_archiveSize);
+    uint64_t total = 0;
+    uint64_t done = 0;
+    for (auto &range: ranges) {
+        total += range.length;
+    }
+    std::string phase = "download " + std::to_string(savePaths.size()) + " files";
+    std::function<void(uint64_t)> report = [&](uint64_t n) {
+        progress_stream::shared().progress(phase, done + n, total);
+    };
+    for (auto &range: ranges) {
+        for (int attempt = 1;; attempt++) {
+            try {
+                fetchRange(range.offset, range.length, buf, &report);
+                break;
+            } catch (tihmstar::exception &e) {
+                if (attempt >= REMOTE_ZIP_MAX_ATTEMPTS) throw;
+                error("[RZIP] range request failed, retrying (%d/%d): %s\n", attempt, REMOTE_ZIP_MAX_ATTEMPTS - 1, e.what());
+                sleep(attempt);
+            }
+        }
+        for (auto entry: range.entries) {
+            uint64_t rel = entry->localHeaderOffset - range.offset;
+            if (!zip_directory::matchesLocalHeader(buf.data() + rel, buf.size() - rel, *entry) &&
+                discardStaleCentralDirectory())
+                return downloadFiles(files, maxGap);
+            auto data = extractRecord(*entry, buf.data() + rel, buf.size() - rel);
+            for (auto &savePath: savePaths[entry]) {
+                writeFile(savePath, data);
+            }
+        }
+        done += range.length;
+    }
+
+    requestCount = _requestCount - requestCount;
+    bytesReceived = _bytesReceived - bytesReceived;
+    uint64_t required = planner.requiredBytes();
+    info("[RZIP] fetched %zu files in %zu requests (%" PRIu64 " bytes, %" PRIu64 " over-fetched)\n", savePaths.size(),
+         requestCount, bytesReceived, (bytesReceived > required) ? bytesReceived - required : 0);
+}
+
+void remote_zip::writeFile(const std::string &savePath, const std::vector<char> &data) {
+    FILE *f = fopen(savePath.c_str(), "wb");
+    retassure(f, "[RZIP] failed to open %s for writing\n", savePath.c_str());
+    cleanup([&] {
+        if (f) fclose(f);
+    });
+    retassure(fwrite(data.data(), 1, data.size(), f) == data.size(), "[RZIP] failed to write %s\n", savePath.c_str());
+}
+
+void remote_zip::downloadFile(const std::string &remotePath, const std::string &savePath) {
+    const zip_entry *entry = getEntry(remotePath);
+    retassure(entry, "[RZIP] %s does not exist in %s\n", remotePath.c_str(), _url.c_str());
+    if (!downloadRecord(*entry, savePath, true)) {
+        retassure(discardStaleCentralDirectory(), "[RZIP] local header of %s does not match the central directory of %s\n",
+                  remotePath.c_str(), _url.c_str());
+        return downloadFile(remotePath, savePath);
+    }
+    info("[RZIP] downloaded %s (%" PRIu64 " bytes)\n", remotePath.c_str(), entry->uncompressedSize);
+}
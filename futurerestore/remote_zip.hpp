@@ -0,0 +1,72 @@
+//
+//  remote_zip.hpp
+//  futurerestore
+//
+
+#ifndef remote_zip_hpp
+#define remote_zip_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include "zip_directory.hpp"
+
+/*
+ * Session on a remote zip (usually the latest IPSW).
+ * The end of central directory record and the central directory are fetched and parsed once
+ * and optionally persisted, after that every file is fetched with a single ranged GET
+ * over a kept-alive connection.
+ */
+class remote_zip {
+    std::string _url;
+    std::string _cacheDir;
+    void *_curl;
+    uint64_t _archiveSize;
+    zip_directory _directory;
+    bool _loaded;
+    bool _loadedFromCache;
+    size_t _requestCount;
+    uint64_t _bytesReceived;
+
+    std::string getCachePath() const;
+    bool loadCachedCentralDirectory();
+    void saveCachedCentralDirectory(const std::vector<char> &cd);
+    void loadCentralDirectory();
+    void fetchRange(uint64_t offset, uint64_t length, std::vector<char> &out,
+                    const std::function<void(uint64_t)> *received = nullptr);
+    void fetchRangeToFile(uint64_t offset, uint64_t length, FILE *f, uint64_t &written,
+                          const std::function<void(uint64_t)> &checkpoint,
+                          const std::function<void(uint64_t)> *received = nullptr);
+    void fetchTail(uint64_t length, std::vector<char> &out);
+    bool discardStaleCentralDirectory();
+    std::vector<char> extractRecord(const zip_entry &entry, const char *record, size_t recordSize);
+    static void writeFile(const std::string &savePath, const std::vector<char> &data);
+    bool loadJournal(const std::string &journalPath, const zip_entry &entry, uint64_t &received) const;
+    void saveJournal(const std::string &journalPath, const zip_entry &entry, uint64_t received) const;
+    //false if the local header doesn't belong to entry, the partial download is removed then
+    bool downloadRecord(const zip_entry &entry, const std::string &savePath, bool allowResume);
+
+public:
+    //cacheDir may be empty to not persist the central directory
+    remote_zip(std::string url, std::string cacheDir = "");
+    remote_zip(const remote_zip &) = delete;
+    remote_zip &operator=(const remote_zip &) = delete;
+    ~remote_zip();
+
+    const std::string &url() const {return _url;}
+    const zip_directory &directory();
+    const zip_entry *getEntry(const std::string &name);
+
+    std::vector<char> getFile(const std::string &remotePath);
+    //resumable, keeps savePath.part and a journal around until the file is complete
+    void downloadFile(const std::string &remotePath, const std::string &savePath);
+    //fetches several files with coalesced range requests, files are pairs of (remotePath, savePath)
+    void downloadFiles(const std::vector<std::pair<std::string, std::string>> &files, uint64_t maxGap);
+
+    size_t requestCount() const {return _requestCount;}
+    uint64_t bytesReceived() const {return _bytesReceived;}
+};
+
+#endif /* remote_zip_hpp */
@@ -0,0 +1,232 @@
+//
+//  restore_session.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <utility>
+#include <plist/plist.h>
+#include "restore_session.hpp"
+#include "mapped_file.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA_DIGEST_LENGTH CC_SHA1_DIGEST_LENGTH
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+static std::string toHex(const unsigned char *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(size * 2);
+    for (size_t i = 0; i < size; i++) {
+        ret += digits[data[i] >> 4];
+        ret += digits[data[i] & 0xf];
+    }
+    return ret;
+}
+
+static std::string getStringVal(plist_t dict, const char *key) {
+    std::string ret;
+    char *str = nullptr;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &str);
+    if (str) ret = str;
+    safeFree(str);
+    return ret;
+}
+
+static restore_session::values getStringDict(plist_t dict, const char *key) {
+    restore_session::values ret;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (!node || plist_get_node_type(node) != PLIST_DICT) return ret;
+    plist_dict_iter it = nullptr;
+    plist_dict_new_iter(node, &it);
+    cleanup([&] {
+        safeFree(it);
+    });
+    while (true) {
+        char *name = nullptr;
+        plist_t value = nullptr;
+        plist_dict_next_item(node, it, &name, &value);
+        if (!value) break;
+        char *str = nullptr;
+        if (plist_get_node_type(value) == PLIST_STRING) plist_get_string_val(value, &str);
+        if (name && str) ret[name] = str;
+        safeFree(name);
+        safeFree(str);
+    }
+    return ret;
+}
+
+static plist_t newStringDict(const restore_session::values &values) {
+    plist_t ret = plist_new_dict();
+    for (auto &v: values) {
+        plist_dict_set_item(ret, v.first.c_str(), plist_new_string(v.second.c_str()));
+    }
+    return ret;
+}
+
+static void removeSessionDir(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent *e = readdir(d)) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        remove((dir + "/" + e->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+restore_session::restore_session(std::string root, const std::string &resumeId)
+        : _root(std::move(root)), _resumed(!resumeId.empty()) {
+    if (_resumed) {
+        retassure(resumeId.find('/') == std::string::npos && resumeId.find('\\') == std::string::npos &&
+                  resumeId[0] != '.', "invalid session name %s\n", resumeId.c_str());
+        _id = resumeId;
+        _dir = _root + "/" + _id;
+        struct stat st{};
+        retassure(!stat(_dir.c_str(), &st) && S_ISDIR(st.st_mode), "no session %s in %s\n", _id.c_str(),
+                  _root.c_str());
+        return;
+    }
+    pruneSessions();
+    char id[64];
+    time_t now = time(nullptr);
+    struct tm local{};
+#ifdef WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    size_t len = strftime(id, sizeof(id), "%Y%m%d-%H%M%S", &local);
+    snprintf(id + len, sizeof(id) - len, "-%d", (int) getpid());
+    _id = id;
+    _dir = _root + "/" + _id;
+    mkdir_with_parents(_dir.c_str(), 0755);
+}
+
+void restore_session::pruneSessions() {
+    DIR *d = opendir(_root.c_str());
+    if (!d) return;
+    std::vector<std::string> expired;
+    time_t now = time(nullptr);
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] == '.') continue;
+        struct stat st{};
+        std::string dir = _root + "/" + e->d_name;
+        if (!stat(dir.c_str(), &st) && S_ISDIR(st.st_mode) && now - st.st_mtime > maxAge) expired.push_back(dir);
+    }
+    closedir(d);
+    for (auto &dir: expired) {
+        debug("[SESSION] removing expired session %s\n", dir.c_str());
+        removeSessionDir(dir);
+    }
+}
+
+std::string restore_session::getCheckpointPath(const std::string &phase) const {
+    std::string name = phase;
+    for (auto &c: name) {
+        if (!isalnum((unsigned char) c) && c != '-' && c != '_') c = '_';
+    }
+    return _dir + "/" + name + ".plist";
+}
+
+std::string restore_session::hashInputs(const std::vector<std::string> &inputs) {
+    std::string all;
+    for (auto &input: inputs) {
+        all += input;
+        all += '\0';
+    }
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *) all.data(), all.size(), digest);
+    return toHex(digest, sizeof(digest));
+}
+
+std::string restore_session::hashFile(const std::string &path) {
+    try {
+        mapped_file f(path);
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1((const unsigned char *) f.data(), f.size(), digest);
+        return toHex(digest, sizeof(digest));
+    } catch (tihmstar::exception &e) {
+        return "";
+    }
+}
+
+bool restore_session::lookup(const std::string &phase, const std::string &inputsHash, values &outputs) const {
+    plist_t checkpoint = nullptr;
+    cleanup([&] {
+        safeFreeCustom(checkpoint, plist_free);
+    });
+    try {
+        mapped_file f(getCheckpointPath(phase));
+        plist_from_xml(f.data(), (uint32_t) f.size(), &checkpoint);
+    } catch (tihmstar::exception &e) {
+        return false;
+    }
+    if (!checkpoint || getStringVal(checkpoint, "Inputs") != inputsHash) {
+        debug("[SESSION] %s: inputs changed\n", phase.c_str());
+        return false;
+    }
+    for (auto &file: getStringDict(checkpoint, "Files")) {
+        if (hashFile(file.first) != file.second) {
+            debug("[SESSION] %s: %s changed\n", phase.c_str(), file.first.c_str());
+            return false;
+        }
+    }
+    outputs = getStringDict(checkpoint, "Outputs");
+    return true;
+}
+
+void restore_session::checkpoint(const std::string &phase, const std::string &inputsHash, const values &outputs,
+                                 const std::vector<std::string> &files) {
+    values digests;
+    for (auto &file: files) {
+        std::string digest = hashFile(file);
+        if (digest.empty()) {
+            debug("[SESSION] %s: can't read %s, not checkpointing\n", phase.c_str(), file.c_str());
+            return;
+        }
+        digests[file] = digest;
+    }
+    plist_t checkpoint = plist_new_dict();
+    char *xml = nullptr;
+    uint32_t xmlSize = 0;
+    cleanup([&] {
+        safeFree(xml);
+        safeFreeCustom(checkpoint, plist_free);
+    });
+    plist_dict_set_item(checkpoint, "Phase", plist_new_string(phase.c_str()));
+    plist_dict_set_item(checkpoint, "Inputs", plist_new_string(inputsHash.c_str()));
+    plist_dict_set_item(checkpoint, "Outputs", newStringDict(outputs));
+    plist_dict_set_item(checkpoint, "Files", newStringDict(digests));
+    plist_to_xml(checkpoint, &xml, &xmlSize);
+    if (!xml) return;
+
+    std::string path = getCheckpointPath(phase);
+    std::string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(xml, xmlSize);
+    out.close();
+    if (out.fail() || rename(tmpPath.c_str(), path.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[SESSION] failed to write checkpoint %s\n", path.c_str());
+    }
+}
@@ -0,0 +1,50 @@
+//
+//  restore_session.hpp
+//  futurerestore
+//
+
+#ifndef restore_session_hpp
+#define restore_session_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+
+/*
+ * Checkpoints of the host side phases of one restore attempt, kept in <root>/<id>/<phase>.plist.
+ * A checkpoint records a hash of everything the phase depended on, the values it produced and a digest of
+ * every file it wrote. Resuming a session skips a phase only if its inputs hash the same and all of its files
+ * are still unchanged, anything else just runs the phase again and overwrites the checkpoint.
+ */
+class restore_session {
+public:
+    typedef std::map<std::string, std::string> values;
+
+private:
+    std::string _root;
+    std::string _id;
+    std::string _dir;
+    bool _resumed;
+
+    std::string getCheckpointPath(const std::string &phase) const;
+    static std::string hashFile(const std::string &path);
+    void pruneSessions();
+
+public:
+    static const long maxAge = 7 * 24 * 60 * 60; //older sessions are removed whenever a new one is started
+
+    //starts a new session if resumeId is empty, throws if the session to resume doesn't exist
+    restore_session(std::string root, const std::string &resumeId = "");
+
+    const std::string &id() const {return _id;}
+    bool resumed() const {return _resumed;}
+
+    static std::string hashInputs(const std::vector<std::string> &inputs);
+
+    //fills outputs and returns true if phase completed with the same inputs and its files are unchanged
+    bool lookup(const std::string &phase, const std::string &inputsHash, values &outputs) const;
+    void checkpoint(const std::string &phase, const std::string &inputsHash, const values &outputs = {},
+                    const std::vector<std::string> &files = {});
+};
+
+#endif /* restore_session_hpp */
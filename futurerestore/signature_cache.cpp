@@ -0,0 +1,140 @@
+//
+//  signature_cache.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <fstream>
+#include <plist/plist.h>
+#include <img4tool/img4tool.hpp>
+#include "signature_cache.hpp"
+#include "mapped_file.hpp"
+#include "private_dir.hpp"
+#include "threadpool.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA384(d, n, md) CC_SHA384(d, n, md)
+#   define SHA384_DIGEST_LENGTH CC_SHA384_DIGEST_LENGTH
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+signature_cache::signature_cache(std::string path) : _path(std::move(path)), _dirty(false), _trusted(false) {
+    plist_t results = nullptr;
+    cleanup([&] {
+        safeFreeCustom(results, plist_free);
+    });
+    char *dir = strdup(_path.c_str());
+    _trusted = private_dir::prepare(dirname(dir)) && private_dir::isTrusted(_path);
+    free(dir);
+    if (!_trusted) return;
+    try {
+        mapped_file cached(_path);
+        if (cached.startsWith("bplist00", 8)) plist_from_bin(cached.data(), (uint32_t) cached.size(), &results);
+    } catch (tihmstar::exception &e) {
+        return; //nothing cached yet
+    }
+    if (!results || plist_get_node_type(results) != PLIST_DICT) return;
+    plist_dict_iter it = nullptr;
+    plist_dict_new_iter(results, &it);
+    cleanup([&] {
+        safeFree(it);
+    });
+    while (true) {
+        char *hash = nullptr;
+        plist_t value = nullptr;
+        plist_dict_next_item(results, it, &hash, &value);
+        if (!value) break;
+        uint8_t valid = 0;
+        if (plist_get_node_type(value) == PLIST_BOOLEAN) {
+            plist_get_bool_val(value, &valid);
+            if (hash) _results[hash] = valid != 0;
+        }
+        safeFree(hash);
+    }
+    debug("[SIGNATURE] %zu cached results in %s\n", _results.size(), _path.c_str());
+}
+
+std::string signature_cache::hashTicket(const char *im4m, size_t im4mSize) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    SHA384((const unsigned char *) im4m, im4mSize, digest);
+    std::string ret;
+    for (unsigned char b: digest) {
+        ret += digits[b >> 4];
+        ret += digits[b & 0xf];
+    }
+    return ret;
+}
+
+std::vector<char> signature_cache::validate(const std::vector<std::pair<char *, size_t>> &im4ms) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> hashes(im4ms.size());
+    threadpool::shared().parallelFor(im4ms.size(), [&](size_t i) {
+        hashes[i] = hashTicket(im4ms[i].first, im4ms[i].second);
+    });
+
+    std::map<std::string, size_t> pending; //hash -> first ticket with it
+    for (size_t i = 0; i < im4ms.size(); i++) {
+        if (!_results.count(hashes[i])) pending.emplace(hashes[i], i);
+    }
+    std::vector<std::pair<std::string, size_t>> todo(pending.begin(), pending.end());
+    std::vector<char> valid(todo.size());
+    threadpool::shared().parallelFor(todo.size(), [&](size_t j) {
+        auto &im4m = im4ms[todo[j].second];
+        try {
+            valid[j] = img4tool::isIM4MSignatureValid({im4m.first, im4m.second});
+        } catch (tihmstar::exception &e) {
+            valid[j] = false; //not even parseable
+        }
+    });
+    for (size_t j = 0; j < todo.size(); j++) _results[todo[j].first] = valid[j] != 0;
+    _dirty |= !todo.empty();
+
+    std::vector<char> ret(im4ms.size());
+    for (size_t i = 0; i < im4ms.size(); i++) ret[i] = _results[hashes[i]];
+    debug("[SIGNATURE] checked %zu tickets in %.2fs, %zu validated, the rest were cached or duplicates\n",
+          im4ms.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), todo.size());
+    return ret;
+}
+
+void signature_cache::save() {
+    if (!_dirty) return;
+    plist_t results = plist_new_dict();
+    char *bin = nullptr;
+    uint32_t binSize = 0;
+    cleanup([&] {
+        safeFree(bin);
+        safeFreeCustom(results, plist_free);
+    });
+    for (auto &r: _results) plist_dict_set_item(results, r.first.c_str(), plist_new_bool(r.second));
+    plist_to_bin(results, &bin, &binSize);
+    if (!bin) return;
+    if (!_trusted) return;
+    std::string tmpPath = _path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(bin, binSize);
+    out.close();
+#ifndef WIN32
+    chmod(tmpPath.c_str(), 0600);
+#endif
+    if (out.fail() || rename(tmpPath.c_str(), _path.c_str())) {
+        remove(tmpPath.c_str());
+        debug("[SIGNATURE] failed to write %s\n", _path.c_str());
+        return;
+    }
+    _dirty = false;
+}
@@ -0,0 +1,39 @@
+//
+//  signature_cache.hpp
+//  futurerestore
+//
+
+#ifndef signature_cache_hpp
+#define signature_cache_hpp
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+/*
+ * IM4M signature results by SHA-384 of the ticket, persisted as a binary plist.
+ * A ticket's signature either verifies against the Apple root or it doesn't, so a result never goes stale.
+ * A cached "valid" skips the check entirely, so the file is only used from a directory nobody else can write to.
+ * Tickets without a result are validated on the shared threadpool, identical tickets only once.
+ */
+class signature_cache {
+    std::string _path;
+    std::map<std::string, bool> _results;
+    bool _dirty;
+    bool _trusted; //only loaded from and saved to a private_dir
+
+public:
+    explicit signature_cache(std::string path);
+    signature_cache(const signature_cache &) = delete;
+    signature_cache &operator=(const signature_cache &) = delete;
+
+    static std::string hashTicket(const char *im4m, size_t im4mSize);
+
+    //one entry per ticket, non-zero if its signature is valid
+    std::vector<char> validate(const std::vector<std::pair<char *, size_t>> &im4ms);
+    void save();
+};
+
+#endif /* signature_cache_hpp */
@@ -0,0 +1,57 @@
+//
+//  stage_report.cpp
+//  futurerestore
+//
+
+#include "stage_report.hpp"
+#include "progress.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+void stage_report::finish(bool passed, const std::string &reason) {
+    if (!_running) return;
+    auto &s = _stages.back();
+    s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _stageStart).count();
+    s.passed = passed;
+    s.reason = reason;
+    _running = false;
+    debug("[STAGE] %s %s after %.3fs\n", s.name.c_str(), passed ? "passed" : "failed", s.seconds);
+    progress_stream::shared().phaseEnd(s.name, passed, reason);
+}
+
+void stage_report::begin(const std::string &name) {
+    end();
+    _stages.push_back({name, 0, false, ""});
+    _stageStart = std::chrono::steady_clock::now();
+    _running = true;
+    progress_stream::shared().phaseBegin(name);
+}
+
+void stage_report::fail(const std::string &reason) {
+    if (_running) {
+        finish(false, reason);
+    } else if (!_failed) { //a recorded stage may already have failed with this
+        _stages.push_back({"(outside of a stage)", 0, false, reason});
+    }
+    _failed = true;
+}
+
+void stage_report::record(const std::string &name, double seconds, bool passed, const std::string &reason) {
+    _stages.push_back({name, seconds, passed, reason});
+    if (!passed) _failed = true;
+    debug("[STAGE] %s %s after %.3fs\n", name.c_str(), passed ? "passed" : "failed", seconds);
+}
+
+void stage_report::print() const {
+    double total = 0;
+    info("\n%-40s %-6s %10s\n", "stage", "result", "time");
+    for (auto &s: _stages) {
+        total += s.seconds;
+        info("%-40s %-6s %9.3fs\n", s.name.c_str(), s.passed ? "PASS" : "FAIL", s.seconds);
+        if (!s.passed && !s.reason.empty())
+            info("    %s%s", s.reason.c_str(), (s.reason.back() == '\n') ? "" : "\n");
+    }
+    info("%-40s %-6s %9.3fs\n\n", "total", _failed ? "FAIL" : "PASS", total);
+}
@@ -0,0 +1,44 @@
+//
+//  stage_report.hpp
+//  futurerestore
+//
+
+#ifndef stage_report_hpp
+#define stage_report_hpp
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+/*
+ * Records named stages with their duration and outcome.
+ * Starting a stage ends the previous one as passed, an exception is recorded with fail().
+ */
+class stage_report {
+    struct stage {
+        std::string name;
+        double seconds;
+        bool passed;
+        std::string reason;
+    };
+    std::vector<stage> _stages;
+    std::chrono::steady_clock::time_point _stageStart;
+    bool _running;
+    bool _failed;
+
+    void finish(bool passed, const std::string &reason);
+
+public:
+    stage_report() : _running(false), _failed(false) {}
+
+    void begin(const std::string &name);
+    void end() {finish(true, "");}
+    void fail(const std::string &reason);
+    //adds a stage that was timed elsewhere, e.g. one of several that ran at the same time
+    void record(const std::string &name, double seconds, bool passed, const std::string &reason = "");
+
+    bool failed() const {return _failed;}
+    void print() const;
+};
+
+#endif /* stage_report_hpp */
@@ -0,0 +1,136 @@
+//
+//  task_graph.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include "task_graph.hpp"
+#include "progress.hpp"
+
+extern "C" {
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+task_graph::node_id task_graph::add(std::string name, std::function<void()> fn, std::vector<node_id> deps) {
+    for (auto dep: deps) {
+        retassure(dep < _nodes.size(), "task graph dependency of %s does not exist\n", name.c_str());
+    }
+    _nodes.push_back({std::move(name), std::move(fn), std::move(deps), 0, 0, false, false, false, ""});
+    return _nodes.size() - 1;
+}
+
+void task_graph::run(stage_report &stages) {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::thread> threads;
+    std::exception_ptr firstFailure;
+    size_t running = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto now = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::unique_lock<std::mutex> ul(lock);
+    while (true) {
+        if (!firstFailure) {
+            for (node_id i = 0; i < _nodes.size(); i++) {
+                auto &n = _nodes[i];
+                if (n.started) continue;
+                bool ready = true;
+                for (auto dep: n.deps) ready &= _nodes[dep].done && !_nodes[dep].failed;
+                if (!ready) continue;
+                n.started = true;
+                n.start = now();
+                running++;
+                debug("[GRAPH] starting %s\n", n.name.c_str());
+                progress_stream::shared().phaseBegin(n.name);
+                threads.emplace_back([&, i] {
+                    std::exception_ptr failure;
+                    std::string reason;
+                    try {
+                        _nodes[i].fn();
+                    } catch (tihmstar::exception &e) {
+                        failure = std::current_exception();
+                        reason = e.what();
+                    } catch (...) {
+                        failure = std::current_exception();
+                        reason = "unknown error";
+                    }
+                    std::lock_guard<std::mutex> guard(lock);
+                    auto &finished = _nodes[i];
+                    finished.end = now();
+                    finished.done = true;
+                    finished.failed = failure != nullptr;
+                    finished.reason = reason;
+                    if (failure && !firstFailure) firstFailure = failure;
+                    stages.record(finished.name, finished.end - finished.start, !finished.failed, finished.reason);
+                    progress_stream::shared().phaseEnd(finished.name, !finished.failed, finished.reason);
+                    running--;
+                    cond.notify_all();
+                });
+            }
+        }
+        if (!running) break;
+        cond.wait(ul);
+    }
+    ul.unlock();
+    for (auto &t: threads) t.join();
+    _wall = now();
+
+    if (firstFailure) std::rethrow_exception(firstFailure);
+    for (auto &n: _nodes) {
+        retassure(n.done, "task graph step %s never ran, its dependencies form a cycle\n", n.name.c_str());
+    }
+}
+
+std::vector<task_graph::node_id> task_graph::criticalPath() const {
+    std::vector<node_id> ret;
+    bool found = false;
+    node_id last = 0;
+    for (node_id i = 0; i < _nodes.size(); i++) {
+        if (_nodes[i].done && (!found || _nodes[i].end > _nodes[last].end)) {
+            last = i;
+            found = true;
+        }
+    }
+    while (found) {
+        ret.insert(ret.begin(), last);
+        found = false;
+        node_id next = 0;
+        for (auto dep: _nodes[last].deps) {
+            if (!found || _nodes[dep].end > _nodes[next].end) {
+                next = dep;
+                found = true;
+            }
+        }
+        last = next;
+    }
+    return ret;
+}
+
+void task_graph::printCriticalPath() const {
+    auto path = criticalPath();
+    if (path.empty()) return;
+    double pathTime = 0;
+    std::string steps;
+    for (auto i: path) {
+        auto &n = _nodes[i];
+        pathTime += n.end - n.start;
+        char step[64];
+        snprintf(step, sizeof(step), " (%.2fs)", n.end - n.start);
+        if (!steps.empty()) steps += " -> ";
+        steps += n.name + step;
+    }
+    double serialTime = 0;
+    for (auto &n: _nodes) serialTime += n.end - n.start;
+    info("Critical path: %s\n", steps.c_str());
+    info("Preparation took %.2fs, %.2fs of it on the critical path, %.2fs if run one after another\n", _wall,
+         pathTime, serialTime);
+}
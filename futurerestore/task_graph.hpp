@@ -0,0 +1,58 @@
+//
+//  task_graph.hpp
+//  futurerestore
+//
+
+#ifndef task_graph_hpp
+#define task_graph_hpp
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <exception>
+#include "stage_report.hpp"
+
+/*
+ * Steps with dependencies between them, every step starts as soon as all of its dependencies are done.
+ * Steps mostly wait on the network or the device, so each one runs on its own thread instead of occupying a
+ * threadpool worker, CPU heavy work inside a step still goes to the shared threadpool.
+ * After the first failure no further steps are started, the ones already running are waited for and the
+ * failure is rethrown.
+ */
+class task_graph {
+public:
+    typedef size_t node_id;
+
+private:
+    struct node {
+        std::string name;
+        std::function<void()> fn;
+        std::vector<node_id> deps;
+        double start;
+        double end;
+        bool started;
+        bool done;
+        bool failed;
+        std::string reason;
+    };
+    std::vector<node> _nodes;
+    double _wall;
+
+public:
+    task_graph() : _wall(0) {}
+    task_graph(const task_graph &) = delete;
+    task_graph &operator=(const task_graph &) = delete;
+
+    //dependencies have to be added before the nodes depending on them
+    node_id add(std::string name, std::function<void()> fn, std::vector<node_id> deps = {});
+
+    //records every finished step in stages, in the order they finished
+    void run(stage_report &stages);
+
+    //the chain of steps that determined the total time, each one waiting for the dependency that finished last
+    std::vector<node_id> criticalPath() const;
+    void printCriticalPath() const;
+};
+
+#endif /* task_graph_hpp */
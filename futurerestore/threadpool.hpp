@@ -0,0 +1,97 @@
+//
+//  threadpool.hpp
+//  futurerestore
+//
+
+#ifndef threadpool_hpp
+#define threadpool_hpp
+
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+
+/*
+ * Fixed size pool of worker threads for CPU bound work (hashing, inflating, ...).
+ * Tasks must not block on other tasks of the same pool.
+ */
+class threadpool {
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _queue;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    bool _stop;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> ul(_lock);
+                _cond.wait(ul, [this] {return _stop || !_queue.empty();});
+                if (_queue.empty()) return;
+                task = std::move(_queue.front());
+                _queue.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit threadpool(size_t threads = 0) : _stop(false) {
+        if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < threads; i++) {
+            _workers.emplace_back(&threadpool::work, this);
+        }
+    }
+
+    threadpool(const threadpool &) = delete;
+    threadpool &operator=(const threadpool &) = delete;
+
+    ~threadpool() {
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _stop = true;
+        }
+        _cond.notify_all();
+        for (auto &worker: _workers) worker.join();
+    }
+
+    size_t size() const {return _workers.size();}
+
+    template<typename F>
+    std::future<typename std::result_of<F()>::type> enqueue(F f) {
+        typedef typename std::result_of<F()>::type ret_t;
+        auto task = std::make_shared<std::packaged_task<ret_t()>>(std::move(f));
+        std::future<ret_t> ret = task->get_future();
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _queue.emplace_back([task] {(*task)();});
+        }
+        _cond.notify_one();
+        return ret;
+    }
+
+    //runs fn(i) for every i in [0, count) and waits for all of them, rethrows the first exception
+    void parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+        std::vector<std::future<void>> results;
+        results.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            results.push_back(enqueue([&fn, i] {fn(i);}));
+        }
+        for (auto &result: results) result.wait();
+        for (auto &result: results) result.get();
+    }
+
+    static threadpool &shared() {
+        static threadpool pool;
+        return pool;
+    }
+};
+
+#endif /* threadpool_hpp */
@@ -0,0 +1,356 @@
+//
+//  zip_directory.cpp
+//  futurerestore
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "zip_directory.hpp"
+
+using namespace tihmstar;
+
+#define ZIP_EOCD_SIGNATURE          0x06054b50
+#define ZIP64_EOCD_LOCATOR_SIG      0x07064b50
+#define ZIP64_EOCD_SIGNATURE        0x06064b50
+#define ZIP_CD_SIGNATURE            0x02014b50
+#define ZIP_LOCAL_SIGNATURE         0x04034b50
+#define ZIP64_EXTRA_ID              0x0001
+
+static inline uint16_t rd16(const char *p) {
+    return (uint16_t) ((uint8_t) p[0] | ((uint8_t) p[1] << 8));
+}
+
+static inline uint32_t rd32(const char *p) {
+    return (uint32_t) rd16(p) | ((uint32_t) rd16(p + 2) << 16);
+}
+
+static inline uint64_t rd64(const char *p) {
+    return (uint64_t) rd32(p) | ((uint64_t) rd32(p + 4) << 32);
+}
+
+bool zip_directory::locateCentralDirectory(const char *tail, size_t tailSize, uint64_t archiveSize,
+                                           uint64_t &cdOffset, uint64_t &cdSize, uint64_t &zip64TailOffset) {
+    retassure(tailSize >= 22 && tailSize <= archiveSize, "zip tail is too short\n");
+    uint64_t tailOffset = archiveSize - tailSize;
+    zip64TailOffset = 0;
+
+    const char *eocd = nullptr;
+    for (const char *p = tail + tailSize - 22; p >= tail; p--) {
+        if (rd32(p) == ZIP_EOCD_SIGNATURE) {
+            eocd = p;
+            break;
+        }
+    }
+    retassure(eocd, "failed to find end of central directory record\n");
+
+    cdSize = rd32(eocd + 12);
+    cdOffset = rd32(eocd + 16);
+    if (cdSize != 0xffffffff && cdOffset != 0xffffffff && rd16(eocd + 10) != 0xffff) return true;
+
+    //zip64
+    retassure(eocd - tail >= 20, "zip64 end of central directory locator is missing\n");
+    const char *locator = eocd - 20;
+    retassure(rd32(locator) == ZIP64_EOCD_LOCATOR_SIG, "zip64 end of central directory locator is missing\n");
+    uint64_t eocd64Offset = rd64(locator + 8);
+    if (eocd64Offset < tailOffset) {
+        zip64TailOffset = eocd64Offset;
+        return false;
+    }
+    const char *eocd64 = tail + (eocd64Offset - tailOffset);
+    retassure(eocd64 + 56 <= tail + tailSize && rd32(eocd64) == ZIP64_EOCD_SIGNATURE,
+              "bad zip64 end of central directory record\n");
+    cdSize = rd64(eocd64 + 40);
+    cdOffset = rd64(eocd64 + 48);
+    return true;
+}
+
+void zip_directory::parseCentralDirectory(const char *cd, size_t cdSize) {
+    const char *p = cd;
+    const char *end = cd + cdSize;
+    _entries.clear();
+    while (end - p >= 46) {
+        retassure(rd32(p) == ZIP_CD_SIGNATURE, "bad central directory entry at offset 0x%zx\n", (size_t) (p - cd));
+        zip_entry entry;
+        entry.compression = rd16(p + 10);
+        entry.crc32 = rd32(p + 16);
+        entry.compressedSize = rd32(p + 20);
+        entry.uncompressedSize = rd32(p + 24);
+        entry.nameLength = rd16(p + 28);
+        entry.extraLength = rd16(p + 30);
+        uint16_t commentLength = rd16(p + 32);
+        entry.localHeaderOffset = rd32(p + 42);
+        retassure(end - p >= 46 + entry.nameLength + entry.extraLength + commentLength,
+                  "truncated central directory\n");
+        entry.name.assign(p + 46, entry.nameLength);
+
+        const char *extra = p + 46 + entry.nameLength;
+        const char *extraEnd = extra + entry.extraLength;
+        while (extraEnd - extra >= 4) {
+            uint16_t id = rd16(extra);
+            uint16_t len = rd16(extra + 2);
+            const char *field = extra + 4;
+            if (field + len > extraEnd) break;
+            if (id == ZIP64_EXTRA_ID) {
+                const char *v = field;
+                if (entry.uncompressedSize == 0xffffffff && v + 8 <= field + len)
+                    entry.uncompressedSize = rd64(v), v += 8;
+                if (entry.compressedSize == 0xffffffff && v + 8 <= field + len)
+                    entry.compressedSize = rd64(v), v += 8;
+                if (entry.localHeaderOffset == 0xffffffff && v + 8 <= field + len)
+                    entry.localHeaderOffset = rd64(v), v += 8;
+            }
+            extra = field + len;
+        }
+
+        p += 46 + entry.nameLength + entry.extraLength + commentLength;
+        _entries[entry.name] = entry;
+    }
+}
+
+void zip_directory::loadFromFile(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    retassure(f, "failed to open %s\n", path.c_str());
+    cleanup([&] {
+        fclose(f);
+    });
+    retassure(!fseeko(f, 0, SEEK_END), "failed to seek in %s\n", path.c_str());
+    auto archiveSize = (uint64_t) ftello(f);
+
+    auto readAt = [&](uint64_t offset, uint64_t length, std::vector<char> &out) {
+        retassure(offset + length <= archiveSize, "zip record out of bounds in %s\n", path.c_str());
+        out.resize(length);
+        retassure(!fseeko(f, (off_t) offset, SEEK_SET) && fread(out.data(), 1, length, f) == length,
+                  "failed to read %s\n", path.c_str());
+    };
+
+    std::vector<char> tail;
+    uint64_t tailSize = std::min<uint64_t>(archiveSize, (uint64_t) maxEOCDSearch);
+    readAt(archiveSize - tailSize, tailSize, tail);
+    uint64_t cdOffset = 0;
+    uint64_t cdSize = 0;
+    uint64_t zip64TailOffset = 0;
+    if (!locateCentralDirectory(tail.data(), tail.size(), archiveSize, cdOffset, cdSize, zip64TailOffset)) {
+        readAt(zip64TailOffset, archiveSize - zip64TailOffset, tail);
+        retassure(locateCentralDirectory(tail.data(), tail.size(), archiveSize, cdOffset, cdSize, zip64TailOffset),
+                  "failed to locate central directory of %s\n", path.c_str());
+    }
+    std::vector<char> cd;
+    readAt(cdOffset, cdSize, cd);
+    parseCentralDirectory(cd.data(), cd.size());
+}
+
+const zip_entry *zip_directory::getEntry(const std::string &name) const {
+    auto it = _entries.find(name);
+    return (it == _entries.end()) ? nullptr : &it->second;
+}
+
+bool zip_directory::matchesLocalHeader(const char *localHeader, size_t size, const zip_entry &entry) {
+    if (size < 30 || rd32(localHeader) != ZIP_LOCAL_SIGNATURE) return false;
+    uint16_t nameLength = rd16(localHeader + 26);
+    return nameLength == entry.nameLength &&
+           (size < 30 + (size_t) nameLength || !memcmp(localHeader + 30, entry.name.data(), nameLength));
+}
+
+uint64_t zip_directory::getDataOffsetFromLocalHeader(const char *localHeader, size_t size, const zip_entry &entry) {
+    retassure(matchesLocalHeader(localHeader, size, entry), "local header does not match central directory entry %s\n",
+              entry.name.c_str());
+    return 30 + (uint64_t) rd16(localHeader + 26) + rd16(localHeader + 28);
+}
+
+//hands out the compressed data in chunks of at most maxSize bytes, chunks stay valid until the next call
+typedef std::function<size_t(const char *&chunk, uint64_t maxSize)> chunk_source;
+
+static void inflateEntryData(const zip_entry &entry, const chunk_source &in,
+                             const std::function<void(const char *, size_t)> &out) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t written = 0;
+
+    if (entry.compression == ZIP_COMPRESSION_STORED) {
+        for (uint64_t off = 0; off < entry.compressedSize;) {
+            const char *chunk = nullptr;
+            size_t have = in(chunk, std::min<uint64_t>(entry.compressedSize - off, 0x40000000));
+            retassure(have, "truncated data for %s\n", entry.name.c_str());
+            crc = crc32(crc, (const Bytef *) chunk, (uInt) have);
+            out(chunk, have);
+            off += have;
+        }
+        written = entry.compressedSize;
+    } else {
+        retassure(entry.compression == ZIP_COMPRESSION_DEFLATE, "unsupported compression method %d for %s\n",
+                  entry.compression, entry.name.c_str());
+        z_stream strm{};
+        retassure(inflateInit2(&strm, -MAX_WBITS) == Z_OK, "inflateInit2 failed\n");
+        cleanup([&] {
+            inflateEnd(&strm);
+        });
+        std::vector<char> buf(0x100000);
+        uint64_t consumed = 0;
+        int zret = Z_OK;
+        bool outputPending = false; //the last call filled buf, inflate may have more without new input
+        while (zret != Z_STREAM_END) {
+            if (!strm.avail_in && !outputPending) {
+                retassure(consumed < entry.compressedSize, "truncated deflate stream for %s\n", entry.name.c_str());
+                const char *chunk = nullptr;
+                size_t have = in(chunk, std::min<uint64_t>(entry.compressedSize - consumed, 0x40000000));
+                retassure(have, "truncated deflate stream for %s\n", entry.name.c_str());
+                strm.next_in = (Bytef *) chunk;
+                strm.avail_in = (uInt) have;
+                consumed += have;
+            }
+            strm.next_out = (Bytef *) buf.data();
+            strm.avail_out = (uInt) buf.size();
+            zret = inflate(&strm, Z_NO_FLUSH);
+            size_t have = buf.size() - strm.avail_out;
+            if (zret == Z_BUF_ERROR && outputPending && !have) {
+                //buf happened to end exactly where the output did, inflate needs more input after all
+                outputPending = false;
+                continue;
+            }
+            retassure(zret == Z_OK || zret == Z_STREAM_END, "inflate failed for %s (%d)\n", entry.name.c_str(), zret);
+            outputPending = !strm.avail_out;
+            crc = crc32(crc, (const Bytef *) buf.data(), (uInt) have);
+            out(buf.data(), have);
+            written += have;
+        }
+    }
+    retassure(written == entry.uncompressedSize, "size mismatch for %s\n", entry.name.c_str());
+    retassure(crc == entry.crc32, "CRC-32 mismatch for %s\n", entry.name.c_str());
+}
+
+static void inflateEntryData(const zip_entry &entry, const char *data, size_t dataSize,
+                             const std::function<void(const char *, size_t)> &out) {
+    retassure(dataSize >= entry.compressedSize, "short data for %s\n", entry.name.c_str());
+    uint64_t consumed = 0;
+    inflateEntryData(entry, [&](const char *&chunk, uint64_t maxSize) -> size_t {
+        chunk = data + consumed;
+        consumed += maxSize;
+        return (size_t) maxSize;
+    }, out);
+}
+
+/*
+ * Reads a range of a file on a separate thread, a few blocks ahead of whoever consumes them,
+ * so reading from disk overlaps with inflating and writing.
+ */
+class readahead_reader {
+    static const size_t blockSize = 0x400000;
+    static const size_t maxBlocks = 4;
+
+    FILE *_f;
+    uint64_t _remaining;
+    std::deque<std::vector<char>> _ready;
+    std::vector<std::vector<char>> _spare;
+    std::vector<char> _current;
+    bool _done;
+    bool _failed;
+    bool _stop;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::thread _thread;
+
+    void read() {
+        std::unique_lock<std::mutex> ul(_lock);
+        while (true) {
+            _cond.wait(ul, [this] {return _stop || _ready.size() < maxBlocks;});
+            if (_stop || !_remaining) break;
+            std::vector<char> buf;
+            if (!_spare.empty()) {
+                buf.swap(_spare.back());
+                _spare.pop_back();
+            }
+            buf.resize((size_t) std::min<uint64_t>(_remaining, (uint64_t) blockSize));
+            ul.unlock();
+            bool ok = fread(buf.data(), 1, buf.size(), _f) == buf.size();
+            ul.lock();
+            if (!ok) {
+                _failed = true;
+                break;
+            }
+            _remaining -= buf.size();
+            _ready.push_back(std::move(buf));
+            _cond.notify_all();
+        }
+        _done = true;
+        _cond.notify_all();
+    }
+
+public:
+    readahead_reader(FILE *f, uint64_t size)
+            : _f(f), _remaining(size), _done(false), _failed(false), _stop(false),
+              _thread(&readahead_reader::read, this) {}
+
+    ~readahead_reader() {
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _stop = true;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+
+    //the previous chunk is recycled, returns 0 once the range is exhausted
+    size_t next(const char *&chunk) {
+        std::unique_lock<std::mutex> ul(_lock);
+        if (!_current.empty()) {
+            _spare.emplace_back();
+            _spare.back().swap(_current);
+        }
+        _cond.wait(ul, [this] {return !_ready.empty() || _done;});
+        if (_ready.empty()) {
+            retassure(!_failed, "failed to read zip data\n");
+            return 0;
+        }
+        _current.swap(_ready.front());
+        _ready.pop_front();
+        _cond.notify_all();
+        chunk = _current.data();
+        return _current.size();
+    }
+};
+
+void zip_directory::extractEntryData(const zip_entry &entry, const char *data, size_t dataSize, FILE *out) {
+    inflateEntryData(entry, data, dataSize, [&](const char *buf, size_t size) {
+        retassure(fwrite(buf, 1, size, out) == size, "failed to write %s\n", entry.name.c_str());
+    });
+}
+
+void zip_directory::verifyEntryData(const zip_entry &entry, const char *data, size_t dataSize) {
+    inflateEntryData(entry, data, dataSize, [](const char *, size_t) {});
+}
+
+void zip_directory::extractEntryFromFile(const std::string &archivePath, const zip_entry &entry,
+                                         const std::function<void(const char *, size_t)> &out) {
+    FILE *f = fopen(archivePath.c_str(), "rb");
+    retassure(f, "failed to open %s\n", archivePath.c_str());
+    cleanup([&] {
+        fclose(f);
+    });
+    char localHeader[30];
+    retassure(!fseeko(f, (off_t) entry.localHeaderOffset, SEEK_SET) &&
+              fread(localHeader, 1, sizeof(localHeader), f) == sizeof(localHeader),
+              "failed to read local header of %s\n", entry.name.c_str());
+    uint64_t dataOffset = getDataOffsetFromLocalHeader(localHeader, sizeof(localHeader), entry);
+    retassure(!fseeko(f, (off_t) (entry.localHeaderOffset + dataOffset), SEEK_SET),
+              "failed to seek to %s\n", entry.name.c_str());
+
+    readahead_reader reader(f, entry.compressedSize);
+    inflateEntryData(entry, [&](const char *&chunk, uint64_t) {
+        return reader.next(chunk);
+    }, out);
+}
+
+std::vector<char> zip_directory::extractEntryData(const zip_entry &entry, const char *data, size_t dataSize) {
+    std::vector<char> ret;
+    ret.reserve(entry.uncompressedSize);
+    inflateEntryData(entry, data, dataSize, [&](const char *buf, size_t size) {
+        ret.insert(ret.end(), buf, buf + size);
+    });
+    return ret;
+}
@@ -0,0 +1,77 @@
+//
+//  zip_directory.hpp
+//  futurerestore
+//
+
+#ifndef zip_directory_hpp
+#define zip_directory_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+#define ZIP_COMPRESSION_STORED      0
+#define ZIP_COMPRESSION_DEFLATE     8
+
+struct zip_entry {
+    std::string name;
+    uint64_t localHeaderOffset;
+    uint64_t compressedSize;
+    uint64_t uncompressedSize;
+    uint32_t crc32;
+    uint16_t compression;
+    uint16_t nameLength;
+    uint16_t extraLength;
+    zip_entry() : localHeaderOffset(0), compressedSize(0), uncompressedSize(0), crc32(0), compression(0),
+                  nameLength(0), extraLength(0) {}
+
+    //upper bound of bytes from the local header to the end of the data, assuming local and central extra fields match
+    uint64_t estimatedRecordSize() const {return 30 + nameLength + extraLength + compressedSize;}
+};
+
+/*
+ * Parsed central directory of a zip archive (with zip64 support).
+ * Only knows about the bytes it is given, so it can be fed from a local file, a mapping or ranged HTTP requests.
+ */
+class zip_directory {
+    std::unordered_map<std::string, zip_entry> _entries;
+
+public:
+    static const size_t maxEOCDSearch = 0xffff + 22 + 20; //max comment + EOCD + zip64 locator
+
+    /*
+     * Locates the central directory in the last bytes of the archive.
+     * Returns false if the tail is too short to reach a zip64 record, in which case
+     * zip64TailOffset holds the absolute offset the tail has to start at.
+     */
+    static bool locateCentralDirectory(const char *tail, size_t tailSize, uint64_t archiveSize,
+                                       uint64_t &cdOffset, uint64_t &cdSize, uint64_t &zip64TailOffset);
+
+    void parseCentralDirectory(const char *cd, size_t cdSize);
+    //reads and parses the central directory of a zip on disk
+    void loadFromFile(const std::string &path);
+
+    size_t size() const {return _entries.size();}
+    const std::unordered_map<std::string, zip_entry> &entries() const {return _entries;}
+    const zip_entry *getEntry(const std::string &name) const;
+
+    //whether the local header belongs to entry, only compares as much of the name as size covers
+    static bool matchesLocalHeader(const char *localHeader, size_t size, const zip_entry &entry);
+
+    //offset of the entry data relative to the start of the local header
+    static uint64_t getDataOffsetFromLocalHeader(const char *localHeader, size_t size, const zip_entry &entry);
+
+    //inflates (or copies, for stored entries) the compressed data and checks its CRC-32
+    static void extractEntryData(const zip_entry &entry, const char *data, size_t dataSize, FILE *out);
+    static std::vector<char> extractEntryData(const zip_entry &entry, const char *data, size_t dataSize);
+    //inflates the entry without keeping the output, only to check its size and CRC-32
+    static void verifyEntryData(const zip_entry &entry, const char *data, size_t dataSize);
+    //streams the entry out of a zip on disk, reading ahead of the inflater on a separate thread
+    static void extractEntryFromFile(const std::string &archivePath, const zip_entry &entry,
+                                     const std::function<void(const char *, size_t)> &out);
+};
+
+#endif /* zip_directory_hpp */